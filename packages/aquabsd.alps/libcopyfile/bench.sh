@@ -0,0 +1,26 @@
+#!/bin/sh
+set -e
+
+# build & run the libcopyfile benchmark suite
+# all arguments are passed on to the benchmark itself (run with '-h' for usage), e.g.:
+#
+#   sh bench.sh > baseline.json
+#   sh bench.sh -b baseline.json # exits with an error if anything regressed
+
+BUILD_DIR=".build/bench/"
+
+rm -rf $BUILD_DIR
+mkdir -p $BUILD_DIR
+
+# the benchmark counts the syscalls libcopyfile makes by wrapping them at link time
+
+WRAP=""
+
+for syscall in open close read write pread pwrite lseek fstat fstatfs ftruncate fchmod copy_file_range; do
+	WRAP="$WRAP -Wl,--wrap=$syscall"
+done
+
+cc -Wall -std=c99 -O2 -pthread -c src/copyfile.c -o $BUILD_DIR/copyfile.o
+cc -Wall -std=c99 -O2 -pthread src/bench.c $BUILD_DIR/copyfile.o $WRAP -o $BUILD_DIR/bench
+
+$BUILD_DIR/bench "$@"
@@ -8,6 +8,7 @@ mkdir -p $BUILD_DIR/package/usr/
 
 # create package directories
 
+mkdir $BUILD_DIR/package/usr/bin/
 mkdir $BUILD_DIR/package/usr/lib/
 mkdir $BUILD_DIR/package/usr/include/
 
@@ -15,12 +16,14 @@ cp src/copyfile.h $BUILD_DIR/package/usr/include/
 
 # build the package files
 
-cc -Wall -std=c99 -fPIC -c src/copyfile.c -o $BUILD_DIR/copyfile.o
-cc -shared $BUILD_DIR/copyfile.o -o $BUILD_DIR/package/usr/lib/libcopyfile.so
+cc -Wall -std=c99 -fPIC -pthread -c src/copyfile.c -o $BUILD_DIR/copyfile.o
+cc -shared -pthread $BUILD_DIR/copyfile.o -o $BUILD_DIR/package/usr/lib/libcopyfile.so
 
 ar rc $BUILD_DIR/package/usr/lib/libcopyfile.a $BUILD_DIR/copyfile.o
 ranlib $BUILD_DIR/package/usr/lib/libcopyfile.a
 
+cc -Wall -std=c99 -pthread src/main.c $BUILD_DIR/copyfile.o -o $BUILD_DIR/package/usr/bin/copyfile
+
 # create the package tarball
 
 pkg create -M manifest.json -p plist -r $BUILD_DIR/package
@@ -0,0 +1,643 @@
+// benchmark suite for libcopyfile
+// generates a few reproducible synthetic workloads and times copying them through each copy engine
+// results are written as JSON, and can be compared against a previous run with '-b' to catch regressions
+//
+// this is meant to be built by 'bench.sh', which links it with '--wrap' on the I/O syscalls libcopyfile uses, so that they can be counted
+
+#include <sys/cdefs.h>
+__FBSDID("$FreeBSD$");
+
+#include "copyfile.h"
+
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <fts.h>
+#include <inttypes.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sys/param.h>
+#include <sys/mount.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+
+// syscall counting
+// each of these is linked in place of the real libc function with '-Wl,--wrap=<name>'
+
+static uint64_t syscalls = 0;
+
+#define WRAP(ret, name, params, args) \
+	ret __real_##name params; \
+	ret __wrap_##name params; \
+	ret __wrap_##name params { \
+		syscalls++; \
+		return __real_##name args; \
+	}
+
+WRAP(int, close, (int fd), (fd))
+WRAP(ssize_t, read, (int fd, void* buf, size_t len), (fd, buf, len))
+WRAP(ssize_t, write, (int fd, const void* buf, size_t len), (fd, buf, len))
+WRAP(ssize_t, pread, (int fd, void* buf, size_t len, off_t off), (fd, buf, len, off))
+WRAP(ssize_t, pwrite, (int fd, const void* buf, size_t len, off_t off), (fd, buf, len, off))
+WRAP(off_t, lseek, (int fd, off_t off, int whence), (fd, off, whence))
+WRAP(int, fstat, (int fd, struct stat* sb), (fd, sb))
+WRAP(int, fstatfs, (int fd, struct statfs* sfs), (fd, sfs))
+WRAP(int, ftruncate, (int fd, off_t len), (fd, len))
+WRAP(int, fchmod, (int fd, mode_t mode), (fd, mode))
+WRAP(ssize_t, copy_file_range, (int in_fd, off_t* in_off, int out_fd, off_t* out_off, size_t len, unsigned flags), (in_fd, in_off, out_fd, out_off, len, flags))
+
+#undef WRAP
+
+// 'open' is variadic, so it can't go through 'WRAP'
+
+int __real_open(const char* path, int flags, ...);
+int __wrap_open(const char* path, int flags, ...);
+
+int __wrap_open(const char* path, int flags, ...) {
+	mode_t mode = 0;
+
+	if (flags & O_CREAT) {
+		va_list args;
+		va_start(args, flags);
+		mode = va_arg(args, int);
+		va_end(args);
+	}
+
+	syscalls++;
+	return __real_open(path, flags, mode);
+}
+
+static void __dead2 usage(void) {
+	fprintf(stderr,
+		"usage: %1$s [-d dir] [-e engine] [-r runs] [-s huge_mib] [-w workload] [-b baseline.json [-t threshold]]\n",
+	getprogname());
+
+	exit(EXIT_FAILURE);
+}
+
+typedef struct {
+	char* dir;
+
+	char* engine;   // only run this engine (all if NULL)
+	char* workload; // only run this workload (all if NULL)
+
+	int runs;
+	off_t huge_size;
+
+	char* baseline;
+	double threshold; // in percent
+} opts_t;
+
+// copy engines
+
+typedef struct {
+	const char* name;
+	copyfile_flags_t flags;
+} engine_t;
+
+static engine_t engines[] = {
+	{ "readwrite", COPYFILE_DATA },
+	{ "clone",     COPYFILE_DATA | COPYFILE_CLONE },
+	{ "sparse",    COPYFILE_DATA | COPYFILE_DATA_SPARSE },
+};
+
+// workloads
+// all file contents come from a fixed-seed PRNG, so that every run copies exactly the same data
+
+typedef struct {
+	const char* name;
+
+	size_t files_len;
+	char** files; // relative to the workload's root
+
+	size_t dirs_len;
+	char** dirs; // in creation order
+
+	off_t bytes; // total apparent size of all files
+} workload_t;
+
+static uint64_t prng_state;
+
+static uint64_t __prng(void) {
+	// xorshift64*
+
+	prng_state ^= prng_state >> 12;
+	prng_state ^= prng_state << 25;
+	prng_state ^= prng_state >> 27;
+
+	return prng_state * 0x2545f4914f6cdd1dull;
+}
+
+static void __add(char*** list_ref, size_t* len_ref, const char* path) {
+	char** list = realloc(*list_ref, (*len_ref + 1) * sizeof *list);
+
+	if (!list || !(list[*len_ref] = strdup(path))) {
+		err(EXIT_FAILURE, "allocating workload");
+	}
+
+	(*len_ref)++;
+	*list_ref = list;
+}
+
+// write 'len' bytes of pseudo-random data at 'off' in 'path' (which is created if it doesn't exist yet)
+
+static void __fill(const char* root, const char* path, off_t off, off_t len) {
+	char full[MAXPATHLEN];
+	snprintf(full, sizeof full, "%s/%s", root, path);
+
+	int fd = open(full, O_WRONLY | O_CREAT, 0644);
+
+	if (fd < 0) {
+		err(EXIT_FAILURE, "open(%s)", full);
+	}
+
+	static uint64_t buf[64 * 1024 / sizeof(uint64_t)];
+
+	while (len > 0) {
+		for (size_t i = 0; i < nitems(buf); i++) {
+			buf[i] = __prng();
+		}
+
+		size_t chunk = MIN((off_t) sizeof buf, len);
+
+		if (pwrite(fd, buf, chunk, off) != (ssize_t) chunk) {
+			err(EXIT_FAILURE, "pwrite(%s)", full);
+		}
+
+		off += chunk;
+		len -= chunk;
+	}
+
+	close(fd);
+}
+
+static void __mkdir(const char* root, const char* path) {
+	char full[MAXPATHLEN];
+	snprintf(full, sizeof full, "%s/%s", root, path);
+
+	if (mkdir(full, 0755) < 0 && errno != EEXIST) {
+		err(EXIT_FAILURE, "mkdir(%s)", full);
+	}
+}
+
+// a single huge file
+
+static void __gen_huge(workload_t* workload, const char* root, opts_t* opts) {
+	__add(&workload->files, &workload->files_len, "huge");
+	__fill(root, "huge", 0, opts->huge_size);
+
+	workload->bytes = opts->huge_size;
+}
+
+// many tiny files (10000 files between 1 B & 8 KiB) in one directory
+
+static void __gen_tiny(workload_t* workload, const char* root, opts_t* opts) {
+	for (int i = 0; i < 10000; i++) {
+		char path[32];
+		snprintf(path, sizeof path, "tiny%05d", i);
+
+		off_t size = 1 + __prng() % (8 * 1024);
+
+		__add(&workload->files, &workload->files_len, path);
+		__fill(root, path, 0, size);
+
+		workload->bytes += size;
+	}
+}
+
+// a 1 GiB sparse disk image, with 1 MiB of data every 64 MiB (like a freshly formatted file system image)
+
+static void __gen_sparse(workload_t* workload, const char* root, opts_t* opts) {
+	off_t const size = 1024ll * 1024 * 1024;
+
+	__add(&workload->files, &workload->files_len, "sparse.img");
+
+	for (off_t off = 0; off < size; off += 64 * 1024 * 1024) {
+		__fill(root, "sparse.img", off, 1024 * 1024);
+	}
+
+	char full[MAXPATHLEN];
+	snprintf(full, sizeof full, "%s/sparse.img", root);
+
+	if (truncate(full, size) < 0) {
+		err(EXIT_FAILURE, "truncate(%s)", full);
+	}
+
+	workload->bytes = size;
+}
+
+// a deep directory tree: 32 levels deep, each level having 4 subdirectories (only one of which continues deeper) & 8 small files
+
+static void __gen_tree(workload_t* workload, const char* root, opts_t* opts) {
+	char path[MAXPATHLEN] = "";
+
+	for (int depth = 0; depth < 32; depth++) {
+		char sub[MAXPATHLEN];
+
+		for (int i = 0; i < 4; i++) {
+			snprintf(sub, sizeof sub, "%s%sd%d", path, *path ? "/" : "", i);
+
+			__add(&workload->dirs, &workload->dirs_len, sub);
+			__mkdir(root, sub);
+		}
+
+		for (int i = 0; i < 8; i++) {
+			char file[MAXPATHLEN];
+			snprintf(file, sizeof file, "%s%sf%d", path, *path ? "/" : "", i);
+
+			off_t size = __prng() % (32 * 1024);
+
+			__add(&workload->files, &workload->files_len, file);
+			__fill(root, file, 0, size);
+
+			workload->bytes += size;
+		}
+
+		snprintf(path + strlen(path), sizeof path - strlen(path), "%sd0", *path ? "/" : "");
+	}
+}
+
+typedef void (*gen_t) (workload_t* workload, const char* root, opts_t* opts);
+
+static struct {
+	const char* name;
+	gen_t gen;
+} gens[] = {
+	{ "huge",   __gen_huge },
+	{ "tiny",   __gen_tiny },
+	{ "sparse", __gen_sparse },
+	{ "tree",   __gen_tree },
+};
+
+// running & timing
+
+typedef struct {
+	const char* workload;
+	const char* engine;
+
+	off_t bytes;
+	size_t files;
+
+	double seconds;
+	double cpu_seconds;
+	uint64_t syscalls;
+} result_t;
+
+static double __now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static double __cpu(void) {
+	struct rusage ru;
+	getrusage(RUSAGE_SELF, &ru);
+
+	return ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6 +
+		ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6;
+}
+
+static void __rm_rf(const char* path) {
+	char* const roots[] = { (char*) path, NULL };
+	FTS* const fts = fts_open(roots, FTS_PHYSICAL | FTS_NOCHDIR, NULL);
+
+	if (!fts) {
+		err(EXIT_FAILURE, "fts_open(%s)", path);
+	}
+
+	FTSENT* ent;
+
+	while ((ent = fts_read(fts))) {
+		switch (ent->fts_info) {
+		case FTS_D:
+			break; // removed on the way back up, once empty
+
+		case FTS_DP:
+			if (rmdir(ent->fts_accpath) < 0) {
+				err(EXIT_FAILURE, "rmdir(%s)", ent->fts_path);
+			}
+
+			break;
+
+		case FTS_NS:
+			if (ent->fts_errno == ENOENT && ent->fts_level == FTS_ROOTLEVEL) {
+				break; // nothing to remove yet
+			}
+
+			// FALLTHROUGH
+
+		case FTS_DNR:
+		case FTS_ERR:
+			errx(EXIT_FAILURE, "%s: %s", ent->fts_path, strerror(ent->fts_errno));
+
+		default:
+			if (unlink(ent->fts_accpath) < 0) {
+				err(EXIT_FAILURE, "unlink(%s)", ent->fts_path);
+			}
+		}
+	}
+
+	if (errno) {
+		err(EXIT_FAILURE, "fts_read(%s)", path);
+	}
+
+	fts_close(fts);
+}
+
+static void __run(workload_t* workload, engine_t* engine, const char* src_root, const char* dst_root, result_t* result) {
+	__rm_rf(dst_root);
+	__mkdir(dst_root, "");
+
+	for (size_t i = 0; i < workload->dirs_len; i++) {
+		__mkdir(dst_root, workload->dirs[i]);
+	}
+
+	uint64_t syscalls_before = syscalls;
+	double cpu_before = __cpu();
+	double before = __now();
+
+	for (size_t i = 0; i < workload->files_len; i++) {
+		char src[MAXPATHLEN];
+		char dst[MAXPATHLEN];
+
+		snprintf(src, sizeof src, "%s/%s", src_root, workload->files[i]);
+		snprintf(dst, sizeof dst, "%s/%s", dst_root, workload->files[i]);
+
+		if (copyfile(src, dst, NULL, engine->flags) < 0) {
+			err(EXIT_FAILURE, "copyfile(%s, %s) with engine %s", src, dst, engine->name);
+		}
+	}
+
+	result->seconds = __now() - before;
+	result->cpu_seconds = __cpu() - cpu_before;
+	result->syscalls = syscalls - syscalls_before;
+
+	result->bytes = workload->bytes;
+	result->files = workload->files_len;
+}
+
+static int __cmp_result(const void* _a, const void* _b) {
+	const result_t* a = _a;
+	const result_t* b = _b;
+
+	return (a->seconds > b->seconds) - (a->seconds < b->seconds);
+}
+
+// baseline comparison
+// we only ever need to read back our own output, which has one result per line, so there's no need for a real JSON parser
+
+typedef struct {
+	char workload[32];
+	char engine[32];
+
+	double mb_per_s;
+	double files_per_s;
+	uint64_t syscalls;
+} baseline_t;
+
+static size_t __read_baseline(const char* path, baseline_t** baseline_ref) {
+	FILE* fp = fopen(path, "r");
+
+	if (!fp) {
+		err(EXIT_FAILURE, "fopen(%s)", path);
+	}
+
+	baseline_t* baseline = NULL;
+	size_t baseline_len = 0;
+
+	char line[1024];
+
+	while (fgets(line, sizeof line, fp)) {
+		baseline_t entry;
+
+		char* workload = strstr(line, "\"workload\": \"");
+		char* engine = strstr(line, "\"engine\": \"");
+		char* mb_per_s = strstr(line, "\"mb_per_s\": ");
+		char* files_per_s = strstr(line, "\"files_per_s\": ");
+		char* entry_syscalls = strstr(line, "\"syscalls\": ");
+
+		if (!workload || !engine || !mb_per_s || !files_per_s || !entry_syscalls) {
+			continue;
+		}
+
+		if (
+			sscanf(workload, "\"workload\": \"%31[^\"]", entry.workload) != 1 ||
+			sscanf(engine, "\"engine\": \"%31[^\"]", entry.engine) != 1 ||
+			sscanf(mb_per_s, "\"mb_per_s\": %lf", &entry.mb_per_s) != 1 ||
+			sscanf(files_per_s, "\"files_per_s\": %lf", &entry.files_per_s) != 1 ||
+			sscanf(entry_syscalls, "\"syscalls\": %" SCNu64, &entry.syscalls) != 1
+		) {
+			continue;
+		}
+
+		baseline = realloc(baseline, (baseline_len + 1) * sizeof *baseline);
+
+		if (!baseline) {
+			err(EXIT_FAILURE, "realloc");
+		}
+
+		baseline[baseline_len++] = entry;
+	}
+
+	fclose(fp);
+
+	*baseline_ref = baseline;
+	return baseline_len;
+}
+
+static double __delta(double now, double then) {
+	return then ? (now - then) / then * 100 : 0;
+}
+
+int main(int argc, char* argv[]) {
+	// options
+
+	opts_t opts = {
+		.runs = 3,
+		.huge_size = 256ll * 1024 * 1024,
+		.threshold = 10,
+	};
+
+	// get options
+
+	int c;
+
+	while ((c = getopt(argc, argv, "b:d:e:r:s:t:w:")) >= 0) {
+		if (c == 'b') {
+			opts.baseline = optarg;
+		}
+
+		else if (c == 'd') {
+			opts.dir = optarg;
+		}
+
+		else if (c == 'e') {
+			opts.engine = optarg;
+		}
+
+		else if (c == 'r') {
+			opts.runs = atoi(optarg);
+		}
+
+		else if (c == 's') {
+			opts.huge_size = strtoll(optarg, NULL, 0) * 1024 * 1024;
+		}
+
+		else if (c == 't') {
+			opts.threshold = strtod(optarg, NULL);
+		}
+
+		else if (c == 'w') {
+			opts.workload = optarg;
+		}
+
+		else {
+			usage();
+		}
+	}
+
+	if (opts.runs < 1 || opts.huge_size <= 0) {
+		usage();
+	}
+
+	// set up scratch directory
+
+	char scratch[MAXPATHLEN];
+
+	if (opts.dir) {
+		snprintf(scratch, sizeof scratch, "%s/copyfile-bench.XXXXXX", opts.dir);
+	}
+
+	else {
+		char* tmpdir = getenv("TMPDIR");
+		snprintf(scratch, sizeof scratch, "%s/copyfile-bench.XXXXXX", tmpdir ? tmpdir : "/tmp");
+	}
+
+	if (!mkdtemp(scratch)) {
+		err(EXIT_FAILURE, "mkdtemp(%s)", scratch);
+	}
+
+	baseline_t* baseline = NULL;
+	size_t baseline_len = 0;
+
+	if (opts.baseline) {
+		baseline_len = __read_baseline(opts.baseline, &baseline);
+	}
+
+	bool regressed = false;
+	bool first = true;
+
+	printf("{\n\t\"results\": [\n");
+
+	for (size_t i = 0; i < nitems(gens); i++) {
+		if (opts.workload && strcmp(opts.workload, gens[i].name)) {
+			continue;
+		}
+
+		// generate workload (always from the same seed)
+
+		workload_t workload = { .name = gens[i].name };
+		prng_state = 0x6161717561425344ull;
+
+		char src_root[MAXPATHLEN];
+		char dst_root[MAXPATHLEN];
+
+		snprintf(src_root, sizeof src_root, "%s/%s.src", scratch, workload.name);
+		snprintf(dst_root, sizeof dst_root, "%s/%s.dst", scratch, workload.name);
+
+		__mkdir(src_root, "");
+		gens[i].gen(&workload, src_root, &opts);
+
+		for (size_t j = 0; j < nitems(engines); j++) {
+			engine_t* engine = &engines[j];
+
+			if (opts.engine && strcmp(opts.engine, engine->name)) {
+				continue;
+			}
+
+			// run a few times & keep the median
+
+			result_t* runs = calloc(opts.runs, sizeof *runs);
+
+			if (!runs) {
+				err(EXIT_FAILURE, "calloc");
+			}
+
+			for (int k = 0; k < opts.runs; k++) {
+				__run(&workload, engine, src_root, dst_root, &runs[k]);
+			}
+
+			qsort(runs, opts.runs, sizeof *runs, __cmp_result);
+			result_t* result = &runs[opts.runs / 2];
+
+			double mb_per_s = result->seconds > 0 ? result->bytes / result->seconds / 1e6 : 0;
+			double files_per_s = result->seconds > 0 ? result->files / result->seconds : 0;
+
+			printf("%s\t\t{ \"workload\": \"%s\", \"engine\": \"%s\", \"bytes\": %jd, \"files\": %zu, \"seconds\": %.6f, \"mb_per_s\": %.2f, \"files_per_s\": %.2f, \"syscalls\": %" PRIu64 ", \"cpu_seconds\": %.6f",
+				first ? "" : ",\n", workload.name, engine->name, (intmax_t) result->bytes, result->files, result->seconds, mb_per_s, files_per_s, result->syscalls, result->cpu_seconds);
+
+			first = false;
+
+			// compare against baseline
+			// a regression is throughput dropping, or the number of syscalls growing, by more than the threshold
+
+			for (size_t k = 0; k < baseline_len; k++) {
+				baseline_t* entry = &baseline[k];
+
+				if (strcmp(entry->workload, workload.name) || strcmp(entry->engine, engine->name)) {
+					continue;
+				}
+
+				double mb_per_s_delta = __delta(mb_per_s, entry->mb_per_s);
+				double files_per_s_delta = __delta(files_per_s, entry->files_per_s);
+				double syscalls_delta = __delta(result->syscalls, entry->syscalls);
+
+				bool regression =
+					mb_per_s_delta < -opts.threshold ||
+					files_per_s_delta < -opts.threshold ||
+					syscalls_delta > opts.threshold;
+
+				regressed |= regression;
+
+				printf(", \"baseline\": { \"mb_per_s_delta_pct\": %.2f, \"files_per_s_delta_pct\": %.2f, \"syscalls_delta_pct\": %.2f, \"regression\": %s }",
+					mb_per_s_delta, files_per_s_delta, syscalls_delta, regression ? "true" : "false");
+
+				break;
+			}
+
+			printf(" }");
+			fflush(stdout);
+
+			free(runs);
+		}
+
+		__rm_rf(src_root);
+		__rm_rf(dst_root);
+
+		for (size_t j = 0; j < workload.files_len; j++) {
+			free(workload.files[j]);
+		}
+
+		for (size_t j = 0; j < workload.dirs_len; j++) {
+			free(workload.dirs[j]);
+		}
+
+		free(workload.files);
+		free(workload.dirs);
+	}
+
+	printf("\n\t]\n}\n");
+
+	__rm_rf(scratch);
+	free(baseline);
+
+	return regressed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
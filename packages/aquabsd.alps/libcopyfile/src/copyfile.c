@@ -22,6 +22,7 @@
 */
 
 #include <err.h>
+#include <limits.h>
 #include <errno.h>
 #include <sys/types.h>
 #include <stdio.h>
@@ -37,6 +38,7 @@
 #include <sys/syscall.h>
 #include <sys/param.h>
 #include <sys/mount.h>
+#include <pthread.h>
 
 #include "copyfile.h"
 
@@ -57,6 +59,7 @@ struct _copyfile_state
 	int dst_fd;
 	struct stat sb;
 	copyfile_flags_t flags;
+	off_t totalCopied;
 	void *stats;
 	uint32_t debug;
 	void *callbacks;
@@ -69,7 +72,9 @@ struct _copyfile_state
 static int copyfile_open	(copyfile_state_t);
 static int copyfile_close	(copyfile_state_t);
 static int copyfile_data	(copyfile_state_t);
+static int copyfile_data_sparse(copyfile_state_t);
 static int copyfile_stat	(copyfile_state_t);
+static int copyfile_range_data(copyfile_state_t, int, off_t, int, off_t, off_t);
 
 static int copyfile_preamble(copyfile_state_t *s, copyfile_flags_t flags);
 static int copyfile_internal(copyfile_state_t state, copyfile_flags_t flags);
@@ -77,6 +82,16 @@ static int copyfile_internal(copyfile_state_t state, copyfile_flags_t flags);
 #define COPYFILE_DEBUG (1<<31)
 #define COPYFILE_DEBUG_VAR "COPYFILE_DEBUG"
 
+/*
+* copy_file_range(2) appeared in FreeBSD 13.0.  It lets
+* the kernel do the copy without bouncing the data through userland,
+* and lets file systems which support it (e.g. ZFS block cloning) share
+* the blocks outright instead of copying them.
+*/
+#if defined(__FreeBSD_version) && __FreeBSD_version >= 1300037
+# define COPYFILE_HAVE_COPY_FILE_RANGE
+#endif
+
 #ifndef _COPYFILE_TEST
 # define copyfile_warn(str, ...) syslog(LOG_WARNING, str ": %m", ## __VA_ARGS__)
 # define copyfile_debug(d, str, ...) \
@@ -231,6 +246,265 @@ error_exit:
 	goto exit;
 }
 
+/*
+* copyfile_range() copies a region of one file descriptor to a (possibly
+* different) region of another.  Unlike fcopyfile(), it doesn't look at
+* or change the descriptors' offsets, metadata, or the destination's
+* size beyond the end of the copied region, so it can be used to splice
+* chunks between files without reading either of them whole.
+*/
+int copyfile_range(int src_fd, off_t src_off, int dst_fd, off_t dst_off, off_t len, copyfile_state_t state, copyfile_flags_t flags)
+{
+	int ret = 0;
+	copyfile_state_t s = state;
+
+	if (src_fd < 0 || dst_fd < 0 || src_off < 0 || dst_off < 0 || len < 0)
+	{
+	errno = EINVAL;
+	return -1;
+	}
+
+	if (copyfile_preamble(&s, flags) < 0)
+	return -1;
+
+	copyfile_debug(2, "copying %jd bytes from %d@%jd to %d@%jd", (intmax_t)len,
+		src_fd, (intmax_t)src_off, dst_fd, (intmax_t)dst_off);
+
+	ret = copyfile_range_data(s, src_fd, src_off, dst_fd, dst_off, len);
+
+	if (state == NULL)
+	copyfile_state_free(s);
+
+	return ret;
+}
+
+/*
+* fcopyfile_fanout() copies one source to several destinations while
+* reading the source only once.  The source is read (in the calling
+* thread) into a ring of COPYFILE_FANOUT_SLOTS buffers, and every
+* destination gets a writer thread which works its way through the ring
+* at its own pace.  A slot can only be refilled once every destination
+* has written it out, which bounds how far ahead of the slowest
+* destination the others can get.
+*
+* tee(2)/splice(2) would let pipes skip the ring altogether, but they
+* are Linux-only; on aquaBSD everything goes through the ring.
+*/
+#define COPYFILE_FANOUT_SLOTS	8
+#define COPYFILE_FANOUT_CHUNK	(1024 * 1024)
+
+struct _copyfile_fanout_slot
+{
+	char *buf;
+	ssize_t len;
+	int pending;		/* destinations which haven't written this slot yet */
+};
+
+struct _copyfile_fanout
+{
+	pthread_mutex_t lock;
+	pthread_cond_t filled;	/* signalled when the reader fills a slot */
+	pthread_cond_t drained;	/* signalled when a slot is free again */
+	struct _copyfile_fanout_slot slots[COPYFILE_FANOUT_SLOTS];
+	uint64_t nfilled;	/* chunks read so far */
+	int eof;
+};
+
+struct _copyfile_fanout_writer
+{
+	struct _copyfile_fanout *f;
+	pthread_t thread;
+	int fd;
+	int error;		/* errno of the first failed write, 0 if none */
+};
+
+static void *copyfile_fanout_writer(void *arg)
+{
+	struct _copyfile_fanout_writer *w = arg;
+	struct _copyfile_fanout *f = w->f;
+	uint64_t next;
+
+	for (next = 0;; next++)
+	{
+	struct _copyfile_fanout_slot *slot = &f->slots[next % COPYFILE_FANOUT_SLOTS];
+	char *ptr;
+	size_t left;
+
+	pthread_mutex_lock(&f->lock);
+	while (f->nfilled <= next && !f->eof)
+		pthread_cond_wait(&f->filled, &f->lock);
+	if (f->nfilled <= next)
+	{
+		pthread_mutex_unlock(&f->lock);
+		break;
+	}
+	pthread_mutex_unlock(&f->lock);
+
+	/*
+	* Once a destination has failed, keep draining slots without
+	* writing them so that it doesn't hold up the others.
+	*/
+	for (ptr = slot->buf, left = slot->len; !w->error && left > 0;)
+	{
+		ssize_t nwritten = write(w->fd, ptr, left);
+
+		if (nwritten < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			w->error = errno;
+			break;
+		}
+
+		left -= nwritten;
+		ptr += nwritten;
+	}
+
+	pthread_mutex_lock(&f->lock);
+	if (--slot->pending == 0)
+		pthread_cond_signal(&f->drained);
+	pthread_mutex_unlock(&f->lock);
+	}
+
+	return NULL;
+}
+
+int fcopyfile_fanout(int src_fd, const int *dst_fds, int dst_count, copyfile_state_t state, copyfile_flags_t flags)
+{
+	int ret = 0, i, nthreads = 0, error = 0;
+	copyfile_state_t s = state;
+	struct _copyfile_fanout f;
+	struct _copyfile_fanout_writer *writers = NULL;
+	struct stat sb;
+
+	if (src_fd < 0 || dst_fds == NULL || dst_count < 1)
+	{
+	errno = EINVAL;
+	return -1;
+	}
+
+	for (i = 0; i < dst_count; i++)
+	if (dst_fds[i] < 0)
+	{
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (copyfile_preamble(&s, flags) < 0)
+	return -1;
+
+	s->totalCopied = 0;
+
+	memset(&f, 0, sizeof(f));
+	pthread_mutex_init(&f.lock, NULL);
+	pthread_cond_init(&f.filled, NULL);
+	pthread_cond_init(&f.drained, NULL);
+
+	for (i = 0; i < COPYFILE_FANOUT_SLOTS; i++)
+	if ((f.slots[i].buf = malloc(COPYFILE_FANOUT_CHUNK)) == NULL)
+		goto error_exit;
+
+	if ((writers = calloc(dst_count, sizeof(*writers))) == NULL)
+	goto error_exit;
+
+	for (nthreads = 0; nthreads < dst_count; nthreads++)
+	{
+	writers[nthreads].f = &f;
+	writers[nthreads].fd = dst_fds[nthreads];
+
+	if ((errno = pthread_create(&writers[nthreads].thread, NULL, copyfile_fanout_writer, &writers[nthreads])) != 0)
+	{
+		copyfile_warn("pthread_create");
+		error = errno;
+		break;
+	}
+	}
+
+	/*
+	* Whichever writers did start must be fed until EOF (or until the
+	* read fails), so from here on errors just stop the reading.
+	*/
+	while (!error)
+	{
+	struct _copyfile_fanout_slot *slot = &f.slots[f.nfilled % COPYFILE_FANOUT_SLOTS];
+	ssize_t nread;
+
+	pthread_mutex_lock(&f.lock);
+	while (slot->pending > 0)
+		pthread_cond_wait(&f.drained, &f.lock);
+	pthread_mutex_unlock(&f.lock);
+
+	while ((nread = read(src_fd, slot->buf, COPYFILE_FANOUT_CHUNK)) < 0 && errno == EINTR)
+		continue;
+
+	if (nread < 0)
+	{
+		copyfile_warn("reading from fd %d", src_fd);
+		error = errno;
+		break;
+	}
+
+	if (nread == 0)
+		break;
+
+	s->totalCopied += nread;
+
+	pthread_mutex_lock(&f.lock);
+	slot->len = nread;
+	slot->pending = nthreads;
+	f.nfilled++;
+	pthread_cond_broadcast(&f.filled);
+	pthread_mutex_unlock(&f.lock);
+	}
+
+	pthread_mutex_lock(&f.lock);
+	f.eof = 1;
+	pthread_cond_broadcast(&f.filled);
+	pthread_mutex_unlock(&f.lock);
+
+	for (i = 0; i < nthreads; i++)
+	{
+	pthread_join(writers[i].thread, NULL);
+
+	if (writers[i].error)
+	{
+		errno = writers[i].error;
+		copyfile_warn("writing to fd %d", writers[i].fd);
+		if (!error)
+			error = writers[i].error;
+		continue;
+	}
+
+	/* same as copyfile_data(): drop whatever was past the end before */
+	if (fstat(writers[i].fd, &sb) == 0 && S_ISREG(sb.st_mode) &&
+		ftruncate(writers[i].fd, lseek(writers[i].fd, 0, SEEK_CUR)) < 0 && !error)
+		error = errno;
+	}
+
+	if (error)
+	{
+	errno = error;
+	ret = -1;
+	}
+
+exit:
+	free(writers);
+	for (i = 0; i < COPYFILE_FANOUT_SLOTS; i++)
+	free(f.slots[i].buf);
+	pthread_cond_destroy(&f.drained);
+	pthread_cond_destroy(&f.filled);
+	pthread_mutex_destroy(&f.lock);
+
+	if (state == NULL)
+	copyfile_state_free(s);
+
+	return ret;
+
+error_exit:
+	ret = -1;
+	goto exit;
+}
+
 /*
 * Shared prelude to the {f,}copyfile().  This initializes the
 * state variable, if necessary, and also checks for both debugging
@@ -518,6 +792,21 @@ static int copyfile_data(copyfile_state_t s)
 	size_t iBlocksize = 0;
 	struct statfs sfs;
 
+	if (COPYFILE_DATA_SPARSE & s->flags)
+	return copyfile_data_sparse(s);
+
+	/*
+	* copyfile_range_data() already tries copy_file_range(2) first, so
+	* all that's left to do is cut off whatever the destination had past
+	* the end of the source.
+	*/
+	if (COPYFILE_CLONE & s->flags)
+	{
+	if (copyfile_range_data(s, s->src_fd, 0, s->dst_fd, 0, s->sb.st_size) < 0)
+		return -1;
+	return ftruncate(s->dst_fd, s->sb.st_size);
+	}
+
 	if (fstatfs(s->src_fd, &sfs) == -1) {
 	iBlocksize = s->sb.st_blksize;
 	} else {
@@ -589,6 +878,179 @@ exit:
 	return ret;
 }
 
+/*
+* Copy only the data regions of the source (as reported by SEEK_DATA and
+* SEEK_HOLE), and extend the destination to the source's size at the end
+* so that the holes in between stay holes.  If the source's file system
+* can't report holes, this is just a plain copy of the whole file.
+*/
+static int copyfile_data_sparse(copyfile_state_t s)
+{
+	off_t data, hole = 0, copied = 0;
+	struct stat dst_sb;
+
+	/* stale data in the destination would otherwise show through the holes */
+	if (fstat(s->dst_fd, &dst_sb) == 0 && S_ISREG(dst_sb.st_mode) &&
+		ftruncate(s->dst_fd, 0) < 0)
+	return -1;
+
+	while (hole < s->sb.st_size)
+	{
+	if ((data = lseek(s->src_fd, hole, SEEK_DATA)) < 0)
+	{
+		if (errno == ENXIO) /* nothing but a hole left */
+			break;
+		if (hole == 0 && errno == EINVAL)
+		{
+			copyfile_debug(3, "SEEK_DATA unsupported, copying everything");
+			data = 0;
+			hole = s->sb.st_size;
+		}
+		else
+			return -1;
+	}
+	else if ((hole = lseek(s->src_fd, data, SEEK_HOLE)) < 0)
+		return -1;
+
+	if (hole > s->sb.st_size)
+		hole = s->sb.st_size;
+
+	copyfile_debug(4, "copying data region [%jd, %jd)", (intmax_t)data, (intmax_t)hole);
+
+	if (copyfile_range_data(s, s->src_fd, data, s->dst_fd, data, hole - data) < 0)
+		return -1;
+	copied += s->totalCopied;
+	}
+
+	s->totalCopied = copied;
+
+	return ftruncate(s->dst_fd, s->sb.st_size);
+}
+
+/*
+* Copy len bytes from src_fd at src_off to dst_fd at dst_off, using the
+* fastest engine available: copy_file_range(2) first (which clones the
+* blocks on file systems that can), and a pread/pwrite loop if the kernel
+* can't do the copy for this pair of descriptors.  The number of bytes
+* copied is accumulated in s->totalCopied.  Like copy_file_range(2),
+* overlapping ranges within the same file are rejected with EINVAL.
+*/
+static int copyfile_range_data(copyfile_state_t s, int src_fd, off_t src_off, int dst_fd, off_t dst_off, off_t len)
+{
+	char *bp = NULL;
+	size_t blen;
+	ssize_t nread;
+	int ret = 0;
+	struct statfs sfs;
+	struct stat sb;
+
+	s->totalCopied = 0;
+
+	if (len > 0 && fstat(src_fd, &sb) == 0)
+	{
+	struct stat dst_sb;
+
+	if (fstat(dst_fd, &dst_sb) == 0 && sb.st_dev == dst_sb.st_dev && sb.st_ino == dst_sb.st_ino &&
+		(src_off > dst_off ? src_off - dst_off : dst_off - src_off) < len)
+	{
+		errno = EINVAL;
+		return -1;
+	}
+	}
+
+#ifdef COPYFILE_HAVE_COPY_FILE_RANGE
+	while (len > 0)
+	{
+	ssize_t ncopied = copy_file_range(src_fd, &src_off, dst_fd, &dst_off, (size_t)MIN(len, SSIZE_MAX), 0);
+
+	if (ncopied < 0)
+	{
+		if (errno == EINTR)
+			continue;
+
+		/*
+		* These mean the kernel can't copy between these two
+		* descriptors (different file systems, special files,
+		* ...), not that the copy itself failed.  Whatever was
+		* already copied stays copied; the offsets have been
+		* advanced accordingly.
+		*/
+		if (errno == ENOSYS || errno == EXDEV || errno == EINVAL || errno == EOPNOTSUPP)
+		{
+			copyfile_debug(3, "copy_file_range unavailable, falling back to read/write");
+			break;
+		}
+
+		copyfile_warn("copy_file_range");
+		return -1;
+	}
+
+	if (ncopied == 0) /* EOF on the source */
+		return 0;
+
+	len -= ncopied;
+	s->totalCopied += ncopied;
+	}
+
+	if (len == 0)
+	return 0;
+#endif
+
+	if (fstatfs(src_fd, &sfs) == 0)
+	blen = sfs.f_iosize;
+	else if (fstat(src_fd, &sb) == 0)
+	blen = sb.st_blksize;
+	else
+	blen = MAXBSIZE;
+
+	if ((off_t)blen > len)
+	blen = len;
+
+	if ((bp = malloc(blen)) == NULL)
+	return -1;
+
+	while (len > 0 && (nread = pread(src_fd, bp, (size_t)MIN((off_t)blen, len), src_off)) != 0)
+	{
+	char *ptr = bp;
+	size_t left;
+
+	if (nread < 0)
+	{
+		if (errno == EINTR)
+			continue;
+		copyfile_warn("reading from fd %d", src_fd);
+		ret = -1;
+		goto exit;
+	}
+
+	src_off += nread;
+	len -= nread;
+
+	for (left = nread; left > 0;)
+	{
+		ssize_t nwritten = pwrite(dst_fd, ptr, left, dst_off);
+
+		if (nwritten < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			copyfile_warn("writing to fd %d", dst_fd);
+			ret = -1;
+			goto exit;
+		}
+
+		left -= nwritten;
+		ptr += nwritten;
+		dst_off += nwritten;
+		s->totalCopied += nwritten;
+	}
+	}
+
+exit:
+	free(bp);
+	return ret;
+}
+
 /*
 * Attempt to set the destination file's stat information -- including
 * flags and time-related fields -- to the source's.
@@ -645,6 +1107,9 @@ int copyfile_state_get(copyfile_state_t s, uint32_t flag, void *ret)
 	case COPYFILE_STATE_DST_FILENAME:
 		*(char**)ret = s->dst;
 		break;
+	case COPYFILE_STATE_COPIED:
+		*(off_t*)ret = s->totalCopied;
+		break;
 #if 0
 	case COPYFILE_STATE_STATS:
 		ret = s->stats.global;
@@ -715,55 +1180,3 @@ int copyfile_state_set(copyfile_state_t s, uint32_t flag, const void * thing)
 #undef copyfile_set_string
 }
 
-
-/*
-* Make this a standalone program for testing purposes by
-* defining _COPYFILE_TEST.
-*/
-#ifdef _COPYFILE_TEST
-#define COPYFILE_OPTION(x) { #x, COPYFILE_ ## x },
-
-struct {char *s; int v;} opts[] = {
-	COPYFILE_OPTION(ACL)
-	COPYFILE_OPTION(STAT)
-	COPYFILE_OPTION(XATTR)
-	COPYFILE_OPTION(DATA)
-	COPYFILE_OPTION(SECURITY)
-	COPYFILE_OPTION(METADATA)
-	COPYFILE_OPTION(ALL)
-	COPYFILE_OPTION(NOFOLLOW_SRC)
-	COPYFILE_OPTION(NOFOLLOW_DST)
-	COPYFILE_OPTION(NOFOLLOW)
-	COPYFILE_OPTION(EXCL)
-	COPYFILE_OPTION(MOVE)
-	COPYFILE_OPTION(UNLINK)
-	COPYFILE_OPTION(CHECK)
-	COPYFILE_OPTION(VERBOSE)
-	COPYFILE_OPTION(DEBUG)
-	{NULL, 0}
-};
-
-int main(int c, char *v[])
-{
-	int i;
-	int flags = 0;
-
-	if (c < 3)
-	errx(1, "insufficient arguments");
-
-	while(c-- > 3)
-	{
-	for (i = 0; opts[i].s != NULL; ++i)
-	{
-		if (strcasecmp(opts[i].s, v[c]) == 0)
-		{
-		printf("option %d: %s <- %d\n", c, opts[i].s, opts[i].v);
-		flags |= opts[i].v;
-		break;
-		}
-	}
-	}
-
-	return copyfile(v[1], v[2], NULL, flags);
-}
-#endif
\ No newline at end of file
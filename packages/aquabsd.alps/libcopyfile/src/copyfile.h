@@ -36,6 +36,7 @@
 
 /* private */
 #include <sys/cdefs.h>
+#include <sys/types.h>
 #include <stdint.h>
 
 __BEGIN_DECLS
@@ -58,6 +59,40 @@ typedef uint32_t copyfile_flags_t;
 int copyfile(const char *from, const char *to, copyfile_state_t state, copyfile_flags_t flags);
 int fcopyfile(int from_fd, int to_fd, copyfile_state_t, copyfile_flags_t flags);
 
+/* receives:
+ *   src_fd	source file descriptor
+ *   src_off	offset in the source to start copying from
+ *   dst_fd	destination file descriptor
+ *   dst_off	offset in the destination to start copying to
+ *   len	number of bytes to copy; stops early at the source's EOF
+ *   state	may be NULL; if not, COPYFILE_STATE_COPIED holds the
+ *		number of bytes actually copied
+ *   flags	(described below)
+ * returns:
+ *   int	negative for error
+ *
+ * Neither descriptor's file offset is used or modified.
+ */
+
+int copyfile_range(int src_fd, off_t src_off, int dst_fd, off_t dst_off, off_t len, copyfile_state_t state, copyfile_flags_t flags);
+
+/* receives:
+ *   src_fd	source file descriptor, read once from its current offset
+ *   dst_fds	array of destination file descriptors
+ *   dst_count	number of entries in dst_fds
+ *   state	may be NULL; if not, COPYFILE_STATE_COPIED holds the
+ *		number of bytes read from the source
+ *   flags	(described below)
+ * returns:
+ *   int	negative for error (if any destination failed)
+ *
+ * Only the data is copied.  Each destination is written from its own
+ * thread out of a bounded ring of buffers, so a slow destination only
+ * holds the others back once it is a whole ring behind.
+ */
+
+int fcopyfile_fanout(int src_fd, const int *dst_fds, int dst_count, copyfile_state_t state, copyfile_flags_t flags);
+
 int copyfile_state_free(copyfile_state_t);
 copyfile_state_t copyfile_state_alloc(void);
 
@@ -69,6 +104,7 @@ int copyfile_state_set(copyfile_state_t s, uint32_t flag, const void * src);
 #define COPYFILE_STATE_SRC_FILENAME	2
 #define COPYFILE_STATE_DST_FD		3
 #define COPYFILE_STATE_DST_FILENAME	4
+#define COPYFILE_STATE_COPIED		8
 
 #define	COPYFILE_DISABLE_VAR	"COPYFILE_DISABLE"
 
@@ -88,6 +124,8 @@ int copyfile_state_set(copyfile_state_t s, uint32_t flag, const void * src);
 #define COPYFILE_MOVE		(1<<20) /* unlink src after copy */
 #define COPYFILE_UNLINK		(1<<21) /* unlink dst before copy */
 #define COPYFILE_NOFOLLOW	(COPYFILE_NOFOLLOW_SRC | COPYFILE_NOFOLLOW_DST)
+#define COPYFILE_CLONE		(1<<24) /* copy data with copy_file_range(2), cloning blocks where possible */
+#define COPYFILE_DATA_SPARSE	(1<<27) /* only copy the source's data regions, leaving its holes as holes */
 
 #define COPYFILE_VERBOSE	(1<<30)
 
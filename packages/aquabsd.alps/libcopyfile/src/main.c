@@ -0,0 +1,542 @@
+// command-line frontend to libcopyfile
+// meant as a drop-in replacement for 'cp(1)' in build scripts, except that it copies files in parallel
+
+// TODO
+//  - manual page
+
+#include <sys/cdefs.h>
+__FBSDID("$FreeBSD$");
+
+#include "copyfile.h"
+
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <fts.h>
+#include <libgen.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sys/param.h>
+#include <sys/stat.h>
+
+static void __dead2 usage(void) {
+	fprintf(stderr,
+		"usage: %1$s [-cDfnpRSsv] [-j jobs] source target\n"
+		"       %1$s [-cDfnpRSsv] [-j jobs] source ... directory\n",
+	getprogname());
+
+	exit(EXIT_FAILURE);
+}
+
+typedef struct {
+	// general options
+
+	bool verbose;
+	bool summary;
+
+	// copy options
+
+	bool recursive;
+	bool no_clobber;
+	bool dedup;
+	copyfile_flags_t flags;
+
+	int jobs;
+} opts_t;
+
+// a single file to be copied
+// directories & symlinks are created up front, so only regular files ever end up as jobs
+
+typedef struct {
+	char* src;
+	char* dst;
+	off_t size;
+
+	bool skipped;
+	bool failed;
+	double latency; // in seconds
+} job_t;
+
+typedef struct {
+	opts_t* opts;
+
+	size_t jobs_len;
+	job_t* jobs;
+
+	// directories are stat'ed after their contents are copied (with '-p'), so that copying the contents doesn't bump their times
+
+	size_t dirs_len;
+	job_t* dirs;
+
+	pthread_mutex_t lock;
+	size_t next_job;
+
+	bool failed;
+} queue_t;
+
+static job_t* __push(job_t** list_ref, size_t* len_ref, const char* src, const char* dst, off_t size) {
+	job_t* list = realloc(*list_ref, (*len_ref + 1) * sizeof *list);
+
+	if (!list) {
+		err(EXIT_FAILURE, "realloc");
+	}
+
+	job_t* job = &list[(*len_ref)++];
+	memset(job, 0, sizeof *job);
+
+	job->src = strdup(src);
+	job->dst = strdup(dst);
+	job->size = size;
+
+	if (!job->src || !job->dst) {
+		err(EXIT_FAILURE, "strdup");
+	}
+
+	*list_ref = list;
+	return job;
+}
+
+static double __now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// compare the contents of two files of the same size
+// used by '-D' to skip destinations which already hold exactly what we'd write to them
+
+static bool __same_contents(const char* src, const char* dst) {
+	static const size_t chunk = 64 * 1024;
+
+	bool same = false;
+	char* src_buf = NULL;
+	char* dst_buf = NULL;
+
+	int src_fd = open(src, O_RDONLY);
+	int dst_fd = open(dst, O_RDONLY);
+
+	if (src_fd < 0 || dst_fd < 0) {
+		goto done;
+	}
+
+	src_buf = malloc(chunk);
+	dst_buf = malloc(chunk);
+
+	if (!src_buf || !dst_buf) {
+		goto done;
+	}
+
+	while (1) {
+		ssize_t src_len = read(src_fd, src_buf, chunk);
+		ssize_t dst_len = read(dst_fd, dst_buf, chunk);
+
+		if (src_len < 0 || src_len != dst_len) {
+			goto done;
+		}
+
+		if (!src_len) {
+			break;
+		}
+
+		if (memcmp(src_buf, dst_buf, src_len)) {
+			goto done;
+		}
+	}
+
+	same = true;
+
+done:
+
+	free(src_buf);
+	free(dst_buf);
+
+	if (src_fd >= 0) {
+		close(src_fd);
+	}
+
+	if (dst_fd >= 0) {
+		close(dst_fd);
+	}
+
+	return same;
+}
+
+static void __copy(queue_t* queue, job_t* job) {
+	opts_t* opts = queue->opts;
+	struct stat sb;
+
+	if ((opts->no_clobber || opts->dedup) && lstat(job->dst, &sb) == 0) {
+		if (opts->no_clobber) {
+			job->skipped = true;
+			return;
+		}
+
+		if (S_ISREG(sb.st_mode) && sb.st_size == job->size && __same_contents(job->src, job->dst)) {
+			job->skipped = true;
+			return;
+		}
+	}
+
+	if (opts->verbose) {
+		printf("%s -> %s\n", job->src, job->dst);
+	}
+
+	double start = __now();
+
+	if (copyfile(job->src, job->dst, NULL, opts->flags) < 0) {
+		warn("%s -> %s", job->src, job->dst);
+		job->failed = true;
+	}
+
+	job->latency = __now() - start;
+}
+
+static void* __worker(void* arg) {
+	queue_t* queue = arg;
+
+	while (1) {
+		pthread_mutex_lock(&queue->lock);
+		size_t i = queue->next_job++;
+		pthread_mutex_unlock(&queue->lock);
+
+		if (i >= queue->jobs_len) {
+			break;
+		}
+
+		__copy(queue, &queue->jobs[i]);
+	}
+
+	return NULL;
+}
+
+// walk a source directory, creating its directory structure & symlinks under 'dst', and queuing its files
+
+static void __walk(queue_t* queue, const char* src, const char* dst) {
+	char* const roots[] = { (char*) src, NULL };
+	FTS* fts = fts_open(roots, FTS_PHYSICAL | FTS_NOCHDIR, NULL);
+
+	if (!fts) {
+		warn("fts_open(%s)", src);
+		queue->failed = true;
+		return;
+	}
+
+	size_t root_len = strlen(src);
+	FTSENT* ent;
+
+	while ((ent = fts_read(fts))) {
+		char path[MAXPATHLEN];
+
+		if (snprintf(path, sizeof path, "%s%s", dst, ent->fts_path + root_len) >= (int) sizeof path) {
+			warnx("%s: path too long", ent->fts_path);
+			queue->failed = true;
+			continue;
+		}
+
+		switch (ent->fts_info) {
+		case FTS_D:
+			if (mkdir(path, (ent->fts_statp->st_mode & ALLPERMS) | S_IRWXU) < 0 && errno != EEXIST) {
+				warn("mkdir(%s)", path);
+				queue->failed = true;
+				fts_set(fts, ent, FTS_SKIP);
+				break;
+			}
+
+			__push(&queue->dirs, &queue->dirs_len, ent->fts_path, path, 0);
+			break;
+
+		case FTS_F:
+			__push(&queue->jobs, &queue->jobs_len, ent->fts_path, path, ent->fts_statp->st_size);
+			break;
+
+		case FTS_SL:
+		case FTS_SLNONE: {
+			char target[MAXPATHLEN];
+			ssize_t len = readlink(ent->fts_path, target, sizeof target - 1);
+
+			if (len < 0) {
+				warn("readlink(%s)", ent->fts_path);
+				queue->failed = true;
+				break;
+			}
+
+			target[len] = '\0';
+
+			if (symlink(target, path) < 0 && !(errno == EEXIST && !queue->opts->no_clobber && unlink(path) == 0 && symlink(target, path) == 0)) {
+				warn("symlink(%s)", path);
+				queue->failed = true;
+			}
+
+			break;
+		}
+
+		case FTS_DNR:
+		case FTS_ERR:
+		case FTS_NS:
+			warnx("%s: %s", ent->fts_path, strerror(ent->fts_errno));
+			queue->failed = true;
+			break;
+
+		case FTS_DP:
+			break;
+
+		default:
+			warnx("%s: unsupported file type (not copied)", ent->fts_path);
+			queue->failed = true;
+			break;
+		}
+	}
+
+	fts_close(fts);
+}
+
+static int __cmp_latency(const void* _a, const void* _b) {
+	double a = *(const double*) _a;
+	double b = *(const double*) _b;
+
+	return (a > b) - (a < b);
+}
+
+static void __print_summary(queue_t* queue, double elapsed) {
+	size_t copied = 0;
+	size_t skipped = 0;
+	off_t bytes = 0;
+
+	double* latencies = calloc(queue->jobs_len + 1, sizeof *latencies);
+
+	if (!latencies) {
+		err(EXIT_FAILURE, "calloc");
+	}
+
+	for (size_t i = 0; i < queue->jobs_len; i++) {
+		job_t* job = &queue->jobs[i];
+
+		if (job->skipped) {
+			skipped++;
+		}
+
+		else if (!job->failed) {
+			latencies[copied++] = job->latency;
+			bytes += job->size;
+		}
+	}
+
+	qsort(latencies, copied, sizeof *latencies, __cmp_latency);
+
+	double total = 0;
+
+	for (size_t i = 0; i < copied; i++) {
+		total += latencies[i];
+	}
+
+	#define PERCENTILE(p) (copied ? latencies[(copied - 1) * (p) / 100] * 1000 : 0)
+
+	fprintf(stderr,
+		"%zu files copied (%zu skipped), %jd bytes in %.3f s\n"
+		"throughput: %.2f MB/s, %.1f files/s (%d jobs)\n"
+		"latency (ms): min %.3f, avg %.3f, p50 %.3f, p99 %.3f, max %.3f\n",
+		copied, skipped, (intmax_t) bytes, elapsed,
+		elapsed > 0 ? bytes / elapsed / 1e6 : 0, elapsed > 0 ? copied / elapsed : 0, queue->opts->jobs,
+		PERCENTILE(0), copied ? total / copied * 1000 : 0, PERCENTILE(50), PERCENTILE(99), PERCENTILE(100));
+
+	#undef PERCENTILE
+
+	free(latencies);
+}
+
+int main(int argc, char* argv[]) {
+	// options
+
+	opts_t opts = {
+		.flags = COPYFILE_DATA,
+		.jobs = sysconf(_SC_NPROCESSORS_ONLN),
+	};
+
+	// get options
+
+	int c;
+
+	while ((c = getopt(argc, argv, "cDfj:npRSsv")) >= 0) {
+		// general options
+
+		if (c == 's') {
+			opts.summary = true;
+		}
+
+		else if (c == 'v') {
+			opts.verbose = true;
+		}
+
+		// copy options
+
+		else if (c == 'c') {
+			opts.flags |= COPYFILE_CLONE;
+		}
+
+		else if (c == 'D') {
+			opts.dedup = true;
+		}
+
+		else if (c == 'f') {
+			opts.flags |= COPYFILE_UNLINK;
+		}
+
+		else if (c == 'j') {
+			char* end;
+			opts.jobs = strtol(optarg, &end, 10);
+
+			if (*end || opts.jobs < 1) {
+				errx(EXIT_FAILURE, "invalid number of jobs: %s", optarg);
+			}
+		}
+
+		else if (c == 'n') {
+			opts.no_clobber = true;
+		}
+
+		else if (c == 'p') {
+			opts.flags |= COPYFILE_STAT;
+		}
+
+		else if (c == 'R') {
+			opts.recursive = true;
+		}
+
+		else if (c == 'S') {
+			opts.flags |= COPYFILE_DATA_SPARSE;
+		}
+
+		else {
+			usage();
+		}
+	}
+
+	argc -= optind;
+	argv += optind;
+
+	if (argc < 2) {
+		usage();
+	}
+
+	if (opts.jobs < 1) {
+		opts.jobs = 1;
+	}
+
+	// figure out where each source goes
+	// like 'cp(1)', if the target is an existing directory (or there are multiple sources), sources are copied into it
+
+	queue_t queue = {
+		.opts = &opts,
+	};
+
+	pthread_mutex_init(&queue.lock, NULL);
+
+	char* target = argv[--argc];
+	struct stat sb;
+
+	bool into_dir = stat(target, &sb) == 0 && S_ISDIR(sb.st_mode);
+
+	if (argc > 1 && !into_dir) {
+		errx(EXIT_FAILURE, "%s is not a directory", target);
+	}
+
+	double start = __now();
+
+	for (int i = 0; i < argc; i++) {
+		char src[MAXPATHLEN];
+		char dst[MAXPATHLEN];
+
+		strlcpy(src, argv[i], sizeof src);
+
+		// strip trailing slashes so 'src/' and 'src' behave the same way
+
+		for (size_t len = strlen(src); len > 1 && src[len - 1] == '/'; len--) {
+			src[len - 1] = '\0';
+		}
+
+		if (stat(src, &sb) < 0) {
+			warn("%s", src);
+			queue.failed = true;
+			continue;
+		}
+
+		if (into_dir) {
+			char base[MAXPATHLEN];
+			strlcpy(base, src, sizeof base);
+
+			snprintf(dst, sizeof dst, "%s/%s", target, basename(base));
+		}
+
+		else {
+			strlcpy(dst, target, sizeof dst);
+		}
+
+		if (S_ISDIR(sb.st_mode)) {
+			if (!opts.recursive) {
+				warnx("%s is a directory (not copied)", src);
+				queue.failed = true;
+				continue;
+			}
+
+			__walk(&queue, src, dst);
+		}
+
+		else {
+			__push(&queue.jobs, &queue.jobs_len, src, dst, sb.st_size);
+		}
+	}
+
+	// copy files in parallel
+
+	int threads_len = MIN((size_t) opts.jobs, MAX(queue.jobs_len, 1));
+	pthread_t* threads = calloc(threads_len, sizeof *threads);
+
+	if (!threads) {
+		err(EXIT_FAILURE, "calloc");
+	}
+
+	for (int i = 0; i < threads_len; i++) {
+		if ((errno = pthread_create(&threads[i], NULL, __worker, &queue))) {
+			err(EXIT_FAILURE, "pthread_create");
+		}
+	}
+
+	for (int i = 0; i < threads_len; i++) {
+		pthread_join(threads[i], NULL);
+	}
+
+	free(threads);
+
+	// with '-p', copy over directory metadata now that their contents are in place
+	// go in reverse so that parents are done after their children
+
+	if (opts.flags & COPYFILE_STAT) {
+		for (size_t i = queue.dirs_len; i-- > 0;) {
+			job_t* dir = &queue.dirs[i];
+
+			if (copyfile(dir->src, dir->dst, NULL, COPYFILE_STAT) < 0) {
+				warn("%s -> %s", dir->src, dir->dst);
+				queue.failed = true;
+			}
+		}
+	}
+
+	double elapsed = __now() - start;
+
+	for (size_t i = 0; i < queue.jobs_len; i++) {
+		queue.failed |= queue.jobs[i].failed;
+	}
+
+	if (opts.summary) {
+		__print_summary(&queue, elapsed);
+	}
+
+	return queue.failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,29 @@
+#!/bin/sh
+set -e
+
+# benchmark mkfs_msdos() across FAT types, sizes and targets
+# the JSON results go to stdout; arguments are passed on to the benchmark (see src/bench.c)
+# TMPFS can be set to a tmpfs mount to use for the tmpfs-backed cases (by default, /tmp)
+
+BUILD_DIR=".build/bench/"
+
+rm -rf $BUILD_DIR
+mkdir -p $BUILD_DIR
+
+COPYFILE=../libcopyfile/.build/package/usr/
+
+# count the system calls libmkfs_msdos makes by wrapping each of them
+
+WRAP="pwrite pwritev writev read pread lseek ftruncate fstat close mmap open ioctl"
+LDFLAGS=""
+
+for sym in $WRAP; do
+	LDFLAGS="$LDFLAGS -Wl,--wrap=$sym"
+done
+
+cc -std=c99 -O2 -pthread -I$COPYFILE/include -c src/mkfs_msdos.c -o $BUILD_DIR/mkfs_msdos.o
+cc -std=c99 -O2 -pthread -I$COPYFILE/include src/bench.c $BUILD_DIR/mkfs_msdos.o -o $BUILD_DIR/bench $LDFLAGS -L$COPYFILE/lib -lcopyfile
+
+$BUILD_DIR/bench -t "${TMPFS:-/tmp}" "$@"
+
+exit 0
@@ -8,17 +8,28 @@ mkdir -p $BUILD_DIR/package/usr/
 
 # create package directories
 
+mkdir $BUILD_DIR/package/usr/bin/
 mkdir $BUILD_DIR/package/usr/lib/
 mkdir $BUILD_DIR/package/usr/include/
 
-cp src/mkfs_msdos.h $BUILD_DIR/package/usr/include/
+cp src/mkfs_msdos.h src/msdos_read.h $BUILD_DIR/package/usr/include/
 
 # build the package files
 
-cc -std=c99 -fPIC -c src/mkfs_msdos.c -o $BUILD_DIR/mkfs_msdos.o
-cc -shared $BUILD_DIR/mkfs_msdos.o -o $BUILD_DIR/package/usr/lib/libmkfs_msdos.so
+# TODO remove second include & library paths
 
-ar rc $BUILD_DIR/package/usr/lib/libmkfs_msdos.a $BUILD_DIR/mkfs_msdos.o
+COPYFILE=../libcopyfile/.build/package/usr/
+
+cc -std=c99 -pthread -fPIC -I$COPYFILE/include -c src/mkfs_msdos.c -o $BUILD_DIR/mkfs_msdos.o
+cc -std=c99 -pthread -fPIC -I$COPYFILE/include -c src/msdos_read.c -o $BUILD_DIR/msdos_read.o
+cc -std=c99 -pthread -fPIC -c src/msdos_disk.c -o $BUILD_DIR/msdos_disk.o
+cc -shared -pthread $BUILD_DIR/mkfs_msdos.o $BUILD_DIR/msdos_read.o $BUILD_DIR/msdos_disk.o -o $BUILD_DIR/package/usr/lib/libmkfs_msdos.so -L$COPYFILE/lib -lcopyfile
+
+cc -std=c99 -pthread src/main.c $BUILD_DIR/mkfs_msdos.o -o $BUILD_DIR/package/usr/bin/mkfs_msdos -L$COPYFILE/lib -lcopyfile
+cc -std=c99 -pthread src/mkdisk.c $BUILD_DIR/mkfs_msdos.o $BUILD_DIR/msdos_disk.o -o $BUILD_DIR/package/usr/bin/mkfs_msdos_disk -L$COPYFILE/lib -lcopyfile
+cc -std=c99 -pthread -I$COPYFILE/include src/check.c $BUILD_DIR/msdos_read.o -o $BUILD_DIR/package/usr/bin/msdos_check -L$COPYFILE/lib -lcopyfile
+
+ar rc $BUILD_DIR/package/usr/lib/libmkfs_msdos.a $BUILD_DIR/mkfs_msdos.o $BUILD_DIR/msdos_read.o $BUILD_DIR/msdos_disk.o
 ranlib $BUILD_DIR/package/usr/lib/libmkfs_msdos.a
 
 # create the package tarball
@@ -0,0 +1,334 @@
+// benchmark for 'mkfs_msdos()': formats images across a matrix of FAT types, sizes, sector & cluster sizes, and targets, and prints the results as JSON
+// new images go through 'mkfs_msdos()', which formats them from a template, and through 'mkfs_msdos_write()' onto an existing file, which runs the whole sector loop
+// 'mkfs_msdos()' is measured both cold (building the template on the way) and warm (with the template already cached by an untimed format in the same process)
+// each case runs in its own child process, so that its peak RSS can be read back with 'wait4(2)'
+// the system calls 'libmkfs_msdos' makes are counted by linking it with '--wrap' for each of them (see 'bench.sh'), so this isn't built as part of the package
+
+#include <sys/cdefs.h>
+__FBSDID("$FreeBSD$");
+
+#include "mkfs_msdos.h"
+
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/param.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
+
+// what a single run measured, sent back to the parent through a pipe
+
+typedef struct {
+	double wall;
+	uint64_t bytes;
+	uint64_t syscalls;
+} result_t;
+
+static result_t counters;
+
+// wrappers for the system calls made by 'mkfs_msdos.o'
+
+#define WRAP(type, name, params, args) \
+	type __real_##name params; \
+	type __wrap_##name params { \
+		counters.syscalls++; \
+		return __real_##name args; \
+	}
+
+#define WRAP_WRITE(name, params, args) \
+	ssize_t __real_##name params; \
+	ssize_t __wrap_##name params { \
+		counters.syscalls++; \
+		ssize_t const rv = __real_##name args; \
+		if (rv > 0) counters.bytes += rv; \
+		return rv; \
+	}
+
+WRAP_WRITE(pwrite, (int fd, const void* buf, size_t len, off_t off), (fd, buf, len, off))
+WRAP_WRITE(pwritev, (int fd, const struct iovec* iov, int cnt, off_t off), (fd, iov, cnt, off))
+WRAP_WRITE(writev, (int fd, const struct iovec* iov, int cnt), (fd, iov, cnt))
+
+WRAP(ssize_t, read, (int fd, void* buf, size_t len), (fd, buf, len))
+WRAP(ssize_t, pread, (int fd, void* buf, size_t len, off_t off), (fd, buf, len, off))
+WRAP(off_t, lseek, (int fd, off_t off, int whence), (fd, off, whence))
+WRAP(int, ftruncate, (int fd, off_t len), (fd, len))
+WRAP(int, fstat, (int fd, struct stat* sb), (fd, sb))
+WRAP(int, close, (int fd), (fd))
+WRAP(void*, mmap, (void* addr, size_t len, int prot, int flags, int fd, off_t off), (addr, len, prot, flags, fd, off))
+
+// 'open(2)' & 'ioctl(2)' are variadic, so they get wrapped by hand
+
+int __real_open(const char* path, int flags, ...);
+
+int __wrap_open(const char* path, int flags, ...) {
+	va_list ap;
+	va_start(ap, flags);
+	int const mode = flags & O_CREAT ? va_arg(ap, int) : 0;
+	va_end(ap);
+
+	counters.syscalls++;
+	return __real_open(path, flags, mode);
+}
+
+int __real_ioctl(int fd, unsigned long req, ...);
+
+int __wrap_ioctl(int fd, unsigned long req, ...) {
+	va_list ap;
+	va_start(ap, req);
+	void* const arg = va_arg(ap, void*);
+	va_end(ap);
+
+	counters.syscalls++;
+	return __real_ioctl(fd, req, arg);
+}
+
+// the APIs measured
+
+typedef enum {
+	API_COLD,  // 'mkfs_msdos()', with an empty template cache
+	API_WARM,  // 'mkfs_msdos()', with the template already cached
+	API_WRITE, // 'mkfs_msdos_plan()' & 'mkfs_msdos_write()'
+	API_COUNT,
+} api_t;
+
+// the matrix
+// sizes are per FAT type, as they each only make sense over a certain range
+
+static const struct {
+	int fat;
+	off_t sizes[2];
+} fats[] = {
+	{ 12, { 1 << 20, 8 << 20 } },
+	{ 16, { 32 << 20, 256 << 20 } },
+	{ 32, { 256 << 20, 1 << 30 } },
+};
+
+static const int bytes_per_sector[] = { 512, 4096 };
+static const int sectors_per_cluster[] = { 0, 8, 64 }; // 0 lets 'mkfs_msdos()' pick
+
+typedef struct {
+	const char* name;
+	const char* dir;
+	bool sparse;
+} target_t;
+
+static double __now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// run a single case in a child process
+// returns -1 if it failed
+
+static int __run(const char* path, const struct msdos_options* o, api_t api, result_t* res, long* maxrss) {
+	int fds[2];
+
+	if (pipe(fds) < 0) {
+		warn("pipe");
+		return -1;
+	}
+
+	fflush(stdout);
+	pid_t const pid = fork();
+
+	if (pid < 0) {
+		warn("fork");
+		close(fds[0]);
+		close(fds[1]);
+		return -1;
+	}
+
+	if (!pid) {
+		close(fds[0]);
+
+		// the summary 'mkfs_msdos()' prints would end up in the middle of the JSON
+
+		int const null = open("/dev/null", O_WRONLY);
+
+		if (null < 0 || dup2(null, STDOUT_FILENO) < 0) {
+			_exit(EXIT_FAILURE);
+		}
+
+		struct msdos_plan plan;
+		int fd = -1;
+
+		// each run is a fresh process, so the template cache has to be filled here for the warm case
+
+		if (api == API_WARM && mkfs_msdos(path, NULL, o) < 0) {
+			_exit(EXIT_FAILURE);
+		}
+
+		if (api == API_WRITE) {
+			fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+
+			if (fd < 0 || ftruncate(fd, o->create_size) < 0 || mkfs_msdos_plan(NULL, NULL, o, &plan) < 0) {
+				_exit(EXIT_FAILURE);
+			}
+		}
+
+		memset(&counters, 0, sizeof counters);
+		double const start = __now();
+
+		if ((api == API_WRITE ? mkfs_msdos_write(&plan, fd) : mkfs_msdos(path, NULL, o)) < 0) {
+			_exit(EXIT_FAILURE);
+		}
+
+		counters.wall = __now() - start;
+
+		if (write(fds[1], &counters, sizeof counters) != sizeof counters) {
+			_exit(EXIT_FAILURE);
+		}
+
+		_exit(EXIT_SUCCESS);
+	}
+
+	close(fds[1]);
+
+	ssize_t const len = read(fds[0], res, sizeof *res);
+	close(fds[0]);
+
+	int status;
+	struct rusage ru;
+
+	if (wait4(pid, &status, 0, &ru) < 0) {
+		warn("wait4");
+		return -1;
+	}
+
+	unlink(path);
+
+	if (len != sizeof *res || !WIFEXITED(status) || WEXITSTATUS(status)) {
+		return -1;
+	}
+
+	*maxrss = ru.ru_maxrss;
+	return 0;
+}
+
+static void __dead2 usage(void) {
+	fprintf(stderr, "usage: %s [-n runs] [-d dir] [-t tmpfs_dir]\n", getprogname());
+	exit(EXIT_FAILURE);
+}
+
+int main(int argc, char* argv[]) {
+	target_t targets[] = {
+		{ "file", ".", false },
+		{ "file", ".", true },
+		{ "tmpfs", "/tmp", false },
+		{ "tmpfs", "/tmp", true },
+	};
+
+	int runs = 3;
+	int c;
+
+	while ((c = getopt(argc, argv, "d:n:t:")) >= 0) {
+		if (c == 'd') {
+			targets[0].dir = targets[1].dir = optarg;
+		}
+
+		else if (c == 't') {
+			targets[2].dir = targets[3].dir = optarg;
+		}
+
+		else if (c == 'n') {
+			runs = atoi(optarg);
+
+			if (runs < 1) {
+				errx(EXIT_FAILURE, "-n: %s: bad number of runs", optarg);
+			}
+		}
+
+		else {
+			usage();
+		}
+	}
+
+	if (optind != argc) {
+		usage();
+	}
+
+	printf("[");
+	char const* sep = "\n";
+
+	for (size_t t = 0; t < nitems(targets) * API_COUNT; t++) {
+		target_t* const target = &targets[t / API_COUNT];
+		api_t const api = t % API_COUNT;
+
+		char path[PATH_MAX];
+		snprintf(path, sizeof path, "%s/mkfs_msdos_bench.%d.img", target->dir, getpid());
+
+		for (size_t f = 0; f < nitems(fats); f++) for (size_t s = 0; s < nitems(fats[f].sizes); s++)
+		for (size_t b = 0; b < nitems(bytes_per_sector); b++) for (size_t k = 0; k < nitems(sectors_per_cluster); k++) {
+			struct msdos_options o = {
+				.fat_type = fats[f].fat,
+				.create_size = fats[f].sizes[s],
+				.bytes_per_sector = bytes_per_sector[b],
+				.sectors_per_cluster = sectors_per_cluster[k],
+				.sparse = target->sparse,
+				.timestamp_set = true,
+				.volume_id_set = true,
+			};
+
+			// skip the combinations which don't make a valid file system (e.g. too few clusters for the FAT type)
+			// the plan says why on stderr
+
+			struct msdos_plan plan;
+
+			if (mkfs_msdos_plan(NULL, NULL, &o, &plan) < 0) {
+				continue;
+			}
+
+			// keep the best wall time, the rest doesn't change from run to run
+
+			result_t best = { 0 };
+			long maxrss = 0;
+			int i;
+
+			for (i = 0; i < runs; i++) {
+				result_t res;
+				long rss;
+
+				if (__run(path, &o, api, &res, &rss) < 0) {
+					break;
+				}
+
+				if (!i || res.wall < best.wall) {
+					best = res;
+				}
+
+				maxrss = MAX(maxrss, rss);
+			}
+
+			if (i < runs) {
+				warnx("%s: FAT%d, %jd bytes, %d bytes per sector, %d sectors per cluster: failed", path, o.fat_type, (intmax_t) o.create_size, o.bytes_per_sector, o.sectors_per_cluster);
+				continue;
+			}
+
+			printf(
+				"%s\t{\"api\": \"%s\", \"template_cache\": %s, \"target\": \"%s\", \"sparse\": %s, \"fat\": %d, \"size\": %jd, \"bytes_per_sector\": %d, \"sectors_per_cluster\": %u, "
+				"\"clusters\": %u, \"runs\": %d, \"wall_s\": %.6f, \"bytes_written\": %" PRIu64 ", \"syscalls\": %" PRIu64 ", \"peak_rss_kb\": %ld}",
+				sep, api == API_WRITE ? "mkfs_msdos_write" : "mkfs_msdos", api == API_COLD ? "\"cold\"" : api == API_WARM ? "\"warm\"" : "null", target->name, target->sparse ? "true" : "false", o.fat_type, (intmax_t) o.create_size, o.bytes_per_sector, plan.layout.bpb.bpbSecPerClust,
+				plan.layout.clusters, runs, best.wall, best.bytes, best.syscalls, maxrss);
+
+			sep = ",\n";
+			fflush(stdout);
+		}
+	}
+
+	printf("\n]\n");
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,73 @@
+// check a FAT file system image for consistency, without mounting it (see 'msdos_check()' in 'msdos_read.h')
+// each problem found is printed as it comes up, followed by a summary of the cluster counts
+// the exit status is 0 if the image is clean, 1 if it has problems, and 2 if it couldn't be checked at all
+
+#include <sys/cdefs.h>
+__FBSDID("$FreeBSD$");
+
+#include "msdos_read.h"
+
+#include <err.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+static void __dead2 usage(void) {
+	fprintf(stderr, "usage: %s [-o offset] image\n", getprogname());
+	exit(2);
+}
+
+int main(int argc, char* argv[]) {
+	off_t offset = 0;
+	int c;
+
+	while ((c = getopt(argc, argv, "o:")) >= 0) {
+		if (c != 'o') {
+			usage();
+		}
+
+		char* end;
+		errno = 0;
+		intmax_t val = strtoimax(optarg, &end, 0);
+
+		if (errno || end == optarg || *end || val < 0) {
+			errx(2, "-o: %s: bad offset", optarg);
+		}
+
+		offset = val;
+	}
+
+	argc -= optind;
+	argv += optind;
+
+	if (argc != 1) {
+		usage();
+	}
+
+	struct msdos_image* const im = msdos_image_open(argv[0], offset);
+
+	if (!im) {
+		return 2;
+	}
+
+	struct msdos_check ck;
+	int const rv = msdos_check(im, &ck);
+
+	if (rv < 0) {
+		msdos_image_close(im);
+		return 2;
+	}
+
+	const struct msdos_layout* const l = msdos_image_layout(im);
+
+	printf("%s: FAT%u, %u clusters: %u used, %u free, %u bad\n", argv[0], l->fat, l->clusters, ck.used_clusters, ck.free_clusters, ck.bad_clusters);
+
+	if (rv) {
+		printf("%s: %u problems (%u lost clusters in %u chains, %u cross-links, %u bad links, %u size mismatches)\n", argv[0], ck.problems, ck.lost_clusters, ck.lost_chains, ck.cross_links, ck.bad_links, ck.size_mismatches);
+	}
+
+	msdos_image_close(im);
+	return rv;
+}
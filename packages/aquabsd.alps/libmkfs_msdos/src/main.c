@@ -0,0 +1,221 @@
+// command-line frontend to libmkfs_msdos
+// takes the same options as 'newfs_msdos(8)', plus '-D' to populate the new file system from a directory in the same pass, like 'makefs(8)' does
+// a special of '-' writes the image to stdout, so that it can be piped somewhere without being staged on disk first (its size is taken from '-C')
+
+// TODO
+//  - manual page
+
+#include <sys/cdefs.h>
+__FBSDID("$FreeBSD$");
+
+#include "mkfs_msdos.h"
+
+#include <ctype.h>
+#include <err.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/param.h>
+#include <sys/stat.h>
+
+static const struct {
+	char opt;
+	int min;
+	const char* desc;
+} opts[] = {
+#define AOPT(_opt, _type, _name, _min, _desc) { _opt, _min, _desc },
+ALLOPTS
+#undef AOPT
+};
+
+static void __dead2 usage(void) {
+	fprintf(stderr,
+		"usage: %s [options] special [disktype]\n"
+		"where the options are:\n",
+	getprogname());
+
+	for (size_t i = 0; i < nitems(opts); i++) {
+		fprintf(stderr, "\t-%c %s\n", opts[i].opt, opts[i].desc);
+	}
+
+	exit(EXIT_FAILURE);
+}
+
+// parse a number (with an optional k/m/g/t suffix) into an option field of the given size
+// booleans & strings are set directly
+
+static int __set_opt(char opt, int min, void* field, size_t size, const char* arg) {
+	if (min == -2) {
+		*(bool*) field = true;
+		return 0;
+	}
+
+	if (min == -1) {
+		*(const char**) field = arg;
+		return 0;
+	}
+
+	char* end;
+	errno = 0;
+	uintmax_t val = strtoumax(arg, &end, 0);
+
+	if (errno || end == arg) {
+		warnx("-%c: %s: bad number", opt, arg);
+		return -1;
+	}
+
+	uintmax_t mul = 1;
+
+	switch (tolower(*end)) {
+	case 't': mul <<= 10; // FALLTHROUGH
+	case 'g': mul <<= 10; // FALLTHROUGH
+	case 'm': mul <<= 10; // FALLTHROUGH
+	case 'k': mul <<= 10;
+		end++;
+		break;
+	}
+
+	// sizes are all signed 64-bit quantities (off_t & time_t), so leave the sign bit alone
+
+	uintmax_t max = size == 8 ? INT64_MAX : (UINTMAX_C(1) << (size * 8)) - 1;
+
+	if (*end || val > max / mul || val * mul < (uintmax_t) min || val * mul > max) {
+		warnx("-%c: %s: bad value", opt, arg);
+		return -1;
+	}
+
+	val *= mul;
+
+	if (size == 1) *(uint8_t*) field = val;
+	else if (size == 2) *(uint16_t*) field = val;
+	else if (size == 4) *(uint32_t*) field = val;
+	else *(uint64_t*) field = val;
+
+	return 0;
+}
+
+// write to stdout rather than a file or device
+// the plan summary would get mixed up with the image, so it isn't printed
+
+static int __stream(const char* dtype, struct msdos_options* o) {
+	if (!o->create_size) {
+		warnx("writing to stdout needs an image size (-C)");
+		return -1;
+	}
+
+	if (isatty(STDOUT_FILENO)) {
+		warnx("not writing an image to a terminal");
+		return -1;
+	}
+
+	struct msdos_plan plan;
+
+	if (mkfs_msdos_plan(NULL, dtype, o, &plan) < 0) {
+		return -1;
+	}
+
+	if (o->no_create) {
+		return 0;
+	}
+
+	// if stdout was redirected to a file instead, it's written in place like with any other image
+
+	struct stat sb;
+
+	if (!fstat(STDOUT_FILENO, &sb) && S_ISREG(sb.st_mode) && ftruncate(STDOUT_FILENO, o->create_size) < 0) {
+		warn("ftruncate");
+		return -1;
+	}
+
+	return mkfs_msdos_write(&plan, STDOUT_FILENO);
+}
+
+// SIGINFO just counts, and the library reports the sector being written whenever the count changes
+
+static volatile sig_atomic_t info_count = 0;
+
+static void __info_handler(int sig __unused) {
+	info_count++;
+}
+
+int main(int argc, char* argv[]) {
+	struct msdos_options o = { 0 };
+
+#if defined(SIGINFO)
+	struct sigaction sa = { .sa_handler = __info_handler };
+
+	if (sigaction(SIGINFO, &sa, NULL) < 0) {
+		err(EXIT_FAILURE, "sigaction(SIGINFO)");
+	}
+
+	o.info_count = &info_count;
+#endif
+
+	// build the getopt string from the list of options
+
+	char optstr[nitems(opts) * 2 + 1];
+	size_t len = 0;
+
+	for (size_t i = 0; i < nitems(opts); i++) {
+		optstr[len++] = opts[i].opt;
+
+		if (opts[i].min != -2) {
+			optstr[len++] = ':';
+		}
+	}
+
+	optstr[len] = '\0';
+
+	int c;
+
+	while ((c = getopt(argc, argv, optstr)) >= 0) {
+		switch (c) {
+#define AOPT(_opt, _type, _name, _min, _desc) \
+		case _opt: \
+			if (__set_opt(_opt, _min, &o._name, sizeof o._name, optarg) < 0) \
+				return EXIT_FAILURE; \
+			break;
+ALLOPTS
+#undef AOPT
+		default:
+			usage();
+		}
+
+		if (c == 'I') {
+			o.volume_id_set = true;
+		}
+
+		else if (c == 'T') {
+			o.timestamp_set = true;
+		}
+
+		else if (c == 'm') {
+			o.media_descriptor_set = true;
+		}
+
+		else if (c == 'o') {
+			o.hidden_sectors_set = true;
+		}
+	}
+
+	argc -= optind;
+	argv += optind;
+
+	if (argc < 1 || argc > 2) {
+		usage();
+	}
+
+	char* const fname = argv[0];
+	char* const dtype = argc == 2 ? argv[1] : NULL;
+
+	if (!strcmp(fname, "-")) {
+		return __stream(dtype, &o) < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+	}
+
+	return mkfs_msdos(fname, dtype, &o) < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,217 @@
+// command-line frontend to 'mkfs_msdos_disk()': partitions a disk image & formats each partition as FAT, all in one pass
+// each partition is described by a list of comma-separated suboptions (see 'getsubopt(3)'):
+//  - 'size=N' (with an optional k/m/g/t suffix), which may only be left out for the last partition if the disk's size is given
+//  - 'name=NAME' for the GPT partition name
+//  - 'efi' to make it an EFI system partition
+//  - 'fat=12|16|32', 'spc=N', 'label=LABEL' & 'dir=DIR' are passed on as '-F', '-c', '-L' & '-D' are by 'mkfs_msdos'
+// an image of '-' writes the disk to stdout, as 'mkfs_msdos' does
+
+#include <sys/cdefs.h>
+__FBSDID("$FreeBSD$");
+
+#include "mkfs_msdos.h"
+
+#include <ctype.h>
+#include <err.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+static void __dead2 usage(void) {
+	fprintf(stderr,
+		"usage: %s [-mZ] [-a align] [-S sector_size] [-s size] [-T timestamp] image partition ...\n"
+		"where each partition is [size=size][,name=name][,efi][,fat=type][,spc=sectors_per_cluster][,label=label][,dir=dir]\n",
+	getprogname());
+
+	exit(EXIT_FAILURE);
+}
+
+// parse a size with an optional k/m/g/t suffix
+
+static int __size(const char* what, const char* arg, uint64_t* val) {
+	char* end;
+	errno = 0;
+	uintmax_t const n = strtoumax(arg, &end, 0);
+
+	if (errno || end == arg) {
+		warnx("%s: %s: bad number", what, arg);
+		return -1;
+	}
+
+	int shift = 0;
+
+	switch (tolower(*end)) {
+	case 't': shift += 10; // FALLTHROUGH
+	case 'g': shift += 10; // FALLTHROUGH
+	case 'm': shift += 10; // FALLTHROUGH
+	case 'k': shift += 10;
+		end++;
+		break;
+	}
+
+	if (*end || n > (uintmax_t) (INT64_MAX >> shift)) {
+		warnx("%s: %s: bad value", what, arg);
+		return -1;
+	}
+
+	*val = n << shift;
+	return 0;
+}
+
+static int __partition(char* spec, struct msdos_partition* part, struct msdos_options* o) {
+	char* const subopts[] = { "size", "name", "efi", "fat", "spc", "label", "dir", NULL };
+	char* val;
+	uint64_t n;
+
+	part->options = o;
+
+	while (*spec) {
+		int const sub = getsubopt(&spec, subopts, &val);
+
+		if (sub < 0) {
+			warnx("%s: unknown partition option", val);
+			return -1;
+		}
+
+		if (!val && strcmp(subopts[sub], "efi")) {
+			warnx("%s: needs a value", subopts[sub]);
+			return -1;
+		}
+
+		if (!strcmp(subopts[sub], "size")) {
+			if (__size("size", val, &n) < 0) {
+				return -1;
+			}
+
+			part->size = n;
+		}
+
+		else if (!strcmp(subopts[sub], "name")) {
+			part->name = val;
+		}
+
+		else if (!strcmp(subopts[sub], "efi")) {
+			part->efi = true;
+		}
+
+		else if (!strcmp(subopts[sub], "fat")) {
+			o->fat_type = atoi(val);
+
+			if (o->fat_type != 12 && o->fat_type != 16 && o->fat_type != 32) {
+				warnx("fat: %s: bad FAT type", val);
+				return -1;
+			}
+		}
+
+		else if (!strcmp(subopts[sub], "spc")) {
+			int const spc = atoi(val);
+
+			if (spc < 1 || spc > 128) {
+				warnx("spc: %s: bad number of sectors per cluster", val);
+				return -1;
+			}
+
+			o->sectors_per_cluster = spc;
+		}
+
+		else if (!strcmp(subopts[sub], "label")) {
+			o->volume_label = val;
+		}
+
+		else {
+			o->source_dir = val;
+		}
+	}
+
+	return 0;
+}
+
+int main(int argc, char* argv[]) {
+	struct msdos_disk disk = { 0 };
+	struct msdos_options common = { 0 };
+	uint64_t n;
+	int c;
+
+	while ((c = getopt(argc, argv, "a:mS:s:T:Z")) >= 0) {
+		if (c == 'm') {
+			disk.mbr = true;
+		}
+
+		else if (c == 'Z') {
+			common.sparse = true;
+		}
+
+		else if (c == 'a' || c == 'S' || c == 's' || c == 'T') {
+			char const what[] = { '-', c, '\0' };
+
+			if (__size(what, optarg, &n) < 0) {
+				return EXIT_FAILURE;
+			}
+
+			if ((c == 'a' && n > UINT32_MAX) || (c == 'S' && n > UINT16_MAX)) {
+				errx(EXIT_FAILURE, "%s: %s: bad value", what, optarg);
+			}
+
+			if (c == 'a') disk.align = n;
+			else if (c == 'S') disk.sector_size = n;
+			else if (c == 's') disk.size = n;
+
+			else {
+				common.timestamp = n;
+				common.timestamp_set = true;
+			}
+		}
+
+		else {
+			usage();
+		}
+	}
+
+	argc -= optind;
+	argv += optind;
+
+	if (argc < 2) {
+		usage();
+	}
+
+	char* const fname = argv[0];
+
+	disk.count = argc - 1;
+	disk.partitions = calloc(disk.count, sizeof *disk.partitions);
+	struct msdos_options* const opts = calloc(disk.count, sizeof *opts);
+
+	if (!disk.partitions || !opts) {
+		err(EXIT_FAILURE, "calloc");
+	}
+
+	for (size_t i = 0; i < disk.count; i++) {
+		opts[i] = common;
+
+		if (__partition(argv[i + 1], &disk.partitions[i], &opts[i]) < 0) {
+			return EXIT_FAILURE;
+		}
+	}
+
+	// like with 'mkfs_msdos', '-' is stdout, which can be a pipe or a file it was redirected to
+
+	bool const to_stdout = !strcmp(fname, "-");
+
+	if (to_stdout && isatty(STDOUT_FILENO)) {
+		errx(EXIT_FAILURE, "not writing a disk image to a terminal");
+	}
+
+	if (mkfs_msdos_disk(to_stdout ? "stdout" : fname, to_stdout ? STDOUT_FILENO : -1, &disk) < 0) {
+		return EXIT_FAILURE;
+	}
+
+	// say where everything ended up, unless stdout has the image
+
+	for (size_t i = 0; !to_stdout && i < disk.count; i++) {
+		printf("%s: partition %zu at %jd\n", fname, i + 1, (intmax_t) disk.partitions[i].offset);
+	}
+
+	return EXIT_SUCCESS;
+}
@@ -40,44 +40,48 @@ static const char rcsid[] =
 #include <sys/disklabel.h>
 #include <sys/mount.h>
 #endif
+#include <sys/ioctl.h>
 #include <sys/stat.h>
 #include <sys/sysctl.h>
 #include <sys/time.h>
+#include <sys/uio.h>
 
 #include <assert.h>
 #include <ctype.h>
+#include <dirent.h>
 #include <err.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <inttypes.h>
+#include <limits.h>
 #include <paths.h>
+#include <pthread.h>
 #include <signal.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
 #include <unistd.h>
 
+#include <copyfile.h>
+
 #include "mkfs_msdos.h"
+#include "msdosfs.h"
 
 #define	MAXU16	  0xffff	/* maximum unsigned 16-bit quantity */
 #define	BPN	  4		/* bits per nibble */
 #define	NPB	  2		/* nibbles per byte */
 
-#define	DOSMAGIC  0xaa55	/* DOS magic number */
-#define	MINBPS	  512		/* minimum bytes per sector */
-#define	MAXBPS    4096		/* maximum bytes per sector */
 #define	MAXSPC	  128		/* maximum sectors per cluster */
 #define	MAXNFT	  16		/* maximum number of FATs */
 #define	DEFBLK	  4096		/* default block size */
 #define	DEFBLK16  2048		/* default block size FAT16 */
 #define	DEFRDE	  512		/* default root directory entries */
-#define	RESFTE	  2		/* reserved FAT entries */
 #define	MINCLS12  1U		/* minimum FAT12 clusters */
 #define	MINCLS16  0xff5U	/* minimum FAT16 clusters */
 #define	MINCLS32  0xfff5U	/* minimum FAT32 clusters */
-#define	MAXCLS12  0xff4U	/* maximum FAT12 clusters */
-#define	MAXCLS16  0xfff4U	/* maximum FAT16 clusters */
 #define	MAXCLS32  0xffffff4U	/* maximum FAT32 clusters */
 
 #define	mincls(fat)  ((fat) == 12 ? MINCLS12 :	\
@@ -101,79 +105,11 @@ static const char rcsid[] =
     (p)[2] = (u_int8_t)((x) >> 020),		\
     (p)[3] = (u_int8_t)((x) >> 030)
 
-struct bs {
-    u_int8_t bsJump[3];			/* bootstrap entry point */
-    u_int8_t bsOemName[8];		/* OEM name and version */
-} __packed;
-
-struct bsbpb {
-    u_int8_t bpbBytesPerSec[2];		/* bytes per sector */
-    u_int8_t bpbSecPerClust;		/* sectors per cluster */
-    u_int8_t bpbResSectors[2];		/* reserved sectors */
-    u_int8_t bpbFATs;			/* number of FATs */
-    u_int8_t bpbRootDirEnts[2];		/* root directory entries */
-    u_int8_t bpbSectors[2];		/* total sectors */
-    u_int8_t bpbMedia;			/* media descriptor */
-    u_int8_t bpbFATsecs[2];		/* sectors per FAT */
-    u_int8_t bpbSecPerTrack[2];		/* sectors per track */
-    u_int8_t bpbHeads[2];		/* drive heads */
-    u_int8_t bpbHiddenSecs[4];		/* hidden sectors */
-    u_int8_t bpbHugeSectors[4];		/* big total sectors */
-} __packed;
-
-struct bsxbpb {
-    u_int8_t bpbBigFATsecs[4];		/* big sectors per FAT */
-    u_int8_t bpbExtFlags[2];		/* FAT control flags */
-    u_int8_t bpbFSVers[2];		/* file system version */
-    u_int8_t bpbRootClust[4];		/* root directory start cluster */
-    u_int8_t bpbFSInfo[2];		/* file system info sector */
-    u_int8_t bpbBackup[2];		/* backup boot sector */
-    u_int8_t bpbReserved[12];		/* reserved */
-} __packed;
-
-struct bsx {
-    u_int8_t exDriveNumber;		/* drive number */
-    u_int8_t exReserved1;		/* reserved */
-    u_int8_t exBootSignature;		/* extended boot signature */
-    u_int8_t exVolumeID[4];		/* volume ID number */
-    u_int8_t exVolumeLabel[11];		/* volume label */
-    u_int8_t exFileSysType[8];		/* file system type */
-} __packed;
-
-struct de {
-    u_int8_t deName[11];		/* name and extension */
-    u_int8_t deAttributes;		/* attributes */
-    u_int8_t rsvd[10];			/* reserved */
-    u_int8_t deMTime[2];		/* last-modified time */
-    u_int8_t deMDate[2];		/* last-modified date */
-    u_int8_t deStartCluster[2];		/* starting cluster */
-    u_int8_t deFileSize[4];		/* size */
-} __packed;
-
-struct bpb {
-    u_int bpbBytesPerSec;		/* bytes per sector */
-    u_int bpbSecPerClust;		/* sectors per cluster */
-    u_int bpbResSectors;		/* reserved sectors */
-    u_int bpbFATs;			/* number of FATs */
-    u_int bpbRootDirEnts;		/* root directory entries */
-    u_int bpbSectors;			/* total sectors */
-    u_int bpbMedia;			/* media descriptor */
-    u_int bpbFATsecs;			/* sectors per FAT */
-    u_int bpbSecPerTrack;		/* sectors per track */
-    u_int bpbHeads;			/* drive heads */
-    u_int bpbHiddenSecs;		/* hidden sectors */
-    u_int bpbHugeSectors; 		/* big total sectors */
-    u_int bpbBigFATsecs; 		/* big sectors per FAT */
-    u_int bpbRootClust; 		/* root directory start cluster */
-    u_int bpbFSInfo; 			/* file system info sector */
-    u_int bpbBackup; 			/* backup boot sector */
-};
-
 #define	BPBGAP 0, 0, 0, 0, 0, 0
 
 static struct {
     const char *name;
-    struct bpb bpb;
+    struct msdos_bpb bpb;
 } const stdfmt[] = {
     {"160",  {512, 1, 1, 2,  64,  320, 0xfe, 1,  8, 1, BPBGAP}},
     {"180",  {512, 1, 1, 2,  64,  360, 0xfc, 2,  9, 1, BPBGAP}},
@@ -219,62 +155,193 @@ static const u_int8_t bootcode[] = {
     0
 };
 
-static volatile sig_atomic_t got_siginfo;
-static void infohandler(int);
+#ifndef IOV_MAX
+#define	IOV_MAX	  1024
+#endif
+
+#define	ZEROSZ	  (64 * 1024)	/* size of the shared zero buffer */
+#define	COPYSZ	  (64 * 1024 * 1024) /* file data copied at a time */
+#define	TPLMAX	  8		/* templates kept */
+#define	TPLSZ	  (1024 * 1024)	/* largest template kept */
+
+/*
+ * Never written to: runs of zero sectors are all written from here.
+ */
+static u_int8_t zeros[ZEROSZ];
+
+/*
+ * Sectors are built one at a time at img, and collected into a batch
+ * written with a single pwritev(2).  Only the sectors with data take up
+ * room in the buffer, which holds io_depth chunks of chunksize bytes:
+ * runs of zero sectors become iovecs pointing at the shared zero
+ * buffer, so they cost neither copying nor memory, and a batch can span
+ * IOV_MAX of them.  In sparse mode, zero sectors aren't written at all:
+ * the batch collected so far is written out, and the next one starts
+ * after the zero sector.
+ */
+struct sectwriter {
+    int fd;
+    off_t offset;			/* byte offset of sector 0 */
+    u_int bps;				/* bytes per sector */
+    bool sparse;			/* skip all-zero sectors */
+    bool stream;			/* fd can't seek, write in order */
+    u_int8_t *buf, *end;		/* buffer for sectors with data */
+    u_int8_t *img;			/* sector being built */
+    u_int lsn;				/* sector at the start of the batch */
+    struct iovec iov[IOV_MAX];		/* batch */
+    int iovcnt;
+    size_t len;				/* bytes in batch */
+    u_int8_t *mem;			/* in-memory target instead of fd */
+    size_t memlen;
+    struct template *tpl;		/* or a template being made */
+    const char *fname;
+    const struct msdos_options *o;	/* for the progress callback */
+    u_int total;			/* sectors to be written */
+    struct timespec start;
+    double next_report;			/* seconds after start */
+};
+
+/*
+ * Images created with the same options come out the same, bar the volume
+ * ID and the time stamp on the volume label.  So the non-zero sectors of
+ * the first one are kept as a template, as runs of consecutive sectors,
+ * and the next ones are formatted by just stamping it into the (fresh,
+ * and so zeroed) image, patching those two fields.  The key is the
+ * options which change what gets written, and the disk type.
+ */
+struct tplrun {
+    u_int lsn;
+    u_int count;
+    size_t off;				/* in data */
+};
+
+struct template {
+    struct template *next;
+    struct msdos_options key;		/* strings are below */
+    char *dtype, *floppy, *label, *oem;
+    struct msdos_layout layout;
+    struct tplrun *runs;
+    u_int nruns, maxruns;
+    u_int8_t *data;
+    size_t len, maxlen;
+    bool toobig;			/* over TPLSZ, don't keep */
+    size_t volid[2];			/* volume ID offsets, in data */
+    size_t labelent;			/* volume label entry offset */
+};
+
+static struct template *templates;	/* most recently used first */
+static pthread_mutex_t template_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * When populating the file system from a directory (-D), the whole tree
+ * is scanned before anything is written.  Clusters are handed out in
+ * the order the tree is walked, so every chain is contiguous and the
+ * chains follow each other without gaps: the FAT and the directories can
+ * then be generated a sector at a time, and the image written front to
+ * back in a single pass, with file data copied straight from the source.
+ */
+struct pnode {
+    char *path;				/* source path */
+    u_int8_t name[11];			/* short name */
+    bool hasname;			/* short name assigned yet */
+    u_int16_t *lname;			/* long name (UCS-2), or NULL */
+    u_int lnamelen;			/* long name length */
+    bool isdir;
+    off_t size;				/* file size */
+    time_t mtime;			/* last-modified time */
+    u_int clust;			/* first cluster, 0 if none */
+    u_int nclust;			/* clusters in chain */
+    struct pnode *parent;
+    struct pnode **kids;		/* directory contents */
+    u_int nkids;
+    u_int nents;			/* directory entries */
+    u_int pre;				/* ".", ".." or volume label entries */
+    u_int ecur, kcur, lcur;		/* directory entry generator state */
+};
+
+struct populate {
+    struct pnode *root;
+    struct pnode **order;		/* nodes with clusters, by cluster */
+    u_int norder;
+    u_int fat;				/* FAT type */
+    u_int bpc;				/* bytes per cluster */
+    u_int cls;				/* clusters in file system */
+    u_int next;				/* first free cluster */
+    bool fixed_tm;			/* stamp everything with tm */
+    struct tm tm;
+};
+
+#ifndef MAKEFS
+/* getdiskbyname() returns a static buffer */
+static pthread_mutex_t disktab_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
 
+static int checkopts(const struct msdos_options *);
+static int plan_internal(const char *, const char *,
+    const struct msdos_options *, int, off_t, struct msdos_plan *);
+static int write_internal(const struct msdos_plan *, const char *, int,
+    u_int8_t *, size_t, struct template *);
+static struct tm *getstamp(const struct msdos_options *, struct tm *,
+    u_int *);
+static void stamplabel(struct de *, const struct tm *);
+static void print_plan(const char *, const struct msdos_plan *);
 static int check_mounted(const char *, mode_t);
 static ssize_t getchunksize(void);
-static int getstdfmt(const char *, struct bpb *);
-static int getdiskinfo(int, const char *, const char *, int, struct bpb *);
-static void print_bpb(struct bpb *);
+static int getstdfmt(const char *, struct msdos_bpb *);
+static int getdiskinfo(int, off_t, const char *, const char *, int,
+    struct msdos_bpb *);
+static void print_bpb(const struct msdos_bpb *);
 static int ckgeom(const char *, u_int, const char *);
 static void mklabel(u_int8_t *, const char *);
 static int oklabel(const char *);
 static void setstr(u_int8_t *, const char *, size_t);
+static int sw_writev(int, struct iovec *, int);
+static int sw_pad(struct sectwriter *, off_t);
+static int sw_flush(struct sectwriter *);
+static int sw_commit(struct sectwriter *, bool);
+static void sw_progress(struct sectwriter *, bool);
+static int discard_range(int, const char *, off_t, off_t, off_t);
+static int tpl_add(struct template *, u_int, const struct iovec *, int);
+static int tpl_format(const char *, const char *,
+    const struct msdos_options *, int);
+static struct populate *pop_build(const char *, u_int, u_int, u_int, u_int,
+    bool, const struct tm *);
+static void pop_free(struct populate *);
+static bool pop_fat(struct populate *, u_int, u_int, u_int8_t *);
+static bool pop_dir(struct populate *, struct pnode *, u_int, u_int8_t *);
+static int pop_data(struct populate *, struct sectwriter *, u_int,
+    const char *);
 
 int
 mkfs_msdos(const char *fname, const char *dtype, const struct msdos_options *op)
 {
-    char buf[MAXPATHLEN];
-    struct sigaction si_sa;
     struct stat sb;
-    struct timeval tv;
-    struct bpb bpb;
-    struct tm *tm;
-    struct bs *bs;
-    struct bsbpb *bsbpb;
-    struct bsxbpb *bsxbpb;
-    struct bsx *bsx;
-    struct de *de;
-    u_int8_t *img;
-    u_int8_t *physbuf, *physbuf_end;
-    const char *bname;
-    ssize_t n;
-    time_t now;
-    u_int fat, bss, rds, cls, dir, lsn, x, x1, x2;
-    u_int extra_res, alignment, saved_x, attempts=0;
-    bool set_res, set_spf, set_spc;
-    int fd, fd1, rv;
+    struct msdos_plan plan;
     struct msdos_options o = *op;
-    ssize_t chunksize;
+    int fd, rv;
 
-    physbuf = NULL;
     rv = -1;
-    fd = fd1 = -1;
+    fd = -1;
 
-    if (o.block_size && o.sectors_per_cluster) {
-	warnx("Cannot specify both block size and sectors per cluster");
+    if (checkopts(&o) == -1)
 	goto done;
+    if (o.sparse && !o.create_size) {
+	/*
+	 * Skipping zero sectors relies on the target already reading back
+	 * as zeros, which we only know for files we've just created.
+	 */
+	warnx("warning, -Z needs -C, writing all sectors");
+	o.sparse = false;
     }
-    if (o.OEM_string && strlen(o.OEM_string) > 8) {
-	warnx("%s: bad OEM string", o.OEM_string);
+    if (o.no_create && o.create_size) {
+	/* nothing to look at, just print what would be created */
+	if (plan_internal(fname, dtype, &o, -1, o.create_size, &plan) == -1)
+	    goto done;
+	print_plan(fname, &plan);
+	rv = 0;
 	goto done;
     }
     if (o.create_size) {
-	if (o.no_create) {
-	    warnx("create (-C) is incompatible with -N");
-	    goto done;
-	}
 	fd = open(fname, O_RDWR | O_CREAT | O_TRUNC, 0644);
 	if (fd == -1) {
 	    warnx("failed to create %s", fname);
@@ -297,7 +364,8 @@ mkfs_msdos(const char *fname, const char *dtype, const struct msdos_options *op)
 	    warnx("warning, %s is not a regular file", fname);
     } else {
 #ifdef MAKEFS
-	errx(1, "o.create_size must be set!");
+	warnx("o.create_size must be set!");
+	goto done;
 #else
 	if (!S_ISCHR(sb.st_mode))
 	    warnx("warning, %s is not a character device", fname);
@@ -312,6 +380,236 @@ mkfs_msdos(const char *fname, const char *dtype, const struct msdos_options *op)
 	warnx("cannot seek to %jd", (intmax_t)o.offset);
 	goto done;
     }
+    /* bootstrap files and directories may change between formats */
+    if (o.create_size && S_ISREG(sb.st_mode) && !o.no_create &&
+	!o.bootstrap && !o.source_dir) {
+	rv = tpl_format(fname, dtype, &o, fd);
+	goto done;
+    }
+    if (plan_internal(fname, dtype, &o, fd, 0, &plan) == -1)
+	goto done;
+    print_plan(fname, &plan);
+    rv = o.no_create ? 0 : write_internal(&plan, fname, fd, NULL, 0, NULL);
+done:
+    if (fd != -1)
+	    close(fd);
+
+    return rv;
+}
+
+/*
+ * Format the len bytes at buf, rather than a file or device.  The
+ * geometry is made up the same way as for image files.  With the sparse
+ * option, buf is assumed to be zeroed already (e.g. fresh from calloc()
+ * or an anonymous mmap()), and all-zero sectors aren't touched.
+ */
+int
+mkfs_msdos_mem(void *buf, size_t len, const struct msdos_options *op)
+{
+    struct msdos_plan plan;
+    struct msdos_options o = *op;
+
+    if (checkopts(&o) == -1)
+	return -1;
+    if (o.create_size) {
+	warnx("create (-C) is meaningless for in-memory targets");
+	return -1;
+    }
+    if (o.offset < 0 || (size_t)o.offset >= len) {
+	warnx("offset %jd is outside of the buffer", (intmax_t)o.offset);
+	return -1;
+    }
+    if (plan_internal("(memory)", NULL, &o, -1, len, &plan) == -1)
+	return -1;
+    /* an explicit size or geometry can claim more than there is */
+    if ((uintmax_t)plan.layout.total_sectors *
+	plan.layout.bpb.bpbBytesPerSec + o.offset > len) {
+	warnx("file system doesn't fit in the %zu byte buffer", len);
+	return -1;
+    }
+    print_plan("(memory)", &plan);
+    return o.no_create ? 0 :
+	write_internal(&plan, "(memory)", -1, buf, len, NULL);
+}
+
+/*
+ * Work out the layout of a file system without writing anything.  The
+ * geometry comes from fname if given, unless the options say to create
+ * an image (in which case it's made up from the size, and fname needn't
+ * exist yet); without fname, the options have to say how large the file
+ * system is, either through create_size or explicit geometry.
+ */
+int
+mkfs_msdos_plan(const char *fname, const char *dtype,
+    const struct msdos_options *op, struct msdos_plan *plan)
+{
+    int fd, rv;
+
+    if (checkopts(op) == -1)
+	return -1;
+    if (fname == NULL || op->create_size)
+	return plan_internal(fname ? fname : "(plan)", dtype, op, -1,
+	    op->create_size, plan);
+    if ((fd = open(fname, O_RDONLY)) == -1) {
+	warn("%s", fname);
+	return -1;
+    }
+    rv = plan_internal(fname, dtype, op, fd, 0, plan);
+    close(fd);
+    return rv;
+}
+
+/*
+ * Write a file system laid out by mkfs_msdos_plan() to fd, starting at
+ * the offset it was planned with; the same plan can be written to any
+ * number of targets.  If fd is a pipe or socket, the image is streamed
+ * to it from the start instead, zeros and all (see prefix_only).
+ * Unlike mkfs_msdos(), this doesn't check whether fd is mounted, and
+ * the sparse option is taken at its word: only ask for it if fd is
+ * known to read back as zeros.
+ */
+int
+mkfs_msdos_write(const struct msdos_plan *plan, int fd)
+{
+    char name[32];
+
+    snprintf(name, sizeof(name), "descriptor %d", fd);
+    return write_internal(plan, name, fd, NULL, 0, NULL);
+}
+
+struct batch {
+    struct msdos_target *targets;
+    size_t count;
+    size_t next;			/* next target to format */
+    pthread_mutex_t lock;
+};
+
+static void *
+batch_worker(void *arg)
+{
+    struct batch *b = arg;
+    struct msdos_target *t;
+
+    for (;;) {
+	pthread_mutex_lock(&b->lock);
+	t = b->next < b->count ? &b->targets[b->next++] : NULL;
+	pthread_mutex_unlock(&b->lock);
+	if (t == NULL)
+	    return NULL;
+	t->status = mkfs_msdos(t->fname, t->dtype, t->options);
+    }
+}
+
+/*
+ * Format count targets, jobs at a time (or as many at a time as there
+ * are CPUs online if jobs is 0), each on its own thread.  Each
+ * target's status is set to what mkfs_msdos() returned for it;
+ * returns -1 if any of them failed.
+ */
+int
+mkfs_msdos_batch(struct msdos_target *targets, size_t count, u_int jobs)
+{
+    struct batch b;
+    pthread_t *tids;
+    size_t i, n;
+    int error, rv;
+
+    if (count == 0)
+	return 0;
+    if (jobs == 0) {
+	long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+	jobs = ncpu > 0 ? ncpu : 1;
+    }
+    n = MIN(jobs, count);
+    if ((tids = calloc(n, sizeof(*tids))) == NULL) {
+	warn(NULL);
+	return -1;
+    }
+    b.targets = targets;
+    b.count = count;
+    b.next = 0;
+    pthread_mutex_init(&b.lock, NULL);
+    for (i = 0; i < count; i++)
+	targets[i].status = -1;
+    for (i = 0; i < n; i++)
+	if ((error = pthread_create(&tids[i], NULL, batch_worker, &b)) != 0) {
+	    warnc(error, "pthread_create");
+	    break;
+	}
+    /* whatever threads did get created drain the queue */
+    if (i == 0)
+	batch_worker(&b);
+    n = i;
+    for (i = 0; i < n; i++)
+	pthread_join(tids[i], NULL);
+    pthread_mutex_destroy(&b.lock);
+    free(tids);
+    rv = 0;
+    for (i = 0; i < count; i++)
+	if (targets[i].status == -1)
+	    rv = -1;
+    return rv;
+}
+
+/*
+ * Print out the file system parameters.
+ */
+static void
+print_plan(const char *fname, const struct msdos_plan *plan)
+{
+    const struct msdos_layout *l = &plan->layout;
+    u_int spc = l->bpb.bpbSecPerClust;
+
+    /* keep the lines together when formatting several targets at once */
+    flockfile(stdout);
+    printf("%s: %u sector%s in %u FAT%u cluster%s "
+	   "(%u bytes/cluster)\n", fname, l->clusters * spc,
+	   l->clusters * spc == 1 ? "" : "s", l->clusters, l->fat,
+	   l->clusters == 1 ? "" : "s", l->bpb.bpbBytesPerSec * spc);
+    print_bpb(&l->bpb);
+    funlockfile(stdout);
+}
+
+/*
+ * Sanity checks on the options which don't need the target.
+ */
+static int
+checkopts(const struct msdos_options *o)
+{
+    if (o->block_size && o->sectors_per_cluster) {
+	warnx("Cannot specify both block size and sectors per cluster");
+	return -1;
+    }
+    if (o->OEM_string && strlen(o->OEM_string) > 8) {
+	warnx("%s: bad OEM string", o->OEM_string);
+	return -1;
+    }
+    return 0;
+}
+
+/*
+ * Work out the layout of the file system on fname, which is either the
+ * open descriptor fd or, if fd is -1, size bytes (of memory, or of an
+ * image which is yet to be created).
+ */
+static int
+plan_internal(const char *fname, const char *dtype,
+    const struct msdos_options *op, int fd, off_t size,
+    struct msdos_plan *plan)
+{
+    char buf[MAXPATHLEN];
+    struct stat sb;
+    struct msdos_bpb bpb;
+    const char *bname;
+    u_int fat, bss, rds, cls, x, x1, x2;
+    u_int extra_res, alignment, unit, base, saved_x, attempts=0;
+    bool set_res, set_spf, set_spc;
+    int fd1, rv;
+    struct msdos_options o = *op;
+
+    rv = -1;
+    fd1 = -1;
+
     memset(&bpb, 0, sizeof(bpb));
     if (o.floppy) {
 	if (getstdfmt(o.floppy, &bpb) == -1)
@@ -333,7 +631,8 @@ mkfs_msdos(const char *fname, const char *dtype, const struct msdos_options *op)
 	bpb.bpbHiddenSecs = o.hidden_sectors;
     if (!(o.floppy || (o.drive_heads && o.sectors_per_track &&
 	o.bytes_per_sector && o.size && o.hidden_sectors_set))) {
-	if (getdiskinfo(fd, fname, dtype, o.hidden_sectors_set, &bpb) == -1)
+	if (getdiskinfo(fd, size, fname, dtype, o.hidden_sectors_set,
+	    &bpb) == -1)
 		goto done;
 	bpb.bpbHugeSectors -= (o.offset / bpb.bpbBytesPerSec);
 	if (bpb.bpbSecPerClust == 0) {	/* set defaults */
@@ -397,6 +696,18 @@ mkfs_msdos(const char *fname, const char *dtype, const struct msdos_options *op)
 	}
 	bpb.bpbSecPerClust = o.block_size / bpb.bpbBytesPerSec;
     }
+    if (o.erase_size) {
+	if (!powerof2(o.erase_size) || o.erase_size < bpb.bpbBytesPerSec) {
+	    warnx("erase block size (%u) must be a power of 2 no smaller "
+		"than %u", o.erase_size, bpb.bpbBytesPerSec);
+	    goto done;
+	}
+	if (o.offset % bpb.bpbBytesPerSec) {
+	    warnx("offset %jd is not a whole number of sectors",
+		(intmax_t)o.offset);
+	    goto done;
+	}
+    }
     if (o.sectors_per_cluster) {
 	if (!powerof2(o.sectors_per_cluster)) {
 	    warnx("sectors/cluster (%u) is not a power of 2",
@@ -509,6 +820,17 @@ mkfs_msdos(const char *fname, const char *dtype, const struct msdos_options *op)
     set_spc = (bpb.bpbSecPerClust == 0);
     saved_x = x;
 
+    /*
+     * With an erase block size, the data region is aligned to it instead,
+     * counting from the start of the device: o.offset if formatting at an
+     * offset, or else the hidden sectors (the start of the partition).
+     * Both sizes being powers of 2, every erase block then starts on a
+     * cluster boundary, or every cluster on an erase block boundary.
+     */
+    base = 0;
+    if (o.erase_size)
+	base = o.offset ? o.offset / bpb.bpbBytesPerSec : bpb.bpbHiddenSecs;
+
     /*
      * Attempt to align the root directory to cluster if o.align is set.
      * This is done by padding with reserved blocks. Note that this can
@@ -566,7 +888,15 @@ mkfs_msdos(const char *fname, const char *dtype, const struct msdos_options *op)
 		bpb.bpbBigFATsecs = x2;
 	    x1 += (bpb.bpbBigFATsecs - 1) * bpb.bpbFATs;
 	}
-	if (set_res) {
+	if (o.erase_size) {
+	    /* attempt to align data region */
+	    unit = o.erase_size / bpb.bpbBytesPerSec;
+	    alignment = (base + bpb.bpbResSectors +
+		bpb.bpbBigFATsecs * bpb.bpbFATs + rds) % unit;
+	    /* the padding has to fit in the BPB's 16-bit field */
+	    if (set_res && bpb.bpbResSectors + (unit - alignment) <= MAXU16)
+		extra_res += unit - alignment;
+	} else if (set_res) {
 	    /* attempt to align root directory */
 	    alignment = (bpb.bpbResSectors + bpb.bpbBigFATsecs * bpb.bpbFATs) %
 		bpb.bpbSecPerClust;
@@ -574,8 +904,9 @@ mkfs_msdos(const char *fname, const char *dtype, const struct msdos_options *op)
 		extra_res += bpb.bpbSecPerClust - alignment;
 	}
 	attempts++;
-    } while (o.align && alignment != 0 && attempts < 2);
-    if (o.align && alignment != 0)
+    } while ((o.align || o.erase_size) && set_res && alignment != 0 &&
+	attempts < 2);
+    if ((o.align || o.erase_size) && alignment != 0)
 	warnx("warning: Alignment failed.");
 
     cls = (bpb.bpbHugeSectors - x1) / bpb.bpbSecPerClust;
@@ -597,10 +928,6 @@ mkfs_msdos(const char *fname, const char *dtype, const struct msdos_options *op)
 	warnx("warning: FAT type limits file system to %u sectors",
 	      bpb.bpbHugeSectors);
     }
-    printf("%s: %u sector%s in %u FAT%u cluster%s "
-	   "(%u bytes/cluster)\n", fname, cls * bpb.bpbSecPerClust,
-	   cls * bpb.bpbSecPerClust == 1 ? "" : "s", cls, fat,
-	   cls == 1 ? "" : "s", bpb.bpbBytesPerSec * bpb.bpbSecPerClust);
     if (!bpb.bpbMedia)
 	bpb.bpbMedia = !bpb.bpbHiddenSecs ? 0xf0 : 0xf8;
     if (fat == 32)
@@ -613,184 +940,304 @@ mkfs_msdos(const char *fname, const char *dtype, const struct msdos_options *op)
 	bpb.bpbFATsecs = bpb.bpbBigFATsecs;
 	bpb.bpbBigFATsecs = 0;
     }
-    print_bpb(&bpb);
-    if (!o.no_create) {
-	if (o.timestamp_set) {
-	    tv.tv_sec = now = o.timestamp;
-	    tv.tv_usec = 0;
-	    tm = gmtime(&now);
-	} else {
-	    gettimeofday(&tv, NULL);
-	    now = tv.tv_sec;
-	    tm = localtime(&now);
-	}
+    plan->options = o;
+    plan->layout.bpb = bpb;
+    plan->layout.fat = fat;
+    plan->layout.clusters = cls;
+    plan->layout.boot_sectors = bss;
+    plan->layout.fat_sector = bpb.bpbResSectors;
+    plan->layout.fat_sectors = bpb.bpbFATsecs ? bpb.bpbFATsecs :
+	bpb.bpbBigFATsecs;
+    plan->layout.dir_sector = plan->layout.fat_sector +
+	plan->layout.fat_sectors * bpb.bpbFATs;
+    plan->layout.dir_sectors = rds;
+    plan->layout.data_sector = plan->layout.dir_sector + rds;
+    plan->layout.total_sectors = bpb.bpbSectors ? bpb.bpbSectors :
+	bpb.bpbHugeSectors;
+    rv = 0;
+done:
+    if (fd1 != -1)
+	    close(fd1);
 
-	chunksize = getchunksize();
-	physbuf = malloc(chunksize);
-	if (physbuf == NULL) {
-	    warn(NULL);
+    return rv;
+}
+
+/*
+ * Write the file system laid out in plan to either fd or, if fd is -1,
+ * the memlen bytes at mem.
+ */
+static int
+write_internal(const struct msdos_plan *plan, const char *fname, int fd,
+    u_int8_t *mem, size_t memlen, struct template *tpl)
+{
+    char buf[MAXPATHLEN];
+    struct msdos_bpb bpb;
+    struct tm tmb, *tm;
+    struct bs *bs;
+    struct bsbpb *bsbpb;
+    struct bsxbpb *bsxbpb;
+    struct bsx *bsx;
+    struct de *de;
+    struct sectwriter sw;
+    struct populate *pop;
+    u_int8_t *img;
+    u_int8_t *physbuf;
+    const char *bname;
+    ssize_t n;
+    u_int fat, bss, rds, cls, dir, lsn, volid, x, x1;
+    sig_atomic_t siginfo_seen;
+    bool zero;
+    int fd1, rv;
+    struct msdos_options o = plan->options;
+    ssize_t chunksize;
+
+    physbuf = NULL;
+    pop = NULL;
+    rv = -1;
+    fd1 = -1;
+
+    bpb = plan->layout.bpb;
+    fat = plan->layout.fat;
+    bss = plan->layout.boot_sectors;
+    rds = plan->layout.dir_sectors;
+    cls = plan->layout.clusters;
+    bname = NULL;
+    if (o.bootstrap) {
+	bname = o.bootstrap;
+	if (!strchr(bname, '/')) {
+	    snprintf(buf, sizeof(buf), "/boot/%s", bname);
+	    bname = buf;
+	}
+	if ((fd1 = open(bname, O_RDONLY)) == -1) {
+	    warn("%s", bname);
 	    goto done;
 	}
-	physbuf_end = physbuf + chunksize;
-	img = physbuf;
-
-	dir = bpb.bpbResSectors + (bpb.bpbFATsecs ? bpb.bpbFATsecs :
-				   bpb.bpbBigFATsecs) * bpb.bpbFATs;
-	memset(&si_sa, 0, sizeof(si_sa));
-	si_sa.sa_handler = infohandler;
-#ifdef SIGINFO
-	if (sigaction(SIGINFO, &si_sa, NULL) == -1) {
-	    warn("sigaction SIGINFO");
+    }
+    tm = getstamp(&o, &tmb, &volid);
+    if (o.source_dir) {
+	pop = pop_build(o.source_dir, fat,
+	    bpb.bpbBytesPerSec * bpb.bpbSecPerClust, cls,
+	    fat == 32 ? 0 : bpb.bpbRootDirEnts, o.volume_label != NULL,
+	    o.timestamp_set ? tm : NULL);
+	if (pop == NULL)
 	    goto done;
+    }
+
+    chunksize = getchunksize() * (o.io_depth ? o.io_depth : 1);
+    physbuf = malloc(chunksize);
+    if (physbuf == NULL) {
+	warn(NULL);
+	goto done;
+    }
+    sw.fd = fd;
+    sw.offset = o.offset;
+    sw.bps = bpb.bpbBytesPerSec;
+    sw.sparse = o.sparse;
+    sw.buf = sw.img = physbuf;
+    sw.end = physbuf + chunksize;
+    sw.lsn = 0;
+    sw.iovcnt = 0;
+    sw.len = 0;
+    sw.mem = mem;
+    sw.memlen = memlen;
+    sw.tpl = tpl;
+    if (tpl != NULL)
+	sw.sparse = true;
+    /*
+     * Pipes and sockets get the image in order, gaps and all: the zeros
+     * up to the offset first, and then every sector to the end of the
+     * file system (or of the metadata, with prefix_only).
+     */
+    sw.stream = fd != -1 && lseek(fd, 0, SEEK_CUR) == -1 && errno == ESPIPE;
+    if (sw.stream)
+	sw.sparse = o.discard = false;
+
+    dir = bpb.bpbResSectors + (bpb.bpbFATsecs ? bpb.bpbFATsecs :
+			       bpb.bpbBigFATsecs) * bpb.bpbFATs;
+    sw.fname = fname;
+    sw.o = &o;
+    sw.total = pop != NULL ?
+	plan->layout.data_sector + (pop->next - RESFTE) * bpb.bpbSecPerClust :
+	dir + (fat == 32 ? bpb.bpbSecPerClust : rds);
+    if (sw.stream && !o.prefix_only)
+	sw.total = plan->layout.total_sectors;
+    clock_gettime(CLOCK_MONOTONIC, &sw.start);
+    sw.next_report = 0;
+    if (o.discard && fd != -1 &&
+	discard_range(fd, fname, o.offset,
+	    (off_t)plan->layout.total_sectors * bpb.bpbBytesPerSec,
+	    (off_t)sw.total * bpb.bpbBytesPerSec) == 1)
+	sw.sparse = true;
+    /*
+     * The caller's counter is only read: each format in progress
+     * remembers the last count it reported for, so that concurrent
+     * formats sharing one counter all get to report.  A progress
+     * callback replaces this reporting altogether.
+     */
+    if (o.progress != NULL)
+	o.info_count = NULL;
+    siginfo_seen = o.info_count != NULL ? *o.info_count : 0;
+    if (sw.stream && sw_pad(&sw, o.offset) == -1) {
+	warn("%s", fname);
+	goto done;
+    }
+    for (lsn = 0; lsn < dir + (fat == 32 ? bpb.bpbSecPerClust : rds); lsn++) {
+	if (o.info_count != NULL && *o.info_count != siginfo_seen) {
+		fprintf(stderr,"%s: writing sector %u of %u (%u%%)\n",
+		    fname, lsn,
+		    (dir + (fat == 32 ? bpb.bpbSecPerClust: rds)),
+		    (lsn * 100) / (dir +
+			(fat == 32 ? bpb.bpbSecPerClust: rds)));
+		siginfo_seen = *o.info_count;
 	}
-#endif
-	for (lsn = 0; lsn < dir + (fat == 32 ? bpb.bpbSecPerClust : rds); lsn++) {
-	    if (got_siginfo) {
-		    fprintf(stderr,"%s: writing sector %u of %u (%u%%)\n",
-			fname, lsn,
-			(dir + (fat == 32 ? bpb.bpbSecPerClust: rds)),
-			(lsn * 100) / (dir +
-			    (fat == 32 ? bpb.bpbSecPerClust: rds)));
-		    got_siginfo = 0;
+	img = sw.img;
+	x = lsn;
+	if (o.bootstrap &&
+	    fat == 32 && bpb.bpbBackup != MAXU16 &&
+	    bss <= bpb.bpbBackup && x >= bpb.bpbBackup) {
+	    x -= bpb.bpbBackup;
+	    if (!x && lseek(fd1, o.offset, SEEK_SET)) {
+		warn("%s", bname);
+		goto done;
+	    }
+	}
+	if (o.bootstrap && x < bss) {
+	    if ((n = read(fd1, img, bpb.bpbBytesPerSec)) == -1) {
+		warn("%s", bname);
+		goto done;
 	    }
-	    x = lsn;
-	    if (o.bootstrap &&
-		fat == 32 && bpb.bpbBackup != MAXU16 &&
-		bss <= bpb.bpbBackup && x >= bpb.bpbBackup) {
-		x -= bpb.bpbBackup;
-		if (!x && lseek(fd1, o.offset, SEEK_SET)) {
-		    warn("%s", bname);
-		    goto done;
-		}
+	    if ((unsigned)n != bpb.bpbBytesPerSec) {
+		warnx("%s: can't read sector %u", bname, x);
+		goto done;
+	    }
+	    zero = false;
+	} else {
+	    memset(img, 0, bpb.bpbBytesPerSec);
+	    zero = true;
+	}
+	if (!lsn ||
+	    (fat == 32 && bpb.bpbBackup != MAXU16 &&
+	     lsn == bpb.bpbBackup)) {
+	    zero = false;
+	    x1 = sizeof(struct bs);
+	    bsbpb = (struct bsbpb *)(img + x1);
+	    mk2(bsbpb->bpbBytesPerSec, bpb.bpbBytesPerSec);
+	    mk1(bsbpb->bpbSecPerClust, bpb.bpbSecPerClust);
+	    mk2(bsbpb->bpbResSectors, bpb.bpbResSectors);
+	    mk1(bsbpb->bpbFATs, bpb.bpbFATs);
+	    mk2(bsbpb->bpbRootDirEnts, bpb.bpbRootDirEnts);
+	    mk2(bsbpb->bpbSectors, bpb.bpbSectors);
+	    mk1(bsbpb->bpbMedia, bpb.bpbMedia);
+	    mk2(bsbpb->bpbFATsecs, bpb.bpbFATsecs);
+	    mk2(bsbpb->bpbSecPerTrack, bpb.bpbSecPerTrack);
+	    mk2(bsbpb->bpbHeads, bpb.bpbHeads);
+	    mk4(bsbpb->bpbHiddenSecs, bpb.bpbHiddenSecs);
+	    mk4(bsbpb->bpbHugeSectors, bpb.bpbHugeSectors);
+	    x1 += sizeof(struct bsbpb);
+	    if (fat == 32) {
+		bsxbpb = (struct bsxbpb *)(img + x1);
+		mk4(bsxbpb->bpbBigFATsecs, bpb.bpbBigFATsecs);
+		mk2(bsxbpb->bpbExtFlags, 0);
+		mk2(bsxbpb->bpbFSVers, 0);
+		mk4(bsxbpb->bpbRootClust, bpb.bpbRootClust);
+		mk2(bsxbpb->bpbFSInfo, bpb.bpbFSInfo);
+		mk2(bsxbpb->bpbBackup, bpb.bpbBackup);
+		x1 += sizeof(struct bsxbpb);
 	    }
-	    if (o.bootstrap && x < bss) {
-		if ((n = read(fd1, img, bpb.bpbBytesPerSec)) == -1) {
-		    warn("%s", bname);
-		    goto done;
-		}
-		if ((unsigned)n != bpb.bpbBytesPerSec) {
-		    warnx("%s: can't read sector %u", bname, x);
-		    goto done;
-		}
-	    } else
-		memset(img, 0, bpb.bpbBytesPerSec);
-	    if (!lsn ||
-		(fat == 32 && bpb.bpbBackup != MAXU16 &&
-		 lsn == bpb.bpbBackup)) {
-		x1 = sizeof(struct bs);
-		bsbpb = (struct bsbpb *)(img + x1);
-		mk2(bsbpb->bpbBytesPerSec, bpb.bpbBytesPerSec);
-		mk1(bsbpb->bpbSecPerClust, bpb.bpbSecPerClust);
-		mk2(bsbpb->bpbResSectors, bpb.bpbResSectors);
-		mk1(bsbpb->bpbFATs, bpb.bpbFATs);
-		mk2(bsbpb->bpbRootDirEnts, bpb.bpbRootDirEnts);
-		mk2(bsbpb->bpbSectors, bpb.bpbSectors);
-		mk1(bsbpb->bpbMedia, bpb.bpbMedia);
-		mk2(bsbpb->bpbFATsecs, bpb.bpbFATsecs);
-		mk2(bsbpb->bpbSecPerTrack, bpb.bpbSecPerTrack);
-		mk2(bsbpb->bpbHeads, bpb.bpbHeads);
-		mk4(bsbpb->bpbHiddenSecs, bpb.bpbHiddenSecs);
-		mk4(bsbpb->bpbHugeSectors, bpb.bpbHugeSectors);
-		x1 += sizeof(struct bsbpb);
-		if (fat == 32) {
-		    bsxbpb = (struct bsxbpb *)(img + x1);
-		    mk4(bsxbpb->bpbBigFATsecs, bpb.bpbBigFATsecs);
-		    mk2(bsxbpb->bpbExtFlags, 0);
-		    mk2(bsxbpb->bpbFSVers, 0);
-		    mk4(bsxbpb->bpbRootClust, bpb.bpbRootClust);
-		    mk2(bsxbpb->bpbFSInfo, bpb.bpbFSInfo);
-		    mk2(bsxbpb->bpbBackup, bpb.bpbBackup);
-		    x1 += sizeof(struct bsxbpb);
-		}
-		bsx = (struct bsx *)(img + x1);
-		mk1(bsx->exBootSignature, 0x29);
-		if (o.volume_id_set)
-		    x = o.volume_id;
-		else
-		    x = (((u_int)(1 + tm->tm_mon) << 8 |
-			  (u_int)tm->tm_mday) +
-			 ((u_int)tm->tm_sec << 8 |
-			  (u_int)(tv.tv_usec / 10))) << 16 |
-			((u_int)(1900 + tm->tm_year) +
-			 ((u_int)tm->tm_hour << 8 |
-			  (u_int)tm->tm_min));
-		mk4(bsx->exVolumeID, x);
-		mklabel(bsx->exVolumeLabel, o.volume_label ? o.volume_label : "NO NAME");
-		snprintf(buf, sizeof(buf), "FAT%u", fat);
-		setstr(bsx->exFileSysType, buf, sizeof(bsx->exFileSysType));
-		if (!o.bootstrap) {
-		    x1 += sizeof(struct bsx);
-		    bs = (struct bs *)img;
-		    mk1(bs->bsJump[0], 0xeb);
-		    mk1(bs->bsJump[1], x1 - 2);
-		    mk1(bs->bsJump[2], 0x90);
-		    setstr(bs->bsOemName, o.OEM_string ? o.OEM_string : "BSD4.4  ",
-			   sizeof(bs->bsOemName));
-		    memcpy(img + x1, bootcode, sizeof(bootcode));
-		    mk2(img + MINBPS - 2, DOSMAGIC);
-		}
-	    } else if (fat == 32 && bpb.bpbFSInfo != MAXU16 &&
-		       (lsn == bpb.bpbFSInfo ||
-			(bpb.bpbBackup != MAXU16 &&
-			 lsn == bpb.bpbBackup + bpb.bpbFSInfo))) {
-		mk4(img, 0x41615252);
-		mk4(img + MINBPS - 28, 0x61417272);
-		mk4(img + MINBPS - 24, 0xffffffff);
-		mk4(img + MINBPS - 20, 0xffffffff);
+	    bsx = (struct bsx *)(img + x1);
+	    mk1(bsx->exBootSignature, 0x29);
+	    mk4(bsx->exVolumeID, volid);
+	    mklabel(bsx->exVolumeLabel, o.volume_label ? o.volume_label : "NO NAME");
+	    snprintf(buf, sizeof(buf), "FAT%u", fat);
+	    setstr(bsx->exFileSysType, buf, sizeof(bsx->exFileSysType));
+	    if (!o.bootstrap) {
+		x1 += sizeof(struct bsx);
+		bs = (struct bs *)img;
+		mk1(bs->bsJump[0], 0xeb);
+		mk1(bs->bsJump[1], x1 - 2);
+		mk1(bs->bsJump[2], 0x90);
+		setstr(bs->bsOemName, o.OEM_string ? o.OEM_string : "BSD4.4  ",
+		       sizeof(bs->bsOemName));
+		memcpy(img + x1, bootcode, sizeof(bootcode));
 		mk2(img + MINBPS - 2, DOSMAGIC);
-	    } else if (lsn >= bpb.bpbResSectors && lsn < dir &&
-		       !((lsn - bpb.bpbResSectors) %
-			 (bpb.bpbFATsecs ? bpb.bpbFATsecs :
-			  bpb.bpbBigFATsecs))) {
-		mk1(img[0], bpb.bpbMedia);
-		for (x = 1; x < fat * (fat == 32 ? 3 : 2) / 8; x++)
-		    mk1(img[x], fat == 32 && x % 4 == 3 ? 0x0f : 0xff);
-	    } else if (lsn == dir && o.volume_label) {
-		de = (struct de *)img;
-		mklabel(de->deName, o.volume_label);
-		mk1(de->deAttributes, 050);
-		x = (u_int)tm->tm_hour << 11 |
-		    (u_int)tm->tm_min << 5 |
-		    (u_int)tm->tm_sec >> 1;
-		mk2(de->deMTime, x);
-		x = (u_int)(tm->tm_year - 80) << 9 |
-		    (u_int)(tm->tm_mon + 1) << 5 |
-		    (u_int)tm->tm_mday;
-		mk2(de->deMDate, x);
 	    }
-	    /*
-	     * Issue a write of chunksize once we have collected
-	     * enough sectors.
-	     */
-	    img += bpb.bpbBytesPerSec;
-	    if (img >= physbuf_end) {
-		n = write(fd, physbuf, chunksize);
-		if (n != chunksize) {
-		    warnx("%s: can't write sector %u", fname, lsn);
-		    goto done;
-		}
-		img = physbuf;
+	} else if (fat == 32 && bpb.bpbFSInfo != MAXU16 &&
+		   (lsn == bpb.bpbFSInfo ||
+		    (bpb.bpbBackup != MAXU16 &&
+		     lsn == bpb.bpbBackup + bpb.bpbFSInfo))) {
+	    zero = false;
+	    mk4(img, 0x41615252);
+	    mk4(img + MINBPS - 28, 0x61417272);
+	    /* free count and next free hint, so nobody has to scan the FAT */
+	    x = pop != NULL ? pop->next - RESFTE : 1;
+	    mk4(img + MINBPS - 24, cls - x);
+	    mk4(img + MINBPS - 20, x < cls ? x + RESFTE : 0xffffffff);
+	    mk2(img + MINBPS - 2, DOSMAGIC);
+	} else if (lsn >= bpb.bpbResSectors && lsn < dir &&
+		   !((lsn - bpb.bpbResSectors) %
+		     (bpb.bpbFATsecs ? bpb.bpbFATsecs :
+		      bpb.bpbBigFATsecs))) {
+	    zero = false;
+	    mk1(img[0], bpb.bpbMedia);
+	    for (x = 1; x < fat * (fat == 32 ? 3 : 2) / 8; x++)
+		mk1(img[x], fat == 32 && x % 4 == 3 ? 0x0f : 0xff);
+	} else if (lsn == dir && o.volume_label) {
+	    zero = false;
+	    de = (struct de *)img;
+	    mklabel(de->deName, o.volume_label);
+	    mk1(de->deAttributes, 050);
+	    stamplabel(de, tm);
+	}
+	if (pop != NULL) {
+	    if (lsn >= bpb.bpbResSectors && lsn < dir) {
+		if (pop_fat(pop, (lsn - bpb.bpbResSectors) %
+		    (bpb.bpbFATsecs ? bpb.bpbFATsecs : bpb.bpbBigFATsecs),
+		    bpb.bpbBytesPerSec, img))
+		    zero = false;
+	    } else if (lsn >= dir &&
+		pop_dir(pop, pop->root, bpb.bpbBytesPerSec, img))
+		zero = false;
+	}
+	if (sw_commit(&sw, zero) == -1) {
+	    warnx("%s: can't write sector %u", fname, lsn);
+	    goto done;
+	}
+    }
+    if (pop != NULL &&
+	pop_data(pop, &sw, bpb.bpbSecPerClust, fname) == -1)
+	goto done;
+    if (sw.stream && !o.prefix_only) {
+	while (sw.lsn + sw.len / sw.bps < plan->layout.total_sectors)
+	    if (sw_commit(&sw, true) == -1) {
+		warn("%s: can't write sector %u", fname, sw.lsn);
+		goto done;
 	    }
+	if (sw_flush(&sw) == -1) {
+	    warn("%s: can't write sector %u", fname, sw.lsn);
+	    goto done;
 	}
-	/*
-	 * Write remaining sectors, if the last write didn't end
-	 * up filling a whole chunk.
-	 */
-	if (img != physbuf) {
-		ssize_t tailsize = img - physbuf;
-
-		n = write(fd, physbuf, tailsize);
-		if (n != tailsize) {
-		    warnx("%s: can't write sector %u", fname, lsn);
-		    goto done;
-		}
+	/* the rest of the image, if the file system doesn't fill it */
+	if (o.create_size > o.offset + (off_t)sw.lsn * sw.bps &&
+	    sw_pad(&sw, o.create_size - o.offset -
+		(off_t)sw.lsn * sw.bps) == -1) {
+	    warn("%s", fname);
+	    goto done;
 	}
     }
+    /*
+     * Write remaining sectors, if the last write didn't end
+     * up filling a whole chunk.
+     */
+    if (sw_flush(&sw) == -1) {
+	warnx("%s: can't write sector %u", fname, lsn);
+	goto done;
+    }
+    sw_progress(&sw, true);
     rv = 0;
 done:
     free(physbuf);
-    if (fd != -1)
-	    close(fd);
+    if (pop != NULL)
+	pop_free(pop);
     if (fd1 != -1)
 	    close(fd1);
 
@@ -798,22 +1245,347 @@ done:
 }
 
 /*
- * return -1 with error if file system is mounted.
+ * Work out the time to stamp the volume label with, into tmb, and the
+ * volume ID, which is made up from the time unless it's given.
  */
-static int
-check_mounted(const char *fname, mode_t mode)
+static struct tm *
+getstamp(const struct msdos_options *o, struct tm *tmb, u_int *volid)
 {
+    struct timeval tv;
+    struct tm *tm;
+    time_t now;
+
+    if (o->timestamp_set) {
+	tv.tv_sec = now = o->timestamp;
+	tv.tv_usec = 0;
+	tm = gmtime_r(&now, tmb);
+    } else {
+	gettimeofday(&tv, NULL);
+	now = tv.tv_sec;
+	tm = localtime_r(&now, tmb);
+    }
+    if (o->volume_id_set)
+	*volid = o->volume_id;
+    else
+	*volid = (((u_int)(1 + tm->tm_mon) << 8 |
+		   (u_int)tm->tm_mday) +
+		  ((u_int)tm->tm_sec << 8 |
+		   (u_int)(tv.tv_usec / 10))) << 16 |
+		 ((u_int)(1900 + tm->tm_year) +
+		  ((u_int)tm->tm_hour << 8 |
+		   (u_int)tm->tm_min));
+    return tm;
+}
+
 /*
- * If getmntinfo() is not available (e.g. Linux) don't check. This should
- * not be a problem since we will only be using makefs to create images.
+ * Set the modification time of the volume label entry.
  */
-#if !defined(MAKEFS)
-    struct statfs *mp;
-    const char *s1, *s2;
-    size_t len;
-    int n, r;
+static void
+stamplabel(struct de *de, const struct tm *tm)
+{
+    u_int x;
+
+    x = (u_int)tm->tm_hour << 11 |
+	(u_int)tm->tm_min << 5 |
+	(u_int)tm->tm_sec >> 1;
+    mk2(de->deMTime, x);
+    x = (u_int)(tm->tm_year - 80) << 9 |
+	(u_int)(tm->tm_mon + 1) << 5 |
+	(u_int)tm->tm_mday;
+    mk2(de->deMDate, x);
+}
 
-    if (!(n = getmntinfo(&mp, MNT_NOWAIT))) {
+static bool
+tpl_streq(const char *a, const char *b)
+{
+    return a == NULL || b == NULL ? a == b : !strcmp(a, b);
+}
+
+/*
+ * The options a template is keyed by: those which change what's written,
+ * except for the strings, which are compared separately.
+ */
+static void
+tpl_key(const struct msdos_options *o, struct msdos_options *k)
+{
+    memset(k, 0, sizeof(*k));
+#define AOPT(_opt, _type, _name, _min, _desc) k->_name = o->_name;
+ALLOPTS
+#undef AOPT
+    k->media_descriptor_set = o->media_descriptor_set;
+    k->hidden_sectors_set = o->hidden_sectors_set;
+    k->bootstrap = k->source_dir = k->floppy = NULL;
+    k->volume_label = k->OEM_string = NULL;
+    k->volume_id = 0;
+    k->timestamp = 0;
+    k->discard = k->no_create = k->prefix_only = k->sparse = false;
+    k->io_depth = 0;
+}
+
+static bool
+tpl_match(const struct template *t, const char *dtype,
+    const struct msdos_options *o, const struct msdos_options *k)
+{
+    return !memcmp(&t->key, k, sizeof(*k)) && tpl_streq(t->dtype, dtype) &&
+	tpl_streq(t->floppy, o->floppy) &&
+	tpl_streq(t->label, o->volume_label) &&
+	tpl_streq(t->oem, o->OEM_string);
+}
+
+static void
+tpl_free(struct template *t)
+{
+    free(t->dtype);
+    free(t->floppy);
+    free(t->label);
+    free(t->oem);
+    free(t->runs);
+    free(t->data);
+    free(t);
+}
+
+/*
+ * Add a batch of sectors starting at lsn to the template being made.
+ */
+static int
+tpl_add(struct template *t, u_int lsn, const struct iovec *iov, int iovcnt)
+{
+    struct tplrun *r;
+    size_t len;
+    void *p;
+    int i;
+
+    for (len = 0, i = 0; i < iovcnt; i++)
+	len += iov[i].iov_len;
+    if (t->toobig || t->len + len > TPLSZ) {
+	t->toobig = true;
+	return 0;
+    }
+    if (t->len + len > t->maxlen) {
+	if ((p = realloc(t->data, MAX(t->maxlen * 2, t->len + len))) == NULL)
+	    return -1;
+	t->data = p;
+	t->maxlen = MAX(t->maxlen * 2, t->len + len);
+    }
+    r = t->nruns ? &t->runs[t->nruns - 1] : NULL;
+    if (r == NULL || r->lsn + r->count != lsn) {
+	if (t->nruns == t->maxruns) {
+	    p = reallocarray(t->runs, t->maxruns ? t->maxruns * 2 : 8,
+		sizeof(*t->runs));
+	    if (p == NULL)
+		return -1;
+	    t->runs = p;
+	    t->maxruns = t->maxruns ? t->maxruns * 2 : 8;
+	}
+	r = &t->runs[t->nruns++];
+	r->lsn = lsn;
+	r->count = 0;
+	r->off = t->len;
+    }
+    for (i = 0; i < iovcnt; i++) {
+	memcpy(t->data + t->len, iov[i].iov_base, iov[i].iov_len);
+	t->len += iov[i].iov_len;
+    }
+    r->count += len / t->layout.bpb.bpbBytesPerSec;
+    return 0;
+}
+
+/*
+ * Where sector lsn is in the template's data, if it's there at all.
+ */
+static size_t
+tpl_find(const struct template *t, u_int lsn)
+{
+    u_int i;
+
+    for (i = 0; i < t->nruns; i++)
+	if (lsn >= t->runs[i].lsn && lsn < t->runs[i].lsn + t->runs[i].count)
+	    return t->runs[i].off +
+		(size_t)(lsn - t->runs[i].lsn) * t->layout.bpb.bpbBytesPerSec;
+    return SIZE_MAX;
+}
+
+/*
+ * Make a template from a plan, by "writing" it to memory.
+ */
+static struct template *
+tpl_make(const struct msdos_plan *plan, const char *fname, const char *dtype)
+{
+    const struct msdos_bpb *bpb = &plan->layout.bpb;
+    struct msdos_plan tplan;
+    struct template *t;
+    size_t x1;
+    int i;
+
+    if ((t = calloc(1, sizeof(*t))) == NULL) {
+	warn(NULL);
+	return NULL;
+    }
+    tpl_key(&plan->options, &t->key);
+    t->layout = plan->layout;
+    tplan = *plan;
+    tplan.options.progress = NULL;
+    if ((dtype != NULL && (t->dtype = strdup(dtype)) == NULL) ||
+	(plan->options.floppy != NULL &&
+	 (t->floppy = strdup(plan->options.floppy)) == NULL) ||
+	(plan->options.volume_label != NULL &&
+	 (t->label = strdup(plan->options.volume_label)) == NULL) ||
+	(plan->options.OEM_string != NULL &&
+	 (t->oem = strdup(plan->options.OEM_string)) == NULL)) {
+	warn(NULL);
+	goto fail;
+    }
+    if (write_internal(&tplan, fname, -1, NULL, 0, t) == -1)
+	goto fail;
+    x1 = sizeof(struct bs) + sizeof(struct bsbpb) +
+	(plan->layout.fat == 32 ? sizeof(struct bsxbpb) : 0) +
+	offsetof(struct bsx, exVolumeID);
+    t->volid[0] = tpl_find(t, 0);
+    t->volid[1] = plan->layout.fat == 32 && bpb->bpbBackup != MAXU16 ?
+	tpl_find(t, bpb->bpbBackup) : SIZE_MAX;
+    for (i = 0; i < 2; i++)
+	if (t->volid[i] != SIZE_MAX)
+	    t->volid[i] += x1;
+    t->labelent = plan->options.volume_label != NULL ?
+	tpl_find(t, plan->layout.dir_sector) : SIZE_MAX;
+    return t;
+fail:
+    tpl_free(t);
+    return NULL;
+}
+
+/*
+ * Format a freshly created image, from a template if there's one for
+ * these options, or else making one on the way.
+ */
+static int
+tpl_format(const char *fname, const char *dtype,
+    const struct msdos_options *o, int fd)
+{
+    struct msdos_options k;
+    struct msdos_plan plan;
+    struct msdos_progress pr;
+    struct template *t, **tp, *made;
+    struct tplrun *runs;
+    struct tm tmb, *tm;
+    u_int8_t *data;
+    u_int bps, nruns, volid, i;
+    size_t volidoff[2], labelent, len;
+    int rv;
+
+    rv = -1;
+    runs = NULL;
+    data = NULL;
+    made = NULL;
+    tpl_key(o, &k);
+    for (;;) {
+	/*
+	 * Copy what's needed out of the template while holding the
+	 * lock, so that it can be dropped from the cache at any time.
+	 */
+	pthread_mutex_lock(&template_lock);
+	for (tp = &templates, i = 0; (t = *tp) != NULL; tp = &t->next, i++)
+	    if (tpl_match(t, dtype, o, &k))
+		break;
+	if (t == NULL && made != NULL) {
+	    t = made;
+	    made = NULL;
+	    t->next = templates;
+	    templates = t;
+	    /* drop the least recently used one */
+	    for (tp = &t->next, i = 1; *tp != NULL && i < TPLMAX;
+		tp = &(*tp)->next, i++)
+		continue;
+	    if (*tp != NULL) {
+		tpl_free(*tp);
+		*tp = NULL;
+	    }
+	} else if (t != NULL) {
+	    *tp = t->next;
+	    t->next = templates;
+	    templates = t;
+	}
+	if (t != NULL) {
+	    plan.layout = t->layout;
+	    nruns = t->nruns;
+	    len = t->len;
+	    volidoff[0] = t->volid[0];
+	    volidoff[1] = t->volid[1];
+	    labelent = t->labelent;
+	    runs = malloc(nruns * sizeof(*runs) + 1);
+	    data = malloc(len + 1);
+	    if (runs != NULL && data != NULL) {
+		memcpy(runs, t->runs, nruns * sizeof(*runs));
+		memcpy(data, t->data, len);
+	    }
+	}
+	pthread_mutex_unlock(&template_lock);
+	if (made != NULL)
+	    tpl_free(made);		/* someone else made one first */
+	if (t != NULL)
+	    break;
+	if (plan_internal(fname, dtype, o, fd, 0, &plan) == -1)
+	    return -1;
+	if ((made = tpl_make(&plan, fname, dtype)) == NULL)
+	    return -1;
+	if (made->toobig) {
+	    tpl_free(made);
+	    print_plan(fname, &plan);
+	    return write_internal(&plan, fname, fd, NULL, 0, NULL);
+	}
+    }
+    if (runs == NULL || data == NULL) {
+	warn(NULL);
+	goto done;
+    }
+    plan.options = *o;
+    print_plan(fname, &plan);
+    tm = getstamp(o, &tmb, &volid);
+    for (i = 0; i < 2; i++)
+	if (volidoff[i] != SIZE_MAX)
+	    mk4(data + volidoff[i], volid);
+    if (labelent != SIZE_MAX)
+	stamplabel((struct de *)(data + labelent), tm);
+    bps = plan.layout.bpb.bpbBytesPerSec;
+    for (i = 0; i < nruns; i++)
+	if (pwrite(fd, data + runs[i].off, (size_t)runs[i].count * bps,
+	    o->offset + (off_t)runs[i].lsn * bps) !=
+	    (ssize_t)runs[i].count * bps) {
+	    warn("%s: can't write sector %u", fname, runs[i].lsn);
+	    goto done;
+	}
+    if (o->progress != NULL) {
+	memset(&pr, 0, sizeof(pr));
+	pr.fname = fname;
+	pr.sectors_done = pr.sectors_total = nruns ?
+	    runs[nruns - 1].lsn + runs[nruns - 1].count : 0;
+	pr.bytes_per_sector = bps;
+	o->progress(&pr, o->progress_arg);
+    }
+    rv = 0;
+done:
+    free(runs);
+    free(data);
+    return rv;
+}
+
+/*
+ * return -1 with error if file system is mounted.
+ */
+static int
+check_mounted(const char *fname, mode_t mode)
+{
+/*
+ * If getmntinfo() is not available (e.g. Linux) don't check. This should
+ * not be a problem since we will only be using makefs to create images.
+ */
+#if !defined(MAKEFS)
+    struct statfs *mp;
+    const char *s1, *s2;
+    size_t len;
+    int n, r;
+
+    if (!(n = getmntinfo(&mp, MNT_NOWAIT))) {
 	warn("getmntinfo");
 	return -1;
     }
@@ -842,10 +1614,7 @@ check_mounted(const char *fname, mode_t mode)
 static ssize_t
 getchunksize(void)
 {
-	static int chunksize;
-
-	if (chunksize != 0)
-		return ((ssize_t)chunksize);
+	int chunksize = 0;
 
 #ifdef	KERN_MAXPHYS
 	int mib[2];
@@ -881,7 +1650,7 @@ getchunksize(void)
  * Get a standard format.
  */
 static int
-getstdfmt(const char *fmt, struct bpb *bpb)
+getstdfmt(const char *fmt, struct msdos_bpb *bpb)
 {
     u_int x, i;
 
@@ -896,47 +1665,77 @@ getstdfmt(const char *fmt, struct bpb *bpb)
 }
 
 static void
-compute_geometry_from_file(int fd, const char *fname, struct disklabel *lp)
+compute_geometry_from_size(off_t ms, struct disklabel *lp)
 {
-	struct stat st;
-	off_t ms;
-
-	if (fstat(fd, &st))
-		err(1, "cannot get disk size");
-	if (!S_ISREG(st.st_mode))
-		errx(1, "%s is not a regular file", fname);
-	ms = st.st_size;
 	lp->d_secsize = 512;
 	lp->d_nsectors = 63;
 	lp->d_ntracks = 255;
 	lp->d_secperunit = ms / lp->d_secsize;
 }
 
+static int
+compute_geometry_from_file(int fd, const char *fname, struct disklabel *lp)
+{
+	struct stat st;
+
+	if (fstat(fd, &st)) {
+		warn("cannot get disk size");
+		return -1;
+	}
+	if (!S_ISREG(st.st_mode)) {
+		warnx("%s is not a regular file", fname);
+		return -1;
+	}
+	compute_geometry_from_size(st.st_size, lp);
+	return 0;
+}
+
 /*
- * Get disk slice, partition, and geometry information.
+ * Get disk slice, partition, and geometry information.  If fd is -1,
+ * the target is size bytes, of memory or of an image yet to be created.
  */
 static int
-getdiskinfo(int fd, const char *fname, const char *dtype, __unused int oflag,
-	    struct bpb *bpb)
+getdiskinfo(int fd, off_t size, const char *fname, const char *dtype,
+	    __unused int oflag, struct msdos_bpb *bpb)
 {
     struct disklabel *lp, dlp;
     off_t hs = 0;
 #ifndef MAKEFS
     off_t ms;
     struct fd_type type;
+#endif
 
     lp = NULL;
+#ifndef MAKEFS
 
     /* If the user specified a disk type, try to use that */
     if (dtype != NULL) {
-	lp = getdiskbyname(dtype);
+	pthread_mutex_lock(&disktab_lock);
+	if ((lp = getdiskbyname(dtype)) != NULL) {
+	    dlp = *lp;
+	    lp = &dlp;
+	}
+	pthread_mutex_unlock(&disktab_lock);
+    }
+#endif
+
+    /* Without a descriptor, make up a geometry like for file images */
+    if (lp == NULL && fd == -1) {
+	if (size == 0) {
+	    warnx("%s: unknown size", fname);
+	    return -1;
+	}
+	compute_geometry_from_size(size, &dlp);
+	lp = &dlp;
     }
+#ifndef MAKEFS
 
     /* Maybe it's a floppy drive */
     if (lp == NULL) {
 	if (ioctl(fd, DIOCGMEDIASIZE, &ms) == -1) {
 	    /* create a fake geometry for a file image */
-	    compute_geometry_from_file(fd, fname, &dlp);
+	    if (compute_geometry_from_file(fd, fname, &dlp) == -1)
+		return -1;
 	    lp = &dlp;
 	} else if (ioctl(fd, FD_GTYPE, &type) != -1) {
 	    dlp.d_secsize = 128 << type.secsize;
@@ -952,8 +1751,10 @@ getdiskinfo(int fd, const char *fname, const char *dtype, __unused int oflag,
 	if (bpb->bpbBytesPerSec)
 	    dlp.d_secsize = bpb->bpbBytesPerSec;
 	if (bpb->bpbBytesPerSec == 0 && ioctl(fd, DIOCGSECTORSIZE,
-					      &dlp.d_secsize) == -1)
-	    err(1, "cannot get sector size");
+					      &dlp.d_secsize) == -1) {
+	    warn("cannot get sector size");
+	    return -1;
+	}
 
 	dlp.d_secperunit = ms / dlp.d_secsize;
 
@@ -978,8 +1779,11 @@ getdiskinfo(int fd, const char *fname, const char *dtype, __unused int oflag,
     }
 #else
     /* In the makefs case we only support image files: */
-    compute_geometry_from_file(fd, fname, &dlp);
-    lp = &dlp;
+    if (lp == NULL) {
+	if (compute_geometry_from_file(fd, fname, &dlp) == -1)
+	    return -1;
+	lp = &dlp;
+    }
 #endif
 
     if (bpb->bpbBytesPerSec == 0) {
@@ -1008,7 +1812,7 @@ getdiskinfo(int fd, const char *fname, const char *dtype, __unused int oflag,
  * Print out BPB values.
  */
 static void
-print_bpb(struct bpb *bpb)
+print_bpb(const struct msdos_bpb *bpb)
 {
     printf("BytesPerSec=%u SecPerClust=%u ResSectors=%u FATs=%u",
 	   bpb->bpbBytesPerSec, bpb->bpbSecPerClust, bpb->bpbResSectors,
@@ -1092,9 +1896,853 @@ setstr(u_int8_t *dest, const char *src, size_t len)
 	*dest++ = *src ? *src++ : ' ';
 }
 
+/*
+ * writev() all of iov to a pipe or socket, which may take several goes.
+ * iov is used up in the process.
+ */
+static int
+sw_writev(int fd, struct iovec *iov, int iovcnt)
+{
+    ssize_t n;
+
+    while (iovcnt > 0) {
+	if ((n = writev(fd, iov, MIN(iovcnt, IOV_MAX))) == -1) {
+	    if (errno == EINTR)
+		continue;
+	    return -1;
+	}
+	for (; iovcnt > 0 && (size_t)n >= iov->iov_len; iov++, iovcnt--)
+	    n -= iov->iov_len;
+	if (iovcnt > 0) {
+	    iov->iov_base = (u_int8_t *)iov->iov_base + n;
+	    iov->iov_len -= n;
+	}
+    }
+    return 0;
+}
+
+/*
+ * Stream len bytes of zeros, outside of any sector; the batch has to be
+ * empty.
+ */
+static int
+sw_pad(struct sectwriter *sw, off_t len)
+{
+    int i;
+
+    while (len > 0) {
+	for (i = 0; i < IOV_MAX && len > 0; i++) {
+	    sw->iov[i].iov_base = zeros;
+	    sw->iov[i].iov_len = MIN(len, ZEROSZ);
+	    len -= sw->iov[i].iov_len;
+	}
+	if (sw_writev(sw->fd, sw->iov, i) == -1)
+	    return -1;
+    }
+    return 0;
+}
+
+/*
+ * Write out the sectors collected so far.
+ */
+static int
+sw_flush(struct sectwriter *sw)
+{
+    off_t off;
+    int i;
+
+    if (sw->len == 0)
+	return 0;
+    off = sw->offset + (off_t)sw->lsn * sw->bps;
+    if (sw->mem != NULL) {
+	if (off + sw->len > sw->memlen) {
+	    errno = ENOSPC;
+	    return -1;
+	}
+	for (i = 0; i < sw->iovcnt; off += sw->iov[i++].iov_len)
+	    memcpy(sw->mem + off, sw->iov[i].iov_base, sw->iov[i].iov_len);
+    } else if (sw->tpl != NULL) {
+	if (tpl_add(sw->tpl, sw->lsn, sw->iov, sw->iovcnt) == -1)
+	    return -1;
+    } else if (sw->stream) {
+	if (sw_writev(sw->fd, sw->iov, sw->iovcnt) == -1)
+	    return -1;
+    } else if (pwritev(sw->fd, sw->iov, sw->iovcnt, off) !=
+	(ssize_t)sw->len)
+	return -1;
+    sw->lsn += sw->len / sw->bps;
+    sw->iovcnt = 0;
+    sw->len = 0;
+    sw->img = sw->buf;
+    sw_progress(sw, false);
+    return 0;
+}
+
+/*
+ * Done building the sector at sw->img (or, if zero, a sector which
+ * needn't be built at all); move on to the next one.
+ */
+static int
+sw_commit(struct sectwriter *sw, bool zero)
+{
+    struct iovec *iov;
+    u_int8_t *base;
+
+    if (zero && sw->sparse) {
+	if (sw_flush(sw) == -1)
+	    return -1;
+	sw->lsn++;
+	if (sw->lsn % 1024 == 0)
+	    sw_progress(sw, false);
+	return 0;
+    }
+    base = zero ? zeros : sw->img;
+    iov = sw->iovcnt ? &sw->iov[sw->iovcnt - 1] : NULL;
+    /*
+     * Zero sectors all point at the start of the zero buffer, so a run
+     * of them grows the last iovec until it covers the whole buffer;
+     * data sectors merge when they follow on from the last one.
+     */
+    if (iov != NULL && (zero ?
+	iov->iov_base == zeros && iov->iov_len + sw->bps <= ZEROSZ :
+	(u_int8_t *)iov->iov_base + iov->iov_len == base))
+	iov->iov_len += sw->bps;
+    else {
+	iov = &sw->iov[sw->iovcnt++];
+	iov->iov_base = base;
+	iov->iov_len = sw->bps;
+    }
+    sw->len += sw->bps;
+    if (!zero)
+	sw->img += sw->bps;
+    /*
+     * Issue the write once we have collected enough sectors, or run
+     * out of room for more.
+     */
+    if (sw->img >= sw->end || sw->iovcnt == IOV_MAX)
+	return sw_flush(sw);
+    return 0;
+}
+
+/*
+ * Discard the len bytes at off: punch a hole in image files, or let
+ * the device know they're unused (TRIM).  Returns 1 if, on top of that,
+ * the first zlen bytes are known to read back as zeros, in which case
+ * zero sectors there needn't be written; 0 otherwise.  Not being able
+ * to discard isn't an error, the sectors are just written as usual.
+ */
+static int
+discard_range(int fd, const char *fname, off_t off, off_t len, off_t zlen)
+{
+    struct stat st;
+
+    if (fstat(fd, &st) == -1) {
+	warn("%s", fname);
+	return 0;
+    }
+    if (S_ISREG(st.st_mode)) {
+#if defined(SPACECTL_DEALLOC)
+	struct spacectl_range r;
+
+	r.r_offset = off;
+	r.r_len = len;
+	while (r.r_len > 0)
+	    if (fspacectl(fd, SPACECTL_DEALLOC, &r, 0, &r) == -1) {
+		warn("%s: fspacectl", fname);
+		return 0;
+	    }
+	return 1;
+#endif
+	return 0;
+    }
+#if defined(DIOCGDELETE)
+    {
+	off_t r[2];
+
+	/* BIO_DELETE doesn't say what deleted blocks read back as */
+	r[0] = off;
+	r[1] = len;
+	if (ioctl(fd, DIOCGDELETE, r) == -1)
+	    warn("%s: DIOCGDELETE", fname);
+    }
+#endif
+    (void)zlen;
+    return 0;
+}
+
+/*
+ * Call the progress callback, if it's time to (or if done).
+ */
+static void
+sw_progress(struct sectwriter *sw, bool done)
+{
+    struct msdos_progress pr;
+    struct timespec now;
+    double elapsed;
+
+    if (sw->o->progress == NULL)
+	return;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    elapsed = (now.tv_sec - sw->start.tv_sec) +
+	(now.tv_nsec - sw->start.tv_nsec) / 1e9;
+    if (!done && elapsed < sw->next_report)
+	return;
+    sw->next_report = elapsed + (sw->o->progress_interval ?
+	sw->o->progress_interval : 1000) / 1e3;
+    pr.fname = sw->fname;
+    pr.sectors_done = sw->lsn;
+    pr.sectors_total = sw->total;
+    pr.bytes_per_sector = sw->bps;
+    pr.elapsed = elapsed;
+    pr.throughput = elapsed > 0 ? (double)sw->lsn * sw->bps / elapsed : 0;
+    sw->o->progress(&pr, sw->o->progress_arg);
+}
+
+/*
+ * Free a node and everything below it.
+ */
+static void
+pop_freenode(struct pnode *pn)
+{
+    u_int i;
+
+    for (i = 0; i < pn->nkids; i++)
+	pop_freenode(pn->kids[i]);
+    free(pn->kids);
+    free(pn->lname);
+    free(pn->path);
+    free(pn);
+}
+
 static void
-infohandler(int sig __unused)
+pop_free(struct populate *p)
 {
+    if (p->root != NULL)
+	pop_freenode(p->root);
+    free(p->order);
+    free(p);
+}
+
+/*
+ * Grow an array by doubling, whenever its length hits a power of 2.
+ */
+static int
+pop_grow(void *arrp, u_int len, size_t size)
+{
+    void *a;
+
+    if (len & (len - 1))
+	return 0;
+    if ((a = reallocarray(*(void **)arrp, len ? len * 2 : 1, size)) == NULL) {
+	warn(NULL);
+	return -1;
+    }
+    *(void **)arrp = a;
+    return 0;
+}
 
-	got_siginfo = 1;
-}
\ No newline at end of file
+static int
+pop_cmp(const void *a, const void *b)
+{
+    return strcmp((*(struct pnode *const *)a)->path,
+	(*(struct pnode *const *)b)->path);
+}
+
+/*
+ * Characters allowed in short names, besides letters and digits.
+ */
+static bool
+pop_okchar(u_char c)
+{
+    if (c == '\0' || c >= 0x80)
+	return false;
+    return isupper(c) || isdigit(c) || strchr("!#$%&'()-@^_`{}~", c) != NULL;
+}
+
+/*
+ * Whether name can be stored as is in a short name, in which case it's
+ * copied to sn.
+ */
+static bool
+pop_isshort(const char *name, u_int8_t *sn)
+{
+    const char *dot, *s;
+    size_t blen, elen;
+
+    if ((dot = strchr(name, '.')) == NULL)
+	dot = name + strlen(name);
+    else if (strchr(dot + 1, '.') != NULL)
+	return false;
+    blen = dot - name;
+    elen = *dot ? strlen(dot + 1) : 0;
+    if (blen < 1 || blen > 8 || (*dot && (elen < 1 || elen > 3)))
+	return false;
+    for (s = name; *s; s++)
+	if (s != dot && !pop_okchar(*s))
+	    return false;
+    memset(sn, ' ', 11);
+    memcpy(sn, name, blen);
+    if (*dot)
+	memcpy(sn + 8, dot + 1, elen);
+    return true;
+}
+
+/*
+ * Map a character to what it becomes in a generated short name, or 0 if
+ * it's dropped.
+ */
+static u_char
+pop_shortchar(u_char c)
+{
+    if (c == ' ' || c == '.')
+	return 0;
+    c = toupper(c);
+    return pop_okchar(c) ? c : '_';
+}
+
+/*
+ * Decode the UTF-8 name into a UCS-2 long name; anything that isn't
+ * valid or doesn't fit in 16 bits becomes an underscore.
+ */
+static int
+pop_lname(struct pnode *pn, const char *name)
+{
+    const u_char *s;
+    u_int c, n, i;
+
+    pn->lname = calloc(WIN_MAXLEN, sizeof(*pn->lname));
+    if (pn->lname == NULL) {
+	warn(NULL);
+	return -1;
+    }
+    for (s = (const u_char *)name, i = 0; *s; i++) {
+	if (i == WIN_MAXLEN) {
+	    warnx("%s: name too long", pn->path);
+	    return -1;
+	}
+	c = *s++;
+	n = c >= 0xf0 ? 3 : c >= 0xe0 ? 2 : c >= 0xc0 ? 1 : 0;
+	if (c >= 0x80) {
+	    c &= 0x3f >> n;
+	    for (; n && (*s & 0xc0) == 0x80; n--)
+		c = c << 6 | (*s++ & 0x3f);
+	    if (n || c > 0xffff || c < 0x80)
+		c = '_';
+	}
+	pn->lname[i] = c;
+    }
+    pn->lnamelen = i;
+    return 0;
+}
+
+/*
+ * Generate a short name for the i-th entry of dn, with a numeric tail
+ * making it unique among the names given out so far.
+ */
+static int
+pop_genname(struct pnode *dn, u_int i, u_int *tailp, u_int8_t *lastbasis)
+{
+    struct pnode *pn = dn->kids[i];
+    const char *name, *dot, *s;
+    u_int8_t basis[11], sn[11];
+    char tail[8];
+    u_int j, k, n;
+    size_t tlen;
+
+    name = strrchr(pn->path, '/') + 1;
+    if (pop_lname(pn, name) == -1)
+	return -1;
+    while (*name == '.' || *name == ' ')
+	name++;
+    if ((dot = strrchr(name, '.')) == NULL)
+	dot = name + strlen(name);
+    memset(basis, ' ', sizeof(basis));
+    for (s = name, k = 0; s < dot && k < 8; s++)
+	if ((basis[k] = pop_shortchar(*s)) != 0)
+	    k++;
+    if (k == 0)
+	basis[k++] = '_';
+    for (s = *dot ? dot + 1 : dot, j = 8; *s && j < 11; s++)
+	if ((basis[j] = pop_shortchar(*s)) != 0)
+	    j++;
+    for (; k < 8; k++)
+	basis[k] = ' ';
+    for (; j < 11; j++)
+	basis[j] = ' ';
+
+    /*
+     * Names sharing a basis tend to sort next to each other, so keep
+     * counting from where the previous one left off.
+     */
+    n = memcmp(basis, lastbasis, sizeof(basis)) ? 1 : *tailp + 1;
+    for (;; n++) {
+	if (n > 999999) {
+	    warnx("%s: can't generate a unique short name", pn->path);
+	    return -1;
+	}
+	tlen = snprintf(tail, sizeof(tail), "~%u", n);
+	memcpy(sn, basis, sizeof(sn));
+	for (k = 0; k < 8 - tlen && basis[k] != ' '; k++)
+	    continue;
+	memcpy(sn + k, tail, tlen);
+	for (j = 0; j < dn->nkids; j++)
+	    if (dn->kids[j]->hasname &&
+		!memcmp(dn->kids[j]->name, sn, sizeof(sn)))
+		break;
+	if (j == dn->nkids)
+	    break;
+    }
+    memcpy(lastbasis, basis, sizeof(basis));
+    *tailp = n;
+    memcpy(pn->name, sn, sizeof(pn->name));
+    pn->hasname = true;
+    return 0;
+}
+
+/*
+ * Read the contents of directory dn, recursively.
+ */
+static int
+pop_scan(struct populate *p, struct pnode *dn)
+{
+    DIR *dirp;
+    struct dirent *dp;
+    struct stat st;
+    struct pnode *pn;
+    u_int8_t lastbasis[11];
+    u_int i, tail;
+
+    if ((dirp = opendir(dn->path)) == NULL) {
+	warn("%s", dn->path);
+	return -1;
+    }
+    while ((dp = readdir(dirp)) != NULL) {
+	if (!strcmp(dp->d_name, ".") || !strcmp(dp->d_name, ".."))
+	    continue;
+	if (pop_grow(&dn->kids, dn->nkids, sizeof(*dn->kids)) == -1 ||
+	    (pn = calloc(1, sizeof(*pn))) == NULL) {
+	    warn(NULL);
+	    closedir(dirp);
+	    return -1;
+	}
+	dn->kids[dn->nkids++] = pn;
+	pn->parent = dn;
+	if (asprintf(&pn->path, "%s/%s", dn->path, dp->d_name) == -1) {
+	    warn(NULL);
+	    closedir(dirp);
+	    return -1;
+	}
+	if (stat(pn->path, &st) == -1) {
+	    warn("%s", pn->path);
+	    closedir(dirp);
+	    return -1;
+	}
+	if (!S_ISREG(st.st_mode) && !S_ISDIR(st.st_mode)) {
+	    warnx("%s: not a regular file or directory, skipping", pn->path);
+	    pop_freenode(pn);
+	    dn->nkids--;
+	    continue;
+	}
+	if (S_ISREG(st.st_mode) && st.st_size > 0xffffffffLL) {
+	    warnx("%s: too large for FAT", pn->path);
+	    closedir(dirp);
+	    return -1;
+	}
+	pn->isdir = S_ISDIR(st.st_mode);
+	pn->size = pn->isdir ? 0 : st.st_size;
+	pn->mtime = st.st_mtime;
+    }
+    closedir(dirp);
+
+    /*
+     * Sort the entries so images are reproducible, and give names which
+     * fit as they are priority over generated ones.
+     */
+    qsort(dn->kids, dn->nkids, sizeof(*dn->kids), pop_cmp);
+    for (i = 0; i < dn->nkids; i++) {
+	pn = dn->kids[i];
+	pn->hasname = pop_isshort(strrchr(pn->path, '/') + 1, pn->name);
+    }
+    memset(lastbasis, 0, sizeof(lastbasis));
+    tail = 0;
+    for (i = 0; i < dn->nkids; i++) {
+	pn = dn->kids[i];
+	if (!pn->hasname && pop_genname(dn, i, &tail, lastbasis) == -1)
+	    return -1;
+	dn->nents += 1 + howmany(pn->lnamelen, WIN_CHARS);
+    }
+    if (dn->nents > 65536) {
+	warnx("%s: too many directory entries", dn->path);
+	return -1;
+    }
+    for (i = 0; i < dn->nkids; i++) {
+	pn = dn->kids[i];
+	if (!pn->isdir)
+	    continue;
+	pn->nents = pn->pre = 2;
+	if (pop_scan(p, pn) == -1)
+	    return -1;
+    }
+    return 0;
+}
+
+/*
+ * Hand out clusters to pn and everything below it.
+ */
+static int
+pop_alloc(struct populate *p, struct pnode *pn)
+{
+    u_int64_t n;
+    u_int i;
+
+    if (pn->isdir)
+	n = MAX(howmany((u_int64_t)pn->nents * sizeof(struct de), p->bpc), 1);
+    else
+	n = howmany((u_int64_t)pn->size, p->bpc);
+    /* the FAT12/16 root directory has its own region */
+    if (n && (pn != p->root || p->fat == 32)) {
+	if (n > p->cls - (p->next - RESFTE)) {
+	    warnx("%s: file system full", pn->path);
+	    return -1;
+	}
+	if (pop_grow(&p->order, p->norder, sizeof(*p->order)) == -1)
+	    return -1;
+	p->order[p->norder++] = pn;
+	pn->clust = p->next;
+	pn->nclust = n;
+	p->next += n;
+    }
+    for (i = 0; i < pn->nkids; i++)
+	if (pop_alloc(p, pn->kids[i]) == -1)
+	    return -1;
+    return 0;
+}
+
+/*
+ * Scan dir and lay it out on a file system with the given parameters.
+ * With label, the first root directory entry is left to the caller.  If
+ * tm isn't NULL, every entry is stamped with it instead of the source's
+ * modification time.
+ */
+static struct populate *
+pop_build(const char *dir, u_int fat, u_int bpc, u_int cls, u_int rootents,
+	  bool label, const struct tm *tm)
+{
+    struct populate *p;
+    struct stat st;
+
+    if ((p = calloc(1, sizeof(*p))) == NULL ||
+	(p->root = calloc(1, sizeof(*p->root))) == NULL ||
+	(p->root->path = strdup(dir)) == NULL) {
+	warn(NULL);
+	goto fail;
+    }
+    p->fat = fat;
+    p->bpc = bpc;
+    p->cls = cls;
+    p->next = RESFTE;
+    if (tm != NULL) {
+	p->fixed_tm = true;
+	p->tm = *tm;
+    }
+    if (stat(dir, &st) == -1) {
+	warn("%s", dir);
+	goto fail;
+    }
+    if (!S_ISDIR(st.st_mode)) {
+	warnx("%s: not a directory", dir);
+	goto fail;
+    }
+    p->root->isdir = true;
+    p->root->mtime = st.st_mtime;
+    p->root->nents = p->root->pre = label;
+    if (pop_scan(p, p->root) == -1)
+	goto fail;
+    if (fat != 32 && p->root->nents > rootents) {
+	warnx("%s: %u entries don't fit in the root directory (%u)", dir,
+	    p->root->nents, rootents);
+	goto fail;
+    }
+    if (pop_alloc(p, p->root) == -1)
+	goto fail;
+    return p;
+fail:
+    if (p != NULL)
+	pop_free(p);
+    return NULL;
+}
+
+/*
+ * Fill in the FAT entries of the chains in FAT sector sec, overwriting
+ * those already there.  Returns whether there were any.
+ */
+static bool
+pop_fat(struct populate *p, u_int sec, u_int bps, u_int8_t *img)
+{
+    struct pnode *pn;
+    u_int64_t lo, hi, nib;
+    u_int first, last, npe, c, v, k, l, r, m;
+
+    /* entries are a whole number of nibbles, even with FAT12 */
+    npe = p->fat / BPN;
+    lo = (u_int64_t)sec * bps * NPB;
+    hi = lo + bps * NPB;
+    first = MAX(lo / npe, RESFTE);
+    last = MIN(howmany(hi, npe), p->next);
+    if (first >= last)
+	return false;
+    for (l = 0, r = p->norder; l < r;) {
+	m = (l + r) / 2;
+	pn = p->order[m];
+	if (pn->clust + pn->nclust <= first)
+	    l = m + 1;
+	else
+	    r = m;
+    }
+    pn = p->order[l];
+    for (c = first; c < last; c++) {
+	if (c >= pn->clust + pn->nclust)
+	    pn = p->order[++l];
+	if (c + 1 < pn->clust + pn->nclust)
+	    v = c + 1;
+	else
+	    v = p->fat == 32 ? 0x0fffffff : (1U << p->fat) - 1;
+	for (k = 0; k < npe; k++) {
+	    nib = (u_int64_t)c * npe + k;
+	    if (nib < lo || nib >= hi)
+		continue;
+	    if (nib & 1)
+		img[(nib - lo) / NPB] = (img[(nib - lo) / NPB] & 0x0f) |
+		    (v >> k * BPN & 0xf) << BPN;
+	    else
+		img[(nib - lo) / NPB] = (img[(nib - lo) / NPB] & 0xf0) |
+		    (v >> k * BPN & 0xf);
+	}
+    }
+    return true;
+}
+
+/*
+ * Fill in a short directory entry.
+ */
+static void
+pop_setent(struct populate *p, struct de *de, const u_int8_t *name,
+	   u_int attr, time_t mtime, u_int clust, off_t size)
+{
+    struct tm tmb, *tm;
+    u_int t, d;
+
+    tm = p->fixed_tm ? &p->tm : localtime_r(&mtime, &tmb);
+    if (tm == NULL || tm->tm_year < 80) {
+	t = 0;
+	d = 1 << 5 | 1;
+    } else {
+	t = (u_int)tm->tm_hour << 11 |
+	    (u_int)tm->tm_min << 5 |
+	    (u_int)tm->tm_sec >> 1;
+	d = (u_int)(MIN(tm->tm_year, 207) - 80) << 9 |
+	    (u_int)(tm->tm_mon + 1) << 5 |
+	    (u_int)tm->tm_mday;
+    }
+    memcpy(de->deName, name, sizeof(de->deName));
+    mk1(de->deAttributes, attr);
+    mk2(de->deCTime, t);
+    mk2(de->deCDate, d);
+    mk2(de->deADate, d);
+    mk2(de->deHighClust, clust >> 16);
+    mk2(de->deMTime, t);
+    mk2(de->deMDate, d);
+    mk2(de->deStartCluster, clust);
+    mk4(de->deFileSize, size);
+}
+
+/*
+ * Fill in long name entry ord (counting from 1) of pn.
+ */
+static void
+pop_setwinent(struct winentry *we, const struct pnode *pn, u_int ord,
+	      bool last)
+{
+    u_int8_t sum, *cp;
+    u_int c, i, j;
+
+    for (sum = 0, i = 0; i < sizeof(pn->name); i++)
+	sum = ((sum & 1) << 7) + (sum >> 1) + pn->name[i];
+    mk1(we->weCnt, ord | (last ? WIN_LAST : 0));
+    mk1(we->weAttributes, ATTR_WIN95);
+    mk1(we->weChksum, sum);
+    for (i = 0; i < WIN_CHARS; i++) {
+	j = (ord - 1) * WIN_CHARS + i;
+	c = j < pn->lnamelen ? pn->lname[j] : j == pn->lnamelen ? 0 : 0xffff;
+	cp = i < 5 ? we->wePart1 + i * 2 :
+	     i < 11 ? we->wePart2 + (i - 5) * 2 : we->wePart3 + (i - 11) * 2;
+	mk2(cp, c);
+    }
+}
+
+/*
+ * Fill in the next sector's worth of entries of directory dn.  Returns
+ * whether there were any.
+ */
+static bool
+pop_dir(struct populate *p, struct pnode *dn, u_int bps, u_int8_t *img)
+{
+    static const u_int8_t dot[11] = ".          ", dotdot[11] = "..         ";
+    struct pnode *pn;
+    struct de *de;
+    bool any;
+    u_int i, n;
+
+    any = false;
+    for (i = 0; i < bps / sizeof(struct de); i++, dn->ecur++) {
+	de = (struct de *)img + i;
+	if (dn->ecur < dn->pre) {
+	    /* the volume label is written by the caller */
+	    if (dn->parent == NULL)
+		continue;
+	    pn = dn->ecur ? dn->parent : dn;
+	    pop_setent(p, de, dn->ecur ? dotdot : dot, ATTR_DIRECTORY,
+		pn->mtime, pn == p->root ? 0 : pn->clust, 0);
+	    any = true;
+	    continue;
+	}
+	if (dn->kcur == dn->nkids)
+	    break;
+	pn = dn->kids[dn->kcur];
+	n = howmany(pn->lnamelen, WIN_CHARS);
+	if (dn->lcur < n) {
+	    pop_setwinent((struct winentry *)de, pn, n - dn->lcur,
+		dn->lcur == 0);
+	    dn->lcur++;
+	} else {
+	    pop_setent(p, de, pn->name,
+		pn->isdir ? ATTR_DIRECTORY : ATTR_ARCHIVE, pn->mtime,
+		pn->clust, pn->size);
+	    dn->kcur++;
+	    dn->lcur = 0;
+	}
+	any = true;
+    }
+    return any;
+}
+
+/*
+ * Copy the contents of file pn to its clusters, which start at the
+ * sector sw is at.
+ */
+static int
+pop_copy(struct pnode *pn, struct sectwriter *sw, u_int spc,
+	 copyfile_state_t cs)
+{
+    off_t whole, copied, off, n;
+    u_int lsn, tail;
+    int fd, rv;
+
+    rv = -1;
+    if ((fd = open(pn->path, O_RDONLY)) == -1) {
+	warn("%s", pn->path);
+	return -1;
+    }
+    if (sw_flush(sw) == -1)
+	goto werr;
+    lsn = sw->lsn;
+    whole = pn->size - pn->size % sw->bps;
+    tail = pn->size % sw->bps;
+    off = sw->offset + (off_t)sw->lsn * sw->bps;
+    if (sw->mem != NULL &&
+	off + whole + (tail ? sw->bps : 0) > (off_t)sw->memlen) {
+	errno = ENOSPC;
+	goto werr;
+    }
+    /* in pieces, so that progress gets reported for large files */
+    for (copied = 0; copied < whole; copied += n) {
+	n = MIN(whole - copied, COPYSZ);
+	if (sw->mem != NULL)
+	    n = pread(fd, sw->mem + off + copied, n, copied);
+	else if (sw->stream) {
+	    /* no seeking, so no copyfile_range(): go through the buffer */
+	    n = pread(fd, sw->buf, MIN(n, sw->end - sw->buf), copied);
+	    if (n > 0) {
+		sw->iov[0].iov_base = sw->buf;
+		sw->iov[0].iov_len = n;
+		if (sw_writev(sw->fd, sw->iov, 1) == -1)
+		    goto werr;
+	    }
+	} else {
+	    if (copyfile_range(fd, copied, sw->fd, off + copied, n, cs,
+		0) == -1) {
+		warn("%s", pn->path);
+		goto done;
+	    }
+	    copyfile_state_get(cs, COPYFILE_STATE_COPIED, &n);
+	}
+	if (n <= 0)
+	    break;
+	sw->lsn = lsn + (copied + n) / sw->bps;
+	sw_progress(sw, false);
+    }
+    if (copied != whole)
+	goto changed;
+    sw->lsn = lsn + whole / sw->bps;
+    if (tail) {
+	memset(sw->img, 0, sw->bps);
+	if (pread(fd, sw->img, tail, whole) != tail)
+	    goto changed;
+	if (sw_commit(sw, false) == -1)
+	    goto werr;
+    }
+    while (sw->lsn + sw->len / sw->bps < lsn + pn->nclust * spc) {
+	if (sw_commit(sw, true) == -1)
+	    goto werr;
+    }
+    rv = 0;
+    goto done;
+changed:
+    warnx("%s: file changed size while copying", pn->path);
+    goto done;
+werr:
+    warn("%s: can't write sector %u", pn->path, sw->lsn);
+done:
+    close(fd);
+    return rv;
+}
+
+/*
+ * Write the data region, from the sector sw is at: the directories, and
+ * the contents of the files.
+ */
+static int
+pop_data(struct populate *p, struct sectwriter *sw, u_int spc,
+	 const char *fname)
+{
+    copyfile_state_t cs;
+    struct pnode *pn;
+    u_int i, n;
+    int rv;
+
+    if ((cs = copyfile_state_alloc()) == NULL) {
+	warn(NULL);
+	return -1;
+    }
+    rv = -1;
+    for (i = 0; i < p->norder; i++) {
+	pn = p->order[i];
+	if (!pn->isdir) {
+	    if (pop_copy(pn, sw, spc, cs) == -1)
+		goto done;
+	    continue;
+	}
+	/* the first cluster of the FAT32 root was written with the FAT */
+	for (n = pn == p->root ? spc : 0; n < pn->nclust * spc; n++) {
+	    memset(sw->img, 0, sw->bps);
+	    if (sw_commit(sw, !pop_dir(p, pn, sw->bps, sw->img)) == -1) {
+		warn("%s: can't write sector %u", fname, sw->lsn);
+		goto done;
+	    }
+	}
+    }
+    rv = 0;
+done:
+    copyfile_state_free(cs);
+    return rv;
+}
@@ -31,19 +31,24 @@
  */
 
 #include <sys/types.h>
+#include <signal.h>
 #include <stdbool.h>
 #define ALLOPTS \
 AOPT('@', off_t, offset, 0, "Offset in device") \
 AOPT('A', bool, align, -2, "Attempt to cluster align root directory") \
 AOPT('B', const char *, bootstrap, -1, "Bootstrap file") \
 AOPT('C', off_t, create_size, 0, "Create file") \
+AOPT('D', const char *, source_dir, -1, "Populate from directory") \
+AOPT('E', bool, discard, -2, "Discard (TRIM or punch out) the old contents first") \
 AOPT('F', uint8_t,  fat_type, 12, "FAT type (12, 16, or 32)") \
+AOPT('G', uint32_t, erase_size, 1, "Align data to erase block size (bytes)") \
 AOPT('I', uint32_t, volume_id, 0, "Volume ID") \
 AOPT('L', const char *, volume_label, -1, "Volume Label") \
 AOPT('N', bool, no_create, -2, "Don't create filesystem, print params only") \
 AOPT('O', const char *, OEM_string, -1, "OEM string") \
 AOPT('S', uint16_t, bytes_per_sector, 1, "Bytes per sector") \
 AOPT('T', time_t, timestamp, 0, "Timestamp") \
+AOPT('Z', bool, sparse, -2, "Don't write all-zero sectors (only with -C)") \
 AOPT('a', uint32_t, sectors_per_fat, 1, "Sectors per FAT") \
 AOPT('b', uint32_t, block_size, 1, "Block size") \
 AOPT('c', uint8_t, sectors_per_cluster, 1, "Sectors per cluster") \
@@ -55,10 +60,22 @@ AOPT('k', uint16_t, backup_sector, 1, "Backup sector") \
 AOPT('m', uint8_t, media_descriptor, 0, "Media descriptor") \
 AOPT('n', uint8_t, num_FAT, 1, "Number of FATs") \
 AOPT('o', uint32_t, hidden_sectors, 0, "Hidden sectors") \
+AOPT('p', bool, prefix_only, -2, "Only stream the metadata to pipes, not the free space") \
+AOPT('q', uint16_t, io_depth, 1, "Chunks of MAXPHYS bytes per write") \
 AOPT('r', uint16_t, reserved_sectors, 1, "Reserved sectors") \
 AOPT('s', uint32_t, size, 1, "File System size") \
 AOPT('u', uint16_t, sectors_per_track, 1, "Sectors per track")
 
+/* Passed to the progress callback while a file system is being written */
+struct msdos_progress {
+	const char *fname;
+	uint64_t sectors_done;		/* written (or skipped, if sparse) */
+	uint64_t sectors_total;
+	uint32_t bytes_per_sector;
+	double elapsed;			/* seconds since writing started */
+	double throughput;		/* bytes per second */
+};
+
 struct msdos_options {
 #define AOPT(_opt, _type, _name, _min, _desc) _type _name;
 ALLOPTS
@@ -67,6 +84,93 @@ ALLOPTS
 	uint32_t volume_id_set:1;
 	uint32_t media_descriptor_set:1;
 	uint32_t hidden_sectors_set:1;
+
+	/* called every progress_interval ms (default 1000), and when done */
+	void (*progress)(const struct msdos_progress *, void *);
+	void *progress_arg;
+	uint32_t progress_interval;
+
+	/*
+	 * if set, the sector being written is reported on stderr whenever
+	 * this changes (e.g. counted up by a SIGINFO handler the caller
+	 * installed); the library never installs signal handlers itself,
+	 * and this is ignored if there's a progress callback
+	 */
+	volatile sig_atomic_t *info_count;
+};
+
+/* BIOS parameter block, in the form it has on disk once planned */
+struct msdos_bpb {
+    u_int bpbBytesPerSec;		/* bytes per sector */
+    u_int bpbSecPerClust;		/* sectors per cluster */
+    u_int bpbResSectors;		/* reserved sectors */
+    u_int bpbFATs;			/* number of FATs */
+    u_int bpbRootDirEnts;		/* root directory entries */
+    u_int bpbSectors;			/* total sectors */
+    u_int bpbMedia;			/* media descriptor */
+    u_int bpbFATsecs;			/* sectors per FAT */
+    u_int bpbSecPerTrack;		/* sectors per track */
+    u_int bpbHeads;			/* drive heads */
+    u_int bpbHiddenSecs;		/* hidden sectors */
+    u_int bpbHugeSectors; 		/* big total sectors */
+    u_int bpbBigFATsecs; 		/* big sectors per FAT */
+    u_int bpbRootClust; 		/* root directory start cluster */
+    u_int bpbFSInfo; 			/* file system info sector */
+    u_int bpbBackup; 			/* backup boot sector */
+};
+
+/* Layout of a planned file system; sectors count from the offset option */
+struct msdos_layout {
+	struct msdos_bpb bpb;
+	u_int fat;			/* FAT type (12, 16 or 32) */
+	u_int clusters;			/* data clusters */
+	u_int boot_sectors;		/* boot sector or bootstrap sectors */
+	u_int fat_sector;		/* first sector of the first FAT */
+	u_int fat_sectors;		/* sectors per FAT */
+	u_int dir_sector;		/* first root directory sector */
+	u_int dir_sectors;		/* root directory sectors (not FAT32) */
+	u_int data_sector;		/* first sector of cluster 2 */
+	u_int total_sectors;
+};
+
+struct msdos_plan {
+	struct msdos_options options;	/* strings are borrowed */
+	struct msdos_layout layout;
+};
+
+/* A file system to create with mkfs_msdos_batch() */
+struct msdos_target {
+	const char *fname;
+	const char *dtype;		/* disk type, or NULL */
+	const struct msdos_options *options;
+	int status;			/* what mkfs_msdos() returned */
+};
+
+/* A FAT partition for mkfs_msdos_disk() */
+struct msdos_partition {
+	const struct msdos_options *options;
+	off_t size;			/* bytes, 0 for the rest of the disk */
+	const char *name;		/* GPT partition name, or NULL */
+	bool efi;			/* EFI system partition, not basic data */
+	uint8_t guid[16];		/* GPT unique GUID, random if all zeros */
+	off_t offset;			/* where it starts, set when laid out */
+};
+
+/* A disk image made up of FAT partitions, for mkfs_msdos_disk() */
+struct msdos_disk {
+	bool mbr;			/* MBR partition table rather than GPT */
+	off_t size;			/* bytes, 0 to just fit the partitions */
+	uint32_t align;			/* partition alignment, 0 for 1MiB */
+	uint16_t sector_size;		/* 0 for 512 */
+	uint8_t guid[16];		/* disk GUID, random if all zeros */
+	struct msdos_partition *partitions;
+	size_t count;
 };
 
-int mkfs_msdos(const char *, const char *, const struct msdos_options *);
\ No newline at end of file
+int mkfs_msdos(const char *, const char *, const struct msdos_options *);
+int mkfs_msdos_mem(void *, size_t, const struct msdos_options *);
+int mkfs_msdos_plan(const char *, const char *, const struct msdos_options *,
+    struct msdos_plan *);
+int mkfs_msdos_write(const struct msdos_plan *, int);
+int mkfs_msdos_batch(struct msdos_target *, size_t, u_int);
+int mkfs_msdos_disk(const char *, int, const struct msdos_disk *);
\ No newline at end of file
@@ -0,0 +1,402 @@
+/*
+ * Build a whole disk image in one pass: the partition table (GPT, with
+ * its protective MBR and backup, or a plain MBR), followed by a FAT file
+ * system in each partition.  The file systems are laid out with
+ * mkfs_msdos_plan() at their partition's offset, with the hidden sectors
+ * pointing at its start, and written with mkfs_msdos_write(), so that
+ * everything goes out in order over the one descriptor; pipes and
+ * sockets get the gaps as zeros.
+ */
+
+#include <sys/cdefs.h>
+__FBSDID("$FreeBSD$");
+
+#include <sys/param.h>
+#include <sys/stat.h>
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "mkfs_msdos.h"
+
+#define	GPTENTS 128		/* partition entries */
+#define	GPTENTSZ 128		/* bytes per entry */
+#define	GPTHDRSZ 92
+#define	GPTNAMELEN 36		/* UTF-16 characters in a name */
+#define	MBRPARTS 4
+#define	MBROFF 446		/* first MBR partition entry */
+#define	ZEROSZ 65536
+
+#define	wr2(p, x)	((p)[0] = (u_int8_t)(x), (p)[1] = (u_int8_t)((x) >> 8))
+#define	wr4(p, x)	(wr2(p, x), wr2((p) + 2, (x) >> 16))
+#define	wr8(p, x)	(wr4(p, x), wr4((p) + 4, (uint64_t)(x) >> 32))
+
+/* partition types, as GUIDs are laid out on disk */
+static const u_int8_t gpt_basic_data[16] = {
+    0xa2, 0xa0, 0xd0, 0xeb, 0xe5, 0xb9, 0x33, 0x44,
+    0x87, 0xc0, 0x68, 0xb6, 0xb7, 0x26, 0x99, 0xc7
+};
+static const u_int8_t gpt_efi[16] = {
+    0x28, 0x73, 0x2a, 0xc1, 0x1f, 0xf8, 0xd2, 0x11,
+    0xba, 0x4b, 0x00, 0xa0, 0xc9, 0x3e, 0xc9, 0x3b
+};
+
+static const u_int8_t zeros[ZEROSZ];
+
+static uint32_t crc32(const u_int8_t *, size_t);
+static void mkguid(u_int8_t *, const u_int8_t *);
+static void mkchs(u_int8_t *, uint64_t);
+static void mkname(u_int8_t *, const char *);
+static void mkmbr(u_int8_t *, u_int, u_int8_t, uint64_t, uint64_t);
+static void mkgpt(u_int8_t *, u_int8_t *, uint64_t, uint64_t, uint64_t,
+    const u_int8_t *, u_int, uint32_t);
+static int put(int, bool, const void *, size_t, off_t);
+
+/*
+ * Partition and format a disk image.  If fd is -1, fname is created (or
+ * truncated) at the disk's size; otherwise the disk is written to fd,
+ * and fname is only used in messages.  The options of each partition
+ * are used as they are, except for the offset, size and hidden sectors,
+ * which come from where the partition ends up (and is stored back).
+ */
+int
+mkfs_msdos_disk(const char *fname, int fd, const struct msdos_disk *disk)
+{
+    struct msdos_options o;
+    struct msdos_plan *plans;
+    struct msdos_partition *p;
+    struct stat sb;
+    u_int8_t *head, *tail, *ent, guid[16];
+    uint64_t align, first, last, pos, end, total, start, len;
+    u_int ss, esec, i;
+    u_int8_t type;
+    bool stream;
+    int fd1, rv;
+
+    rv = -1;
+    fd1 = -1;
+    plans = NULL;
+    head = tail = NULL;
+    ss = disk->sector_size ? disk->sector_size : 512;
+    align = disk->align ? disk->align : 1024 * 1024;
+    if (ss < 512 || ss > 4096 || !powerof2(ss)) {
+	warnx("%s: bad sector size %u", fname, ss);
+	return -1;
+    }
+    if (align < ss || !powerof2(align)) {
+	warnx("%s: alignment %ju must be a power of 2, no smaller than a "
+	    "sector", fname, (uintmax_t)align);
+	return -1;
+    }
+    if (disk->count == 0 || disk->count > (disk->mbr ? MBRPARTS : GPTENTS)) {
+	warnx("%s: %zu partitions, can have 1 to %u", fname, disk->count,
+	    disk->mbr ? MBRPARTS : GPTENTS);
+	return -1;
+    }
+
+    /*
+     * GPT has a header and the entries at either end of the disk, MBR
+     * just the one sector at the start.
+     */
+    esec = disk->mbr ? 0 : GPTENTS * GPTENTSZ / ss;
+    first = disk->mbr ? 1 : 2 + esec;
+    last = disk->mbr ? 0 : 1 + esec;	/* sectors kept at the end */
+    if ((plans = calloc(disk->count, sizeof(*plans))) == NULL ||
+	(head = calloc(first, ss)) == NULL ||
+	(tail = calloc(MAX(last, 1), ss)) == NULL) {
+	warn(NULL);
+	goto done;
+    }
+
+    /* lay out every partition and file system before writing anything */
+    end = 0;
+    pos = roundup2(first * ss, align);
+    for (i = 0; i < disk->count; i++) {
+	p = &disk->partitions[i];
+	p->offset = pos;
+	if (p->size == 0) {
+	    if (i != disk->count - 1 || disk->size == 0) {
+		warnx("%s: only the last partition can fill the disk, and only "
+		    "if the disk has a size", fname);
+		goto done;
+	    }
+	    len = rounddown((uint64_t)disk->size, ss) - last * ss;
+	    len = len > pos ? len - pos : 0;
+	} else
+	    len = rounddown((uint64_t)p->size, ss);
+	start = pos / ss;
+	if (len == 0) {
+	    warnx("%s: partition %u is empty", fname, i + 1);
+	    goto done;
+	}
+	if (start > UINT32_MAX) {
+	    warnx("%s: partition %u starts too far in for FAT", fname, i + 1);
+	    goto done;
+	}
+	o = *p->options;
+	if (o.bytes_per_sector && o.bytes_per_sector != ss) {
+	    warnx("%s: partition %u has %u bytes per sector, the disk %u",
+		fname, i + 1, o.bytes_per_sector, ss);
+	    goto done;
+	}
+	o.bytes_per_sector = ss;
+	o.offset = pos;
+	o.create_size = pos + len;
+	o.size = (pos + len) / ss;
+	o.hidden_sectors = start;
+	o.hidden_sectors_set = true;
+	if (mkfs_msdos_plan(fname, NULL, &o, &plans[i]) == -1)
+	    goto done;
+	if (disk->mbr) {
+	    type = p->efi ? 0xef : plans[i].layout.fat == 12 ? 0x01 :
+		plans[i].layout.fat == 16 ? 0x0e : 0x0c;
+	    mkmbr(head, i, type, start, len / ss);
+	} else {
+	    ent = head + 2 * ss + i * GPTENTSZ;
+	    memcpy(ent, p->efi ? gpt_efi : gpt_basic_data, 16);
+	    mkguid(ent + 16, p->guid);
+	    wr8(ent + 32, start);
+	    wr8(ent + 40, start + len / ss - 1);
+	    if (p->name != NULL)
+		mkname(ent + 56, p->name);
+	}
+	end = pos + len;
+	pos = roundup2(end, align);
+    }
+    total = disk->size ? (uint64_t)disk->size / ss : end / ss + last;
+    if (total < first + last || end > (total - last) * ss) {
+	warnx("%s: partitions need %ju bytes, the disk only has %jd", fname,
+	    (uintmax_t)(end + last * ss), (intmax_t)disk->size);
+	goto done;
+    }
+    if (disk->mbr && total > UINT32_MAX) {
+	warnx("%s: too large for an MBR", fname);
+	goto done;
+    }
+    if (disk->mbr) {
+	mkguid(guid, disk->guid);
+	memcpy(head + 440, guid, 4);	/* disk signature */
+    } else {
+	mkmbr(head, 0, 0xee, 1, MIN(total - 1, UINT32_MAX));
+	memcpy(tail, head + 2 * ss, esec * ss);
+	mkgpt(head + ss, tail + esec * ss, total, first, total - last,
+	    disk->guid, ss, crc32(head + 2 * ss, esec * ss));
+    }
+    head[510] = 0x55;
+    head[511] = 0xaa;
+
+    if (fd == -1) {
+	if ((fd = fd1 = open(fname, O_RDWR | O_CREAT | O_TRUNC, 0644)) == -1) {
+	    warn("%s", fname);
+	    goto done;
+	}
+    }
+    stream = lseek(fd, 0, SEEK_CUR) == -1 && errno == ESPIPE;
+    if (!stream && fstat(fd, &sb) == 0 && S_ISREG(sb.st_mode) &&
+	sb.st_size < (off_t)(total * ss) && ftruncate(fd, total * ss) == -1) {
+	warn("%s", fname);
+	goto done;
+    }
+
+    /* in order: the table, each file system, and the backup table */
+    if (put(fd, stream, head, first * ss, 0) == -1) {
+	warn("%s", fname);
+	goto done;
+    }
+    pos = first * ss;
+    for (i = 0; i < disk->count; i++) {
+	p = &disk->partitions[i];
+	if (stream) {
+	    /* streaming from where the last one left off */
+	    if (put(fd, true, NULL, p->offset - pos, 0) == -1) {
+		warn("%s", fname);
+		goto done;
+	    }
+	    plans[i].options.offset = 0;
+	    plans[i].options.create_size = 0;
+	    plans[i].options.prefix_only = false;
+	    pos = p->offset + (uint64_t)plans[i].layout.total_sectors * ss;
+	}
+	if (mkfs_msdos_write(&plans[i], fd) == -1)
+	    goto done;
+    }
+    if (put(fd, stream, NULL, (total - last) * ss - pos, 0) == -1 ||
+	put(fd, stream, tail, last * ss, (total - last) * ss) == -1) {
+	warn("%s", fname);
+	goto done;
+    }
+    rv = 0;
+done:
+    if (fd1 != -1)
+	close(fd1);
+    free(plans);
+    free(head);
+    free(tail);
+    return rv;
+}
+
+/*
+ * Write len bytes of buf (or zeros, if it's NULL) at off; a stream
+ * gets them wherever it's at.  Zeros aren't written to anything else,
+ * as it's been truncated to size.
+ */
+static int
+put(int fd, bool stream, const void *buf, size_t len, off_t off)
+{
+    const u_int8_t *p = buf;
+    ssize_t n;
+
+    if (buf == NULL && !stream)
+	return 0;
+    while (len > 0) {
+	if (stream)
+	    n = write(fd, p ? p : zeros, p ? len : MIN(len, ZEROSZ));
+	else
+	    n = pwrite(fd, p, len, off);
+	if (n == -1) {
+	    if (errno == EINTR)
+		continue;
+	    return -1;
+	}
+	if (p != NULL)
+	    p += n;
+	len -= n;
+	off += n;
+    }
+    return 0;
+}
+
+/*
+ * CRC-32 as GPT uses it (the same as zlib's).
+ */
+static uint32_t
+crc32(const u_int8_t *p, size_t len)
+{
+    uint32_t crc = 0xffffffff;
+    int i;
+
+    while (len--) {
+	crc ^= *p++;
+	for (i = 0; i < 8; i++)
+	    crc = crc >> 1 ^ (0xedb88320 & -(crc & 1));
+    }
+    return ~crc;
+}
+
+/*
+ * Copy guid, or make up a random (version 4) one if it's all zeros.
+ */
+static void
+mkguid(u_int8_t *dest, const u_int8_t *guid)
+{
+    static const u_int8_t none[16];
+
+    if (memcmp(guid, none, sizeof(none))) {
+	memcpy(dest, guid, 16);
+	return;
+    }
+    arc4random_buf(dest, 16);
+    dest[7] = (dest[7] & 0x0f) | 0x40;
+    dest[8] = (dest[8] & 0x3f) | 0x80;
+}
+
+/*
+ * Cylinder/head/sector address of a sector, for the MBR, with the usual
+ * made up geometry; anything past what CHS can address gets the maximum.
+ */
+static void
+mkchs(u_int8_t *p, uint64_t lba)
+{
+    u_int c, h, s;
+
+    if (lba >= 1024 * 255 * 63) {
+	p[0] = 0xfe;
+	p[1] = 0xff;
+	p[2] = 0xff;
+	return;
+    }
+    c = lba / (255 * 63);
+    h = lba / 63 % 255;
+    s = lba % 63 + 1;
+    p[0] = h;
+    p[1] = s | (c >> 2 & 0xc0);
+    p[2] = c;
+}
+
+static void
+mkmbr(u_int8_t *mbr, u_int i, u_int8_t type, uint64_t start, uint64_t len)
+{
+    u_int8_t *p = mbr + MBROFF + i * 16;
+
+    mkchs(p + 1, start);
+    p[4] = type;
+    mkchs(p + 5, start + len - 1);
+    wr4(p + 8, start);
+    wr4(p + 12, len);
+}
+
+/*
+ * Store a UTF-8 name as UTF-16LE; anything that isn't valid or doesn't
+ * fit in 16 bits becomes an underscore, and it's cut short if need be.
+ */
+static void
+mkname(u_int8_t *dest, const char *name)
+{
+    const u_char *s;
+    u_int c, n, i;
+
+    for (s = (const u_char *)name, i = 0; *s && i < GPTNAMELEN; i++) {
+	c = *s++;
+	n = c >= 0xf0 ? 3 : c >= 0xe0 ? 2 : c >= 0xc0 ? 1 : 0;
+	if (c >= 0x80) {
+	    c &= 0x3f >> n;
+	    for (; n && (*s & 0xc0) == 0x80; n--)
+		c = c << 6 | (*s++ & 0x3f);
+	    if (n || c > 0xffff || c < 0x80)
+		c = '_';
+	}
+	wr2(dest + i * 2, c);
+    }
+}
+
+/*
+ * Fill in the primary and backup GPT headers; the entries are the same
+ * for both, with crc as their checksum.
+ */
+static void
+mkgpt(u_int8_t *hdr, u_int8_t *bak, uint64_t total, uint64_t first,
+    uint64_t last, const u_int8_t *guid, u_int ss, uint32_t crc)
+{
+    u_int esec = GPTENTS * GPTENTSZ / ss;
+
+    memcpy(hdr, "EFI PART", 8);
+    wr4(hdr + 8, 0x00010000);		/* revision 1.0 */
+    wr4(hdr + 12, GPTHDRSZ);
+    wr8(hdr + 24, 1);			/* this header */
+    wr8(hdr + 32, total - 1);		/* the other one */
+    wr8(hdr + 40, first);		/* first usable sector */
+    wr8(hdr + 48, last - 1);		/* last usable sector */
+    mkguid(hdr + 56, guid);
+    wr8(hdr + 72, 2);			/* entries */
+    wr4(hdr + 80, GPTENTS);
+    wr4(hdr + 84, GPTENTSZ);
+    wr4(hdr + 88, crc);
+
+    /* the backup has the locations the other way around */
+    memcpy(bak, hdr, GPTHDRSZ);
+    wr8(bak + 24, total - 1);
+    wr8(bak + 32, 1);
+    wr8(bak + 72, total - 1 - esec);
+
+    /* wr4() looks at its value more than once */
+    crc = crc32(hdr, GPTHDRSZ);
+    wr4(hdr + 16, crc);
+    crc = crc32(bak, GPTHDRSZ);
+    wr4(bak + 16, crc);
+}
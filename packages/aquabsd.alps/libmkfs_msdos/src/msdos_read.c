@@ -0,0 +1,1034 @@
+/*
+ * Read FAT file system images in place: the image is mmap(2)'d, and
+ * everything handed back (directory entries, cluster runs) points into
+ * or at the mapping.  File contents can be copied out with memcpy(), or
+ * straight from the image's descriptor with copyfile_range(), which lets
+ * the kernel do the copy (and share blocks, where the file system can).
+ */
+
+#include <sys/cdefs.h>
+__FBSDID("$FreeBSD$");
+
+#include <sys/param.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <ctype.h>
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define	HAVE_SIMD
+#include <immintrin.h>
+#endif
+
+#include <copyfile.h>
+
+#include "msdos_read.h"
+#include "msdosfs.h"
+
+#define	rd2(p)	((u_int)(p)[0] | (u_int)(p)[1] << 010)
+#define	rd4(p)	(rd2(p) | (u_int)rd2((p) + 2) << 020)
+
+#define	CHAINHASH 1024		/* chain cache buckets */
+
+#define	BIT(m, i)	((m)[(i) / 32] >> ((i) % 32) & 1)
+#define	SETBIT(m, i)	((m)[(i) / 32] |= 1U << ((i) % 32))
+
+/*
+ * Chains are cached by their first cluster, as runs of consecutive
+ * clusters.  Once added, a chain is neither changed nor dropped until
+ * the image is closed, so the runs can be handed out without copying.
+ */
+struct chain {
+    struct chain *next;
+    uint32_t first;
+    size_t nruns;
+    struct msdos_run runs[];
+};
+
+struct msdos_image {
+    char *fname;
+    int fd;
+    u_int8_t *map;			/* the whole file */
+    size_t maplen;
+    off_t offset;			/* of the file system in the file */
+    struct msdos_layout layout;
+    u_int bps;				/* bytes per sector */
+    u_int bpc;				/* bytes per cluster */
+    const u_int8_t *fat;		/* the active FAT */
+    pthread_mutex_t lock;		/* for chains */
+    struct chain *chains[CHAINHASH];
+};
+
+static int parse_bpb(struct msdos_image *);
+static uint32_t fat_get(const struct msdos_image *, uint32_t);
+static const struct de *dir_entry(const struct msdos_dir *, uint32_t);
+static void short_name(const struct de *, char *);
+static size_t utf8_name(const u_int16_t *, size_t, char *, size_t);
+static u_int8_t chksum(const u_int8_t *);
+static int file_runs(struct msdos_image *, const struct msdos_dirent *,
+    const struct msdos_run **, size_t *);
+static size_t scan_fat(const struct msdos_image *, size_t, uint32_t *);
+
+/*
+ * Map the FAT file system found offset bytes into the image fname.
+ */
+struct msdos_image *
+msdos_image_open(const char *fname, off_t offset)
+{
+    struct msdos_image *im;
+    struct stat sb;
+
+    if ((im = calloc(1, sizeof(*im))) == NULL) {
+	warn(NULL);
+	return NULL;
+    }
+    im->fd = -1;
+    im->map = MAP_FAILED;
+    im->offset = offset;
+    pthread_mutex_init(&im->lock, NULL);
+    if ((im->fname = strdup(fname)) == NULL) {
+	warn(NULL);
+	goto fail;
+    }
+    if ((im->fd = open(fname, O_RDONLY)) == -1 || fstat(im->fd, &sb) == -1) {
+	warn("%s", fname);
+	goto fail;
+    }
+    if (!S_ISREG(sb.st_mode)) {
+	warnx("%s: not an image file", fname);
+	goto fail;
+    }
+    if (offset < 0 || offset + MINBPS > sb.st_size) {
+	warnx("%s: no file system at offset %jd", fname, (intmax_t)offset);
+	goto fail;
+    }
+    im->maplen = sb.st_size;
+    im->map = mmap(NULL, im->maplen, PROT_READ, MAP_SHARED, im->fd, 0);
+    if (im->map == MAP_FAILED) {
+	warn("%s: mmap", fname);
+	goto fail;
+    }
+    if (parse_bpb(im) == -1)
+	goto fail;
+    return im;
+fail:
+    msdos_image_close(im);
+    return NULL;
+}
+
+void
+msdos_image_close(struct msdos_image *im)
+{
+    struct chain *c, *next;
+    u_int i;
+
+    for (i = 0; i < CHAINHASH; i++)
+	for (c = im->chains[i]; c != NULL; c = next) {
+	    next = c->next;
+	    free(c);
+	}
+    if (im->map != MAP_FAILED)
+	munmap(im->map, im->maplen);
+    if (im->fd != -1)
+	close(im->fd);
+    pthread_mutex_destroy(&im->lock);
+    free(im->fname);
+    free(im);
+}
+
+const struct msdos_layout *
+msdos_image_layout(const struct msdos_image *im)
+{
+    return &im->layout;
+}
+
+/*
+ * The start of the mapped image file; run offsets are relative to it.
+ */
+const void *
+msdos_image_map(const struct msdos_image *im)
+{
+    return im->map;
+}
+
+/*
+ * Work out the layout from the boot sector, the same way the kernel
+ * does: the FAT type follows from the number of clusters.
+ */
+static int
+parse_bpb(struct msdos_image *im)
+{
+    const u_int8_t *bs = im->map + im->offset;
+    const struct bsbpb *bsbpb;
+    const struct bsxbpb *bsxbpb;
+    struct msdos_layout *l = &im->layout;
+    struct msdos_bpb *bpb = &l->bpb;
+    u_int flags;
+
+    bsbpb = (const struct bsbpb *)(bs + sizeof(struct bs));
+    bsxbpb = (const struct bsxbpb *)(bsbpb + 1);
+    bpb->bpbBytesPerSec = rd2(bsbpb->bpbBytesPerSec);
+    bpb->bpbSecPerClust = bsbpb->bpbSecPerClust;
+    bpb->bpbResSectors = rd2(bsbpb->bpbResSectors);
+    bpb->bpbFATs = bsbpb->bpbFATs;
+    bpb->bpbRootDirEnts = rd2(bsbpb->bpbRootDirEnts);
+    bpb->bpbSectors = rd2(bsbpb->bpbSectors);
+    bpb->bpbMedia = bsbpb->bpbMedia;
+    bpb->bpbFATsecs = rd2(bsbpb->bpbFATsecs);
+    bpb->bpbSecPerTrack = rd2(bsbpb->bpbSecPerTrack);
+    bpb->bpbHeads = rd2(bsbpb->bpbHeads);
+    bpb->bpbHiddenSecs = rd4(bsbpb->bpbHiddenSecs);
+    bpb->bpbHugeSectors = rd4(bsbpb->bpbHugeSectors);
+    if (bpb->bpbFATsecs == 0) {
+	bpb->bpbBigFATsecs = rd4(bsxbpb->bpbBigFATsecs);
+	bpb->bpbRootClust = rd4(bsxbpb->bpbRootClust);
+	bpb->bpbFSInfo = rd2(bsxbpb->bpbFSInfo);
+	bpb->bpbBackup = rd2(bsxbpb->bpbBackup);
+    }
+    im->bps = bpb->bpbBytesPerSec;
+    if (im->bps < MINBPS || im->bps > MAXBPS || !powerof2(im->bps) ||
+	bpb->bpbSecPerClust == 0 || !powerof2(bpb->bpbSecPerClust) ||
+	bpb->bpbResSectors == 0 || bpb->bpbFATs == 0 ||
+	(bpb->bpbFATsecs == 0 && bpb->bpbBigFATsecs == 0)) {
+	warnx("%s: no FAT file system at offset %jd", im->fname,
+	    (intmax_t)im->offset);
+	return -1;
+    }
+    im->bpc = im->bps * bpb->bpbSecPerClust;
+    l->boot_sectors = 1;
+    l->fat_sector = bpb->bpbResSectors;
+    l->fat_sectors = bpb->bpbFATsecs ? bpb->bpbFATsecs : bpb->bpbBigFATsecs;
+    l->dir_sector = l->fat_sector + l->fat_sectors * bpb->bpbFATs;
+    l->dir_sectors = howmany(bpb->bpbRootDirEnts * sizeof(struct de),
+	im->bps);
+    l->data_sector = l->dir_sector + l->dir_sectors;
+    l->total_sectors = bpb->bpbSectors ? bpb->bpbSectors :
+	bpb->bpbHugeSectors;
+    if (l->total_sectors <= l->data_sector ||
+	(off_t)l->total_sectors * im->bps > (off_t)im->maplen - im->offset) {
+	warnx("%s: file system doesn't fit in the image", im->fname);
+	return -1;
+    }
+    l->clusters = (l->total_sectors - l->data_sector) /
+	bpb->bpbSecPerClust;
+    l->fat = l->clusters <= MAXCLS12 ? 12 : l->clusters <= MAXCLS16 ? 16 : 32;
+    if ((l->fat == 32) != (bpb->bpbFATsecs == 0) ||
+	(uint64_t)l->fat_sectors * im->bps * 8 / l->fat <
+	l->clusters + RESFTE) {
+	warnx("%s: FAT doesn't match the number of clusters", im->fname);
+	return -1;
+    }
+    im->fat = im->map + im->offset + (size_t)l->fat_sector * im->bps;
+    /* FAT32 can have mirroring turned off, and only one FAT in use */
+    if (l->fat == 32) {
+	flags = rd2(bsxbpb->bpbExtFlags);
+	if (flags & 0x80 && (flags & 0x0f) < bpb->bpbFATs)
+	    im->fat += (size_t)(flags & 0x0f) * l->fat_sectors * im->bps;
+    }
+    return 0;
+}
+
+static uint32_t
+fat_get(const struct msdos_image *im, uint32_t cl)
+{
+    const u_int8_t *p;
+
+    switch (im->layout.fat) {
+    case 12:
+	p = im->fat + cl + cl / 2;
+	return cl & 1 ? rd2(p) >> 4 : rd2(p) & 0xfff;
+    case 16:
+	return rd2(im->fat + cl * 2);
+    default:
+	return rd4(im->fat + cl * 4) & 0x0fffffff;
+    }
+}
+
+/*
+ * Get the chain starting at cluster first, as runs of consecutive
+ * clusters.  The runs stay valid until the image is closed.
+ */
+int
+msdos_chain(struct msdos_image *im, uint32_t first,
+    const struct msdos_run **runs, size_t *nruns)
+{
+    struct chain *c, *found, **bucket;
+    struct msdos_run *r;
+    uint32_t cl, next, eoc, steps;
+    size_t maxruns;
+    void *p;
+
+    if (first < RESFTE || first >= im->layout.clusters + RESFTE) {
+	warnx("%s: cluster %u is out of range", im->fname, first);
+	errno = EINVAL;
+	return -1;
+    }
+    bucket = &im->chains[first % CHAINHASH];
+    pthread_mutex_lock(&im->lock);
+    for (c = *bucket; c != NULL && c->first != first; c = c->next)
+	continue;
+    pthread_mutex_unlock(&im->lock);
+    if (c != NULL)
+	goto done;
+
+    /* a chain can't be longer than the file system, or it has a loop */
+    eoc = im->layout.fat == 12 ? 0xff8 : im->layout.fat == 16 ? 0xfff8 :
+	0x0ffffff8;
+    maxruns = 8;
+    if ((c = malloc(sizeof(*c) + maxruns * sizeof(*r))) == NULL) {
+	warn(NULL);
+	return -1;
+    }
+    c->first = first;
+    c->nruns = 0;
+    r = NULL;
+    for (cl = first, steps = 0;; cl = next) {
+	if (r != NULL && cl == r->cluster + r->count)
+	    r->count++;
+	else {
+	    if (c->nruns == maxruns) {
+		maxruns *= 2;
+		if ((p = realloc(c, sizeof(*c) + maxruns * sizeof(*r))) ==
+		    NULL) {
+		    warn(NULL);
+		    free(c);
+		    return -1;
+		}
+		c = p;
+	    }
+	    r = &c->runs[c->nruns++];
+	    r->cluster = cl;
+	    r->count = 1;
+	    r->offset = im->offset + ((off_t)im->layout.data_sector +
+		(off_t)(cl - RESFTE) * im->layout.bpb.bpbSecPerClust) *
+		im->bps;
+	}
+	next = fat_get(im, cl);
+	if (next >= eoc)
+	    break;
+	if (next < RESFTE || next >= im->layout.clusters + RESFTE ||
+	    ++steps >= im->layout.clusters) {
+	    warnx("%s: bad cluster chain from %u (at %u)", im->fname,
+		first, cl);
+	    free(c);
+	    errno = EINVAL;
+	    return -1;
+	}
+    }
+
+    /* someone else may have got there first */
+    pthread_mutex_lock(&im->lock);
+    for (found = *bucket; found != NULL && found->first != first;
+	found = found->next)
+	continue;
+    if (found == NULL) {
+	c->next = *bucket;
+	*bucket = c;
+    }
+    pthread_mutex_unlock(&im->lock);
+    if (found != NULL) {
+	free(c);
+	c = found;
+    }
+done:
+    *runs = c->runs;
+    *nruns = c->nruns;
+    return 0;
+}
+
+/*
+ * Start reading the directory de, or the root directory if de is NULL.
+ */
+int
+msdos_opendir(struct msdos_image *im, const struct msdos_dirent *de,
+    struct msdos_dir *dir)
+{
+    const struct msdos_layout *l = &im->layout;
+    uint64_t entries;
+    size_t i;
+
+    if (de != NULL && !(de->attributes & ATTR_DIRECTORY)) {
+	errno = ENOTDIR;
+	return -1;
+    }
+    dir->image = im;
+    dir->next = 0;
+    /* ".." entries in the root's children point at cluster 0 */
+    if ((de == NULL || de->cluster == 0) && l->fat != 32) {
+	dir->runs = NULL;
+	dir->nruns = 0;
+	dir->entries = l->bpb.bpbRootDirEnts;
+	return 0;
+    }
+    if (msdos_chain(im, de == NULL || de->cluster == 0 ?
+	l->bpb.bpbRootClust : de->cluster, &dir->runs, &dir->nruns) == -1)
+	return -1;
+    for (entries = 0, i = 0; i < dir->nruns; i++)
+	entries += (uint64_t)dir->runs[i].count * im->bpc / sizeof(struct de);
+    dir->entries = MIN(entries, UINT32_MAX);
+    return 0;
+}
+
+static const struct de *
+dir_entry(const struct msdos_dir *dir, uint32_t i)
+{
+    const struct msdos_image *im = dir->image;
+    uint64_t off;
+    size_t r;
+
+    off = (uint64_t)i * sizeof(struct de);
+    if (dir->runs == NULL)
+	return (const struct de *)(im->map + im->offset +
+	    (size_t)im->layout.dir_sector * im->bps + off);
+    for (r = 0; off >= (uint64_t)dir->runs[r].count * im->bpc; r++)
+	off -= (uint64_t)dir->runs[r].count * im->bpc;
+    return (const struct de *)(im->map + dir->runs[r].offset + off);
+}
+
+/*
+ * Get the next entry in dir, skipping ".", "..", the volume label and
+ * deleted entries.  Returns 1 with the entry in de, or 0 at the end.
+ */
+int
+msdos_readdir(struct msdos_dir *dir, struct msdos_dirent *de)
+{
+    const struct msdos_image *im = dir->image;
+    const struct winentry *we;
+    const struct de *e;
+    u_int16_t lname[WIN_MAXLEN + WIN_CHARS];
+    u_int lord, lsum, ord, i, n, t, d;
+    size_t llen;
+    struct tm tm;
+
+    lord = lsum = 0;
+    llen = 0;
+    while (dir->next < dir->entries) {
+	e = dir_entry(dir, dir->next++);
+	if (e->deName[0] == 0) {
+	    dir->next = dir->entries;
+	    break;
+	}
+	if (e->deName[0] == 0xe5) {
+	    lord = 0;
+	    continue;
+	}
+	if (e->deAttributes == ATTR_WIN95) {
+	    /* long name entries come last first, just before their entry */
+	    we = (const struct winentry *)e;
+	    ord = we->weCnt & ~WIN_LAST;
+	    if (we->weCnt & WIN_LAST) {
+		if (ord == 0 || ord * WIN_CHARS > WIN_MAXLEN + WIN_CHARS) {
+		    lord = 0;
+		    continue;
+		}
+		lsum = we->weChksum;
+		llen = ord * WIN_CHARS;
+	    } else if (lord == 0 || ord != lord - 1 || we->weChksum != lsum) {
+		lord = 0;
+		continue;
+	    }
+	    lord = ord;
+	    n = (ord - 1) * WIN_CHARS;
+	    for (i = 0; i < 5; i++)
+		lname[n++] = rd2(we->wePart1 + i * 2);
+	    for (i = 0; i < 6; i++)
+		lname[n++] = rd2(we->wePart2 + i * 2);
+	    for (i = 0; i < 2; i++)
+		lname[n++] = rd2(we->wePart3 + i * 2);
+	    continue;
+	}
+	if (e->deAttributes & ATTR_VOLUME ||
+	    !memcmp(e->deName, ".          ", 11) ||
+	    !memcmp(e->deName, "..         ", 11)) {
+	    lord = 0;
+	    continue;
+	}
+	short_name(e, de->short_name);
+	if (lord != 1 || lsum != chksum(e->deName) ||
+	    utf8_name(lname, llen, de->name, sizeof(de->name)) == 0)
+	    strcpy(de->name, de->short_name);
+	de->attributes = e->deAttributes;
+	de->cluster = rd2(e->deStartCluster);
+	if (im->layout.fat == 32)
+	    de->cluster |= rd2(e->deHighClust) << 16;
+	de->size = rd4(e->deFileSize);
+	t = rd2(e->deMTime);
+	d = rd2(e->deMDate);
+	memset(&tm, 0, sizeof(tm));
+	tm.tm_year = (d >> 9) + 80;
+	tm.tm_mon = MAX((int)(d >> 5 & 0xf), 1) - 1;
+	tm.tm_mday = MAX(d & 0x1f, 1);
+	tm.tm_hour = t >> 11;
+	tm.tm_min = t >> 5 & 0x3f;
+	tm.tm_sec = (t & 0x1f) * 2;
+	tm.tm_isdst = -1;
+	de->mtime = mktime(&tm);
+	de->entry = e;
+	return 1;
+    }
+    return 0;
+}
+
+/*
+ * Look up a path, from the root directory.
+ */
+int
+msdos_lookup(struct msdos_image *im, const char *path, struct msdos_dirent *de)
+{
+    struct msdos_dir dir;
+    const char *p, *end;
+    size_t len;
+    int rv;
+
+    memset(de, 0, sizeof(*de));
+    de->attributes = ATTR_DIRECTORY;
+    de->cluster = im->layout.fat == 32 ? im->layout.bpb.bpbRootClust : 0;
+    for (p = path; *p != '\0'; p = end) {
+	while (*p == '/')
+	    p++;
+	if (*p == '\0')
+	    break;
+	if ((end = strchr(p, '/')) == NULL)
+	    end = p + strlen(p);
+	len = end - p;
+	if (msdos_opendir(im, de, &dir) == -1)
+	    return -1;
+	while ((rv = msdos_readdir(&dir, de)) == 1)
+	    if ((strlen(de->name) == len && !strncasecmp(de->name, p, len)) ||
+		(strlen(de->short_name) == len &&
+		 !strncasecmp(de->short_name, p, len)))
+		break;
+	if (rv == 0) {
+	    errno = ENOENT;
+	    return -1;
+	}
+    }
+    return 0;
+}
+
+/*
+ * The runs of a file's chain, checking that they hold all of it.
+ */
+static int
+file_runs(struct msdos_image *im, const struct msdos_dirent *de,
+    const struct msdos_run **runs, size_t *nruns)
+{
+    uint64_t len;
+    size_t i;
+
+    if (de->attributes & ATTR_DIRECTORY) {
+	errno = EISDIR;
+	return -1;
+    }
+    *runs = NULL;
+    *nruns = 0;
+    if (de->size == 0)
+	return 0;
+    if (msdos_chain(im, de->cluster, runs, nruns) == -1)
+	return -1;
+    for (len = 0, i = 0; i < *nruns; i++)
+	len += (uint64_t)(*runs)[i].count * im->bpc;
+    if (len < de->size) {
+	warnx("%s: %s: cluster chain is shorter than the file", im->fname,
+	    de->name);
+	errno = EINVAL;
+	return -1;
+    }
+    return 0;
+}
+
+/*
+ * Read up to len bytes of the file de, from offset off.
+ */
+ssize_t
+msdos_pread(struct msdos_image *im, const struct msdos_dirent *de, void *buf,
+    size_t len, off_t off)
+{
+    const struct msdos_run *runs;
+    size_t nruns, i, n, done;
+    off_t rlen;
+
+    if (file_runs(im, de, &runs, &nruns) == -1)
+	return -1;
+    if (off < 0) {
+	errno = EINVAL;
+	return -1;
+    }
+    if (off >= de->size)
+	return 0;
+    len = MIN(len, de->size - off);
+    for (i = 0, done = 0; i < nruns && done < len; i++) {
+	rlen = (off_t)runs[i].count * im->bpc;
+	if (off >= rlen) {
+	    off -= rlen;
+	    continue;
+	}
+	n = MIN(len - done, rlen - off);
+	memcpy((u_int8_t *)buf + done, im->map + runs[i].offset + off, n);
+	done += n;
+	off = 0;
+    }
+    return done;
+}
+
+/*
+ * Copy the file de to fd at offset off, a run at a time, with
+ * copyfile_range(); the copyfile state may be NULL.
+ */
+int
+msdos_extract(struct msdos_image *im, const struct msdos_dirent *de, int fd,
+    off_t off, copyfile_state_t cs)
+{
+    const struct msdos_run *runs;
+    copyfile_state_t s;
+    size_t nruns, i;
+    off_t left, n, copied;
+    int rv;
+
+    if (file_runs(im, de, &runs, &nruns) == -1)
+	return -1;
+    if ((s = cs) == NULL && (s = copyfile_state_alloc()) == NULL) {
+	warn(NULL);
+	return -1;
+    }
+    rv = -1;
+    left = de->size;
+    for (i = 0; i < nruns && left > 0; i++) {
+	n = MIN(left, (off_t)runs[i].count * im->bpc);
+	if (copyfile_range(im->fd, runs[i].offset, fd, off, n, s, 0) == -1) {
+	    warn("%s: %s", im->fname, de->name);
+	    goto done;
+	}
+	copyfile_state_get(s, COPYFILE_STATE_COPIED, &copied);
+	if (copied != n) {
+	    warnx("%s: %s: short copy", im->fname, de->name);
+	    goto done;
+	}
+	off += n;
+	left -= n;
+    }
+    rv = 0;
+done:
+    if (cs == NULL)
+	copyfile_state_free(s);
+    return rv;
+}
+
+struct checker {
+    struct msdos_image *im;
+    struct msdos_check *ck;
+    uint32_t *used;			/* clusters with non-zero entries */
+    uint32_t *seen;			/* clusters reached from directories */
+    uint32_t max;			/* one past the last cluster */
+    uint32_t eoc;			/* end of chain, and above */
+    uint32_t bad;			/* bad cluster mark */
+    char path[PATH_MAX];
+};
+
+#define	problem(c, ...) \
+    ((c)->ck->problems++, warnx(__VA_ARGS__))
+
+/*
+ * Follow a chain from a directory entry, marking its clusters as seen.
+ * Returns the number of clusters it has, or 0 if it runs into a
+ * cluster which was already seen (a cross-link) or out of the file
+ * system (a bad link).
+ */
+static uint32_t
+check_chain(struct checker *c, uint32_t first)
+{
+    const char *fname = c->im->fname;
+    uint32_t cl, next, n;
+
+    for (cl = first, n = 1;; cl = next, n++) {
+	if (cl < RESFTE || cl >= c->max) {
+	    c->ck->bad_links++;
+	    problem(c, "%s: %s: bad link to cluster %u", fname, c->path, cl);
+	    return 0;
+	}
+	if (BIT(c->seen, cl)) {
+	    c->ck->cross_links++;
+	    problem(c, "%s: %s: cross-linked at cluster %u", fname, c->path,
+		cl);
+	    return 0;
+	}
+	SETBIT(c->seen, cl);
+	next = fat_get(c->im, cl);
+	if (next >= c->eoc)
+	    return n;
+	if (next == 0 || next == c->bad) {
+	    c->ck->bad_links++;
+	    problem(c, "%s: %s: chain ends in %s cluster %u", fname, c->path,
+		next ? "a bad" : "a free", cl);
+	    return 0;
+	}
+    }
+}
+
+/*
+ * Check every chain reachable from directory de (or the root).
+ */
+static void
+check_dir(struct checker *c, const struct msdos_dirent *de)
+{
+    const char *fname = c->im->fname;
+    struct msdos_dirent e;
+    struct msdos_dir dir;
+    size_t len;
+    uint32_t n;
+
+    if (msdos_opendir(c->im, de, &dir) == -1) {
+	problem(c, "%s: %s: can't read directory", fname, c->path);
+	return;
+    }
+    len = strlen(c->path);
+    while (msdos_readdir(&dir, &e) == 1) {
+	snprintf(c->path + len, sizeof(c->path) - len, "/%s", e.name);
+	if (e.cluster == 0) {
+	    if (e.attributes & ATTR_DIRECTORY || e.size != 0) {
+		c->ck->size_mismatches++;
+		problem(c, "%s: %s: has no clusters", fname, c->path);
+	    }
+	    continue;
+	}
+	if ((n = check_chain(c, e.cluster)) == 0)
+	    continue;
+	if (e.attributes & ATTR_DIRECTORY)
+	    check_dir(c, &e);
+	else if (n != howmany((uint64_t)e.size, c->im->bpc)) {
+	    c->ck->size_mismatches++;
+	    problem(c, "%s: %s: %u clusters for %u bytes", fname, c->path, n,
+		e.size);
+	}
+    }
+    c->path[len] = '\0';
+}
+
+/*
+ * The parts of the boot sectors and FATs which don't depend on what's
+ * in the file system.
+ */
+static void
+check_meta(struct checker *c)
+{
+    const struct msdos_image *im = c->im;
+    const struct msdos_layout *l = &im->layout;
+    const u_int8_t *bs, *fat0, *fs;
+    const struct bsxbpb *bsxbpb;
+    uint32_t mask, flags, e;
+    size_t fatlen;
+    u_int i;
+
+    bs = im->map + im->offset;
+    bsxbpb = (const struct bsxbpb *)(bs + sizeof(struct bs) +
+	sizeof(struct bsbpb));
+    if (rd2(bs + MINBPS - 2) != DOSMAGIC)
+	problem(c, "%s: boot sector has no signature", im->fname);
+    if (l->bpb.bpbMedia < 0xf8 && l->bpb.bpbMedia != 0xf0)
+	problem(c, "%s: bad media descriptor %#x", im->fname,
+	    l->bpb.bpbMedia);
+    if (l->fat == 32 && l->bpb.bpbBackup != 0 &&
+	l->bpb.bpbBackup != 0xffff &&
+	(l->bpb.bpbBackup >= l->fat_sector ||
+	 memcmp(bs, bs + (size_t)l->bpb.bpbBackup * im->bps, MINBPS)))
+	problem(c, "%s: backup boot sector doesn't match", im->fname);
+
+    /* entry 0 holds the media descriptor, entry 1 end of chain */
+    mask = l->fat == 12 ? 0xfff : l->fat == 16 ? 0xffff : 0x0fffffff;
+    flags = l->fat == 12 ? 0 : l->fat == 16 ? 0xc000 : 0x0c000000;
+    if (fat_get(im, 0) != ((mask & ~0xffU) | l->bpb.bpbMedia))
+	problem(c, "%s: FAT entry 0 doesn't match the media descriptor",
+	    im->fname);
+    if ((fat_get(im, 1) | flags) < c->eoc)
+	problem(c, "%s: FAT entry 1 isn't an end of chain mark", im->fname);
+
+    /* the FATs are all the same, unless FAT32 mirroring is off */
+    fat0 = im->map + im->offset + (size_t)l->fat_sector * im->bps;
+    fatlen = (size_t)l->fat_sectors * im->bps;
+    if (l->fat != 32 || !(rd2(bsxbpb->bpbExtFlags) & 0x80))
+	for (i = 1; i < l->bpb.bpbFATs; i++)
+	    if (memcmp(fat0, fat0 + i * fatlen, fatlen))
+		problem(c, "%s: FAT %u differs from FAT 0", im->fname, i);
+
+    if (l->fat != 32 || l->bpb.bpbFSInfo == 0 || l->bpb.bpbFSInfo == 0xffff)
+	return;
+    if (l->bpb.bpbFSInfo >= l->fat_sector) {
+	problem(c, "%s: FSInfo sector is out of range", im->fname);
+	return;
+    }
+    fs = bs + (size_t)l->bpb.bpbFSInfo * im->bps;
+    if (rd4(fs) != 0x41615252 || rd4(fs + MINBPS - 28) != 0x61417272 ||
+	rd2(fs + MINBPS - 2) != DOSMAGIC) {
+	problem(c, "%s: FSInfo sector has no signature", im->fname);
+	return;
+    }
+    c->ck->fsinfo_free = rd4(fs + MINBPS - 24);
+    c->ck->fsinfo_next = rd4(fs + MINBPS - 20);
+    e = c->ck->fsinfo_next;
+    if (e != 0xffffffff && (e < RESFTE || e >= c->max))
+	problem(c, "%s: FSInfo next free cluster %u is out of range",
+	    im->fname, e);
+}
+
+/*
+ * Check the image for consistency, warning about each problem found:
+ * the boot sector, FATs, FSInfo sector, and every chain (finding those
+ * which are cross-linked, or lost).  Returns 0 if the image is clean, 1
+ * if there are problems, and -1 if it couldn't be checked at all.
+ */
+int
+msdos_check(struct msdos_image *im, struct msdos_check *ck)
+{
+    struct checker c;
+    uint32_t *pred, lost, cl, next;
+    size_t words, i;
+    int rv;
+
+    memset(ck, 0, sizeof(*ck));
+    ck->fsinfo_free = ck->fsinfo_next = 0xffffffff;
+    memset(&c, 0, sizeof(c));
+    c.im = im;
+    c.ck = ck;
+    c.max = im->layout.clusters + RESFTE;
+    c.eoc = im->layout.fat == 12 ? 0xff8 : im->layout.fat == 16 ? 0xfff8 :
+	0x0ffffff8;
+    c.bad = c.eoc - 1;
+    words = howmany(c.max, 32);
+    rv = -1;
+    c.used = calloc(words, sizeof(*c.used));
+    c.seen = calloc(words, sizeof(*c.seen));
+    pred = calloc(words, sizeof(*pred));
+    if (c.used == NULL || c.seen == NULL || pred == NULL) {
+	warn(NULL);
+	goto done;
+    }
+    check_meta(&c);
+
+    /* which clusters are in use, a vector at a time */
+    for (i = scan_fat(im, c.max, c.used); i < c.max; i++)
+	if (fat_get(im, i) != 0)
+	    SETBIT(c.used, i);
+    c.used[0] &= ~3U;
+    for (i = 0; i < words; i++)
+	ck->free_clusters += __builtin_popcount(~c.used[i]);
+    ck->free_clusters -= RESFTE + words * 32 - c.max;
+
+    /* everything reachable from the root, and what's left over */
+    if (im->layout.fat == 32) {
+	snprintf(c.path, sizeof(c.path), "(root)");
+	if (check_chain(&c, im->layout.bpb.bpbRootClust) == 0)
+	    goto lost;
+	c.path[0] = '\0';
+    }
+    check_dir(&c, NULL);
+lost:
+    for (i = 0; i < words; i++)
+	for (lost = c.used[i] & ~c.seen[i]; lost != 0; lost &= lost - 1) {
+	    cl = i * 32 + __builtin_ctz(lost);
+	    if ((next = fat_get(im, cl)) == c.bad) {
+		ck->bad_clusters++;
+		continue;
+	    }
+	    ck->lost_clusters++;
+	    if (next >= RESFTE && next < c.max && !BIT(c.seen, next))
+		SETBIT(pred, next);
+	}
+    for (i = 0; i < words; i++)
+	for (lost = c.used[i] & ~c.seen[i] & ~pred[i]; lost != 0;
+	    lost &= lost - 1)
+	    if (fat_get(im, i * 32 + __builtin_ctz(lost)) != c.bad)
+		ck->lost_chains++;
+    /* chains which loop back on themselves have no start */
+    if (ck->lost_clusters != 0 && ck->lost_chains == 0)
+	ck->lost_chains = 1;
+    if (ck->lost_clusters != 0)
+	problem(&c, "%s: %u lost clusters in %u chains", im->fname,
+	    ck->lost_clusters, ck->lost_chains);
+    ck->used_clusters = im->layout.clusters - ck->free_clusters -
+	ck->bad_clusters;
+    if (ck->fsinfo_free != 0xffffffff && ck->fsinfo_free != ck->free_clusters)
+	problem(&c, "%s: FSInfo says %u free clusters, there are %u",
+	    im->fname, ck->fsinfo_free, ck->free_clusters);
+    rv = ck->problems != 0;
+done:
+    free(c.used);
+    free(c.seen);
+    free(pred);
+    return rv;
+}
+
+#ifdef HAVE_SIMD
+/*
+ * Set a bit in used for every non-zero FAT16 or FAT32 entry, 32 entries
+ * (a word of used) at a time.  Returns how many entries were done; the
+ * rest are left to the caller.
+ */
+__attribute__((target("avx2")))
+static size_t
+scan_avx2(const u_int8_t *fat, u_int width, size_t n, uint32_t *used)
+{
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i mask = _mm256_set1_epi32(0x0fffffff);
+    __m256i a, b;
+    uint32_t m;
+    size_t i;
+    u_int j;
+
+    for (i = 0; i + 32 <= n; i += 32) {
+	if (width == 16) {
+	    a = _mm256_loadu_si256((const __m256i *)(fat + i * 2));
+	    b = _mm256_loadu_si256((const __m256i *)(fat + i * 2 + 32));
+	    a = _mm256_cmpeq_epi16(a, zero);
+	    b = _mm256_cmpeq_epi16(b, zero);
+	    /* packing works within 128-bit lanes, put them back in order */
+	    a = _mm256_permute4x64_epi64(_mm256_packs_epi16(a, b), 0xd8);
+	    m = _mm256_movemask_epi8(a);
+	} else {
+	    for (m = 0, j = 0; j < 4; j++) {
+		a = _mm256_loadu_si256((const __m256i *)(fat + i * 4 + j * 32));
+		a = _mm256_cmpeq_epi32(_mm256_and_si256(a, mask), zero);
+		m |= (uint32_t)_mm256_movemask_ps(_mm256_castsi256_ps(a)) <<
+		    (j * 8);
+	    }
+	}
+	used[i / 32] = ~m;
+    }
+    return i;
+}
+
+__attribute__((target("sse2")))
+static size_t
+scan_sse2(const u_int8_t *fat, u_int width, size_t n, uint32_t *used)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i mask = _mm_set1_epi32(0x0fffffff);
+    __m128i a, b;
+    uint32_t m;
+    size_t i;
+    u_int j;
+
+    for (i = 0; i + 32 <= n; i += 32) {
+	m = 0;
+	if (width == 16)
+	    for (j = 0; j < 2; j++) {
+		a = _mm_loadu_si128((const __m128i *)(fat + i * 2 + j * 32));
+		b = _mm_loadu_si128((const __m128i *)(fat + i * 2 + j * 32 +
+		    16));
+		a = _mm_packs_epi16(_mm_cmpeq_epi16(a, zero),
+		    _mm_cmpeq_epi16(b, zero));
+		m |= (uint32_t)_mm_movemask_epi8(a) << (j * 16);
+	    }
+	else
+	    for (j = 0; j < 8; j++) {
+		a = _mm_loadu_si128((const __m128i *)(fat + i * 4 + j * 16));
+		a = _mm_cmpeq_epi32(_mm_and_si128(a, mask), zero);
+		m |= (uint32_t)_mm_movemask_ps(_mm_castsi128_ps(a)) << (j * 4);
+	    }
+	used[i / 32] = ~m;
+    }
+    return i;
+}
+#endif
+
+/*
+ * Mark the first n entries' clusters in used as far as it can be done
+ * with vector instructions; FAT12 entries straddle bytes, so they're
+ * left to fat_get().
+ */
+static size_t
+scan_fat(const struct msdos_image *im, size_t n, uint32_t *used)
+{
+#ifdef HAVE_SIMD
+    if (im->layout.fat != 12) {
+	if (__builtin_cpu_supports("avx2"))
+	    return scan_avx2(im->fat, im->layout.fat, n, used);
+	if (__builtin_cpu_supports("sse2"))
+	    return scan_sse2(im->fat, im->layout.fat, n, used);
+    }
+#endif
+    return 0;
+}
+
+/*
+ * Make "NAME.EXT" out of a short name entry.
+ */
+static void
+short_name(const struct de *e, char *name)
+{
+    u_int i, n;
+
+    n = 0;
+    for (i = 0; i < 8 && e->deName[i] != ' '; i++)
+	name[n++] = !i && e->deName[0] == 5 ? (char)0xe5 :
+	    e->deLowerCase & 0x08 ? tolower(e->deName[i]) : e->deName[i];
+    if (e->deName[8] != ' ') {
+	name[n++] = '.';
+	for (i = 8; i < 11 && e->deName[i] != ' '; i++)
+	    name[n++] = e->deLowerCase & 0x10 ? tolower(e->deName[i]) :
+		e->deName[i];
+    }
+    name[n] = '\0';
+}
+
+/*
+ * Convert a long name from UTF-16 to UTF-8.  Returns its length, or 0
+ * if it doesn't fit (or isn't valid).
+ */
+static size_t
+utf8_name(const u_int16_t *src, size_t srclen, char *dst, size_t dstlen)
+{
+    u_int32_t c;
+    size_t i, n;
+
+    for (i = n = 0; i < srclen && src[i] != 0; i++) {
+	c = src[i];
+	if (c >= 0xd800 && c < 0xdc00 && i + 1 < srclen &&
+	    src[i + 1] >= 0xdc00 && src[i + 1] < 0xe000)
+	    c = 0x10000 + ((c - 0xd800) << 10) + (src[++i] - 0xdc00);
+	else if (c >= 0xd800 && c < 0xe000)
+	    return 0;
+	if (n + 4 >= dstlen)
+	    return 0;
+	if (c < 0x80)
+	    dst[n++] = c;
+	else if (c < 0x800) {
+	    dst[n++] = 0xc0 | c >> 6;
+	    dst[n++] = 0x80 | (c & 0x3f);
+	} else if (c < 0x10000) {
+	    dst[n++] = 0xe0 | c >> 12;
+	    dst[n++] = 0x80 | (c >> 6 & 0x3f);
+	    dst[n++] = 0x80 | (c & 0x3f);
+	} else {
+	    dst[n++] = 0xf0 | c >> 18;
+	    dst[n++] = 0x80 | (c >> 12 & 0x3f);
+	    dst[n++] = 0x80 | (c >> 6 & 0x3f);
+	    dst[n++] = 0x80 | (c & 0x3f);
+	}
+    }
+    dst[n] = '\0';
+    return n;
+}
+
+/*
+ * Checksum of a short name, as kept in its long name entries.
+ */
+static u_int8_t
+chksum(const u_int8_t *name)
+{
+    u_int8_t sum;
+    int i;
+
+    for (sum = 0, i = 0; i < 11; i++)
+	sum = ((sum & 1) << 7 | sum >> 1) + name[i];
+    return sum;
+}
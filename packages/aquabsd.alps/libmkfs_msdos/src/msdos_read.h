@@ -0,0 +1,78 @@
+/*	$FreeBSD$	*/
+
+/*
+ * Reading FAT file system images, without mounting them.  The image is
+ * mapped into memory, and directories, file contents and cluster chains
+ * are all looked at in place.
+ */
+
+#ifndef _MSDOS_READ_H_
+#define	_MSDOS_READ_H_
+
+#include <sys/types.h>
+#include <stdint.h>
+
+#include <copyfile.h>
+
+#include "mkfs_msdos.h"
+
+struct msdos_image;
+
+/* A run of consecutive clusters in a chain */
+struct msdos_run {
+	uint32_t cluster;		/* first cluster */
+	uint32_t count;			/* clusters */
+	off_t offset;			/* byte offset in the image file */
+};
+
+struct msdos_dirent {
+	char name[256 * 3];		/* long name (as UTF-8), or short name */
+	char short_name[13];		/* 8.3, with the dot */
+	uint8_t attributes;
+	uint32_t cluster;		/* first cluster, 0 if none */
+	uint32_t size;
+	time_t mtime;			/* local time, as FAT has no zone */
+	const void *entry;		/* short name entry, in the image */
+};
+
+/* Where msdos_readdir() is at in a directory */
+struct msdos_dir {
+	struct msdos_image *image;
+	const struct msdos_run *runs;	/* NULL for the FAT12/16 root */
+	size_t nruns;
+	uint32_t entries;
+	uint32_t next;			/* next entry to look at */
+};
+
+/* What msdos_check() found */
+struct msdos_check {
+	uint32_t free_clusters;
+	uint32_t used_clusters;
+	uint32_t bad_clusters;		/* marked bad */
+	uint32_t lost_clusters;		/* in use, but in no file */
+	uint32_t lost_chains;
+	uint32_t cross_links;		/* clusters in more than one file */
+	uint32_t bad_links;		/* chains leading out of the FAT */
+	uint32_t size_mismatches;	/* files with the wrong chain length */
+	uint32_t fsinfo_free;		/* as the FSInfo sector has them */
+	uint32_t fsinfo_next;
+	uint32_t problems;		/* all of the above, and more */
+};
+
+struct msdos_image *msdos_image_open(const char *, off_t);
+void msdos_image_close(struct msdos_image *);
+const struct msdos_layout *msdos_image_layout(const struct msdos_image *);
+const void *msdos_image_map(const struct msdos_image *);
+int msdos_chain(struct msdos_image *, uint32_t, const struct msdos_run **,
+    size_t *);
+int msdos_opendir(struct msdos_image *, const struct msdos_dirent *,
+    struct msdos_dir *);
+int msdos_readdir(struct msdos_dir *, struct msdos_dirent *);
+int msdos_lookup(struct msdos_image *, const char *, struct msdos_dirent *);
+ssize_t msdos_pread(struct msdos_image *, const struct msdos_dirent *, void *,
+    size_t, off_t);
+int msdos_extract(struct msdos_image *, const struct msdos_dirent *, int,
+    off_t, copyfile_state_t);
+int msdos_check(struct msdos_image *, struct msdos_check *);
+
+#endif /* !_MSDOS_READ_H_ */
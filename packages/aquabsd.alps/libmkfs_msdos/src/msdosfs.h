@@ -0,0 +1,94 @@
+/*	$FreeBSD$	*/
+
+/*
+ * On-disk structures of the FAT file system, shared by the writer
+ * (mkfs_msdos.c) and the reader (msdos_read.c).  Not installed.
+ */
+
+#ifndef _MSDOSFS_H_
+#define	_MSDOSFS_H_
+
+#include <sys/types.h>
+
+#define	DOSMAGIC  0xaa55	/* DOS magic number */
+#define	MINBPS	  512		/* minimum bytes per sector */
+#define	MAXBPS    4096		/* maximum bytes per sector */
+#define	RESFTE	  2		/* reserved FAT entries */
+#define	MAXCLS12  0xff4U	/* maximum FAT12 clusters */
+#define	MAXCLS16  0xfff4U	/* maximum FAT16 clusters */
+
+struct bs {
+    u_int8_t bsJump[3];			/* bootstrap entry point */
+    u_int8_t bsOemName[8];		/* OEM name and version */
+} __packed;
+
+struct bsbpb {
+    u_int8_t bpbBytesPerSec[2];		/* bytes per sector */
+    u_int8_t bpbSecPerClust;		/* sectors per cluster */
+    u_int8_t bpbResSectors[2];		/* reserved sectors */
+    u_int8_t bpbFATs;			/* number of FATs */
+    u_int8_t bpbRootDirEnts[2];		/* root directory entries */
+    u_int8_t bpbSectors[2];		/* total sectors */
+    u_int8_t bpbMedia;			/* media descriptor */
+    u_int8_t bpbFATsecs[2];		/* sectors per FAT */
+    u_int8_t bpbSecPerTrack[2];		/* sectors per track */
+    u_int8_t bpbHeads[2];		/* drive heads */
+    u_int8_t bpbHiddenSecs[4];		/* hidden sectors */
+    u_int8_t bpbHugeSectors[4];		/* big total sectors */
+} __packed;
+
+struct bsxbpb {
+    u_int8_t bpbBigFATsecs[4];		/* big sectors per FAT */
+    u_int8_t bpbExtFlags[2];		/* FAT control flags */
+    u_int8_t bpbFSVers[2];		/* file system version */
+    u_int8_t bpbRootClust[4];		/* root directory start cluster */
+    u_int8_t bpbFSInfo[2];		/* file system info sector */
+    u_int8_t bpbBackup[2];		/* backup boot sector */
+    u_int8_t bpbReserved[12];		/* reserved */
+} __packed;
+
+struct bsx {
+    u_int8_t exDriveNumber;		/* drive number */
+    u_int8_t exReserved1;		/* reserved */
+    u_int8_t exBootSignature;		/* extended boot signature */
+    u_int8_t exVolumeID[4];		/* volume ID number */
+    u_int8_t exVolumeLabel[11];		/* volume label */
+    u_int8_t exFileSysType[8];		/* file system type */
+} __packed;
+
+struct de {
+    u_int8_t deName[11];		/* name and extension */
+    u_int8_t deAttributes;		/* attributes */
+    u_int8_t deLowerCase;		/* NT case flags */
+    u_int8_t deCHundredth;		/* creation time, 10ms units */
+    u_int8_t deCTime[2];		/* creation time */
+    u_int8_t deCDate[2];		/* creation date */
+    u_int8_t deADate[2];		/* last-accessed date */
+    u_int8_t deHighClust[2];		/* starting cluster, high word */
+    u_int8_t deMTime[2];		/* last-modified time */
+    u_int8_t deMDate[2];		/* last-modified date */
+    u_int8_t deStartCluster[2];		/* starting cluster */
+    u_int8_t deFileSize[4];		/* size */
+} __packed;
+
+struct winentry {
+    u_int8_t weCnt;			/* sequence number */
+    u_int8_t wePart1[10];		/* characters 1-5 */
+    u_int8_t weAttributes;		/* always 0x0f */
+    u_int8_t weReserved1;
+    u_int8_t weChksum;			/* short name checksum */
+    u_int8_t wePart2[12];		/* characters 6-11 */
+    u_int8_t weReserved2[2];
+    u_int8_t wePart3[4];		/* characters 12-13 */
+} __packed;
+
+#define	WIN_CHARS 13			/* characters per long name entry */
+#define	WIN_MAXLEN 255			/* maximum long name length */
+#define	WIN_LAST 0x40			/* last long name entry */
+
+#define	ATTR_VOLUME 0x08		/* volume label */
+#define	ATTR_DIRECTORY 0x10		/* directory */
+#define	ATTR_ARCHIVE 0x20		/* file is new or modified */
+#define	ATTR_WIN95 0x0f			/* long name entry */
+
+#endif /* !_MSDOSFS_H_ */
@@ -87,6 +87,18 @@ typedef struct {
 
 	size_t oid_len;
 	int* oid;
+
+	// internal: set if the key & OID belong to a list returned by 'settings_list' or to an iterator, in which case 'setting_free' leaves them be
+
+	bool __borrowed;
+
+	// internal: set if the data belongs to a buffer returned by 'settings_read_many', in which case 'setting_free' leaves it be
+
+	bool __batched;
+
+	// internal: set if the OID was looked up by key, in which case it has room for 'CTL_MAXNAME' integers & can be looked up again if it goes stale
+
+	bool __resolved;
 } setting_t;
 
 char* settings_error_str(void);
@@ -99,16 +111,62 @@ char* settings_error_str(void);
 
 int settings_list(setting_t*** settings_ref, size_t* settings_len_ref, settings_privilege_t privilege, int user);
 
+// like 'settings_list', but only for the settings under 'prefix' (e.g. "vm.stats"), or just that setting if it isn't a node
+// only that subtree is walked, so this takes time proportional to its size rather than to the whole tree's
+// a NULL or empty 'prefix' lists all settings
+
+int settings_list_prefix(const char* prefix, setting_t*** settings_ref, size_t* settings_len_ref, settings_privilege_t privilege, int user);
+
+// free a list allocated by 'settings_list', including all of the 'setting_t' objects in it
+// the settings are all allocated out of the same arena, so they can't be freed individually; 'setting_free' may still be called on them to free what was read into them
+
+int settings_list_free(setting_t** settings, size_t settings_len);
+
+// walk through settings one at a time, rather than allocating a list of all of them up front
+// 'settings_iter_begin' takes the same 'privilege' & 'user' parameters as 'settings_list', and returns NULL on error
+// 'settings_iter_next' sets 'setting_ref' to the next setting and returns 1, or returns 0 once there are none left (-1 on error)
+// the setting handed out is owned by the iterator & reused by the next call to 'settings_iter_next', so anything which must outlive it must be copied out
+// 'setting_read_descr' & 'setting_read' may be called on it as usual, but 'setting_free' is not needed
+
+typedef struct settings_iter_t settings_iter_t;
+
+settings_iter_t* settings_iter_begin(settings_privilege_t privilege, int user);
+settings_iter_t* settings_iter_begin_prefix(const char* prefix, settings_privilege_t privilege, int user); // see 'settings_list_prefix'
+int settings_iter_next(settings_iter_t* iter, setting_t** setting_ref);
+int settings_iter_end(settings_iter_t* iter);
+
 // search for a specific setting by key, privilege level, and user
 // read the description for 'settings_list' for more information on the 'privilege' & 'user' parameters
 
 setting_t* settings_search(const char* key, settings_privilege_t privilege, int user);
 
+// 'settings_search' caches what it looks up, so repeated searches for the same key don't need to ask the kernel again
+// the cache is dropped by itself when a kernel module is loaded or unloaded (this is checked at most once a second), or explicitly by 'settings_cache_flush'
+// 'settings_cache_save' & 'settings_cache_load' persist it to 'path' across runs
+// a cache file from a previous boot or from before a kernel module was (un)loaded is ignored, as is a missing one
+
+void settings_cache_flush(void);
+int settings_cache_load(const char* path);
+int settings_cache_save(const char* path);
+
 // read the description or data from a 'setting_t' object
 
 int setting_read_descr(setting_t* setting);
 int setting_read(setting_t* setting);
 
+// read the data of many settings at once, which for a setting that's been read before (by 'settings_read_many' or 'setting_read') costs a single sysctl call
+// the data of all settings is placed in the one buffer returned in 'buf_ref', which must be freed by the caller (with 'free') once it's done with them, and not before the next call to 'settings_read_many' for the same settings
+// settings which couldn't be read are left with 'data' set to NULL, as with 'setting_read'
+
+int settings_read_many(setting_t** settings, size_t settings_len, void** buf_ref);
+
+// like 'settings_read_many', but searching for the settings by key first
+// 'settings_ref' is set to an array of 'keys_len' settings, in the same order as 'keys' (which must outlive them), and must be freed by the caller (with 'free') along with 'buf_ref'
+// keys which can't be found are left with 'oid' & 'data' set to NULL, rather than failing the whole call
+// read the description for 'settings_list' for more information on the 'privilege' & 'user' parameters
+
+int settings_read_many_keys(const char* const* keys, size_t keys_len, settings_privilege_t privilege, int user, setting_t** settings_ref, void** buf_ref);
+
 // write the data in 'data' & 'len' to a 'setting_t' object
 
 int setting_write(setting_t* setting, void* data, size_t len, settings_priority_t priority);
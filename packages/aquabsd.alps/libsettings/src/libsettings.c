@@ -3,13 +3,19 @@
 
 #include <settings.h>
 
+#include <stddef.h>
 #include <stdio.h>
 #include <string.h>
 #include <errno.h>
+#include <time.h>
+#include <unistd.h>
 
 #include <err.h>
 
+#include <sys/param.h>
+#include <sys/linker.h>
 #include <sys/sysctl.h>
+#include <sys/time.h>
 
 static char* error_str = NULL;
 
@@ -40,16 +46,114 @@ static inline int __emit_error(char* fmt, char* data_primary, char* data_seconda
 	return -1;
 }
 
-static inline setting_t* __stack_add(setting_t*** settings_ref, size_t* settings_len_ref) {
-	size_t settings_len = *settings_len_ref;
+// arena backing the lists returned by 'settings_list'
+// the 'setting_t' objects themselves are stored contiguously in an array which grows geometrically, and their keys & OIDs are bump-allocated out of a chain of blocks (which also grow geometrically)
+// everything in a list is thus freed at once by 'settings_list_free', rather than entry by entry
 
-	setting_t** settings = realloc(*settings_ref, (settings_len + 1) * sizeof *settings);
+#define ARENA_SETTINGS_MIN 256
+#define ARENA_BLOCK_MIN (16 * 1024)
 
-	setting_t* setting = calloc(1, sizeof *setting);
-	settings[settings_len++] = setting;
+typedef struct arena_block_t {
+	struct arena_block_t* next;
 
-	*settings_ref = settings;
-	*settings_len_ref = settings_len;
+	size_t size;
+	size_t used;
+
+	uint8_t data[];
+} arena_block_t;
+
+typedef struct {
+	setting_t* settings;
+	size_t settings_len;
+	size_t settings_cap;
+
+	arena_block_t* blocks; // most recent first
+} arena_t;
+
+// header preceding the array of pointers handed back by 'settings_list', so that 'settings_list_free' can find the arena from it
+
+typedef struct {
+	arena_t arena;
+	setting_t* settings[];
+} arena_list_t;
+
+static void* __arena_alloc(arena_t* arena, size_t size) {
+	size = (size + sizeof(void*) - 1) & ~(sizeof(void*) - 1);
+	arena_block_t* block = arena->blocks;
+
+	if (!block || block->used + size > block->size) {
+		size_t block_size = block ? block->size * 2 : ARENA_BLOCK_MIN;
+
+		while (block_size < size) {
+			block_size *= 2;
+		}
+
+		block = malloc(sizeof *block + block_size);
+
+		if (!block) {
+			return NULL;
+		}
+
+		block->next = arena->blocks;
+		block->size = block_size;
+		block->used = 0;
+
+		arena->blocks = block;
+	}
+
+	void* const ptr = block->data + block->used;
+	block->used += size;
+
+	return ptr;
+}
+
+static char* __arena_strdup(arena_t* arena, const char* str) {
+	size_t const len = strlen(str) + 1;
+	char* const copy = __arena_alloc(arena, len);
+
+	if (copy) {
+		memcpy(copy, str, len);
+	}
+
+	return copy;
+}
+
+static void __arena_free(arena_t* arena) {
+	for (size_t i = 0; i < arena->settings_len; i++) {
+		setting_free(&arena->settings[i]);
+	}
+
+	free(arena->settings);
+
+	for (arena_block_t* block = arena->blocks, *next; block; block = next) {
+		next = block->next;
+		free(block);
+	}
+
+	memset(arena, 0, sizeof *arena);
+}
+
+// the returned setting is only valid until the next call, as the array may be moved when it grows
+
+static setting_t* __arena_add(arena_t* arena) {
+	if (arena->settings_len == arena->settings_cap) {
+		size_t const cap = arena->settings_cap ? arena->settings_cap * 2 : ARENA_SETTINGS_MIN;
+		setting_t* const settings = realloc(arena->settings, cap * sizeof *settings);
+
+		if (!settings) {
+			return NULL;
+		}
+
+		arena->settings = settings;
+		arena->settings_cap = cap;
+	}
+
+	setting_t* const setting = &arena->settings[arena->settings_len++];
+	memset(setting, 0, sizeof *setting);
+
+	// the key & OID belong to the arena, so 'setting_free' must leave them be
+
+	setting->__borrowed = true;
 
 	return setting;
 }
@@ -84,10 +188,14 @@ static inline int __query_sysctl(int query, size_t oid_len, int* oid, size_t* bu
 	return 0;
 }
 
-static inline int __sysctl_fill(setting_t* setting, size_t oid_len, int* oid, settings_privilege_t privilege) {
-	// get sysctl OID format
-	// make sure it's a sysctl kind we actually care about, based on our privilege
+// what 'CTL_SYSCTL_OIDFMT' tells us about a sysctl
 
+typedef struct {
+	uint32_t kind; // 'CTLTYPE_*' & 'CTLFLAG_*'
+	settings_type_t type;
+} sysctl_fmt_t;
+
+static inline int __sysctl_fmt(size_t oid_len, int* oid, sysctl_fmt_t* fmt_ref) {
 	uint8_t buf[BUFSIZ];
 	size_t buf_len = sizeof buf;
 
@@ -98,40 +206,22 @@ static inline int __sysctl_fill(setting_t* setting, size_t oid_len, int* oid, se
 	uint32_t kind = *(uint32_t*) buf;
 	char* fmt = (void*) (buf + sizeof kind);
 
-	if (kind & CTLFLAG_TUN) {
-		setting->privilege = SETTINGS_PRIVILEGE_BOOT;
-	}
-
-	else {
-		setting->privilege = SETTINGS_PRIVILEGE_KERN;
-	}
-
-	if (setting->privilege != privilege) {
-		return 0;
-	}
-
-	setting->writeable = kind & CTLFLAG_WR;
+	fmt_ref->kind = kind;
 	int type = kind & CTLTYPE;
 
-	// 'sysctl' setting, so fill in 'setting_t.oid' & 'setting_t.oid_len'
+	// fill in type
 
-	setting->oid_len = oid_len;
-	setting->oid = malloc(oid_len * sizeof *oid);
-	memcpy(setting->oid, oid, oid_len * sizeof *oid);
-
-	// fill in type field of setting
-
-	setting->type = SETTINGS_TYPE_OPAQUE;
+	fmt_ref->type = SETTINGS_TYPE_OPAQUE;
 
 	#define SETTING_TYPE_CASE(name) \
 		else if (type == CTLTYPE_##name) { \
-			setting->type = SETTINGS_TYPE_##name; \
+			fmt_ref->type = SETTINGS_TYPE_##name; \
 		}
 
 	if (type == CTLTYPE_OPAQUE) {
 		#define OPAQUE_SETTING_TYPE_CASE(name, settings_type) \
 			else if (strcmp(fmt, (name)) == 0) { \
-				setting->type = SETTINGS_TYPE_##settings_type; \
+				fmt_ref->type = SETTINGS_TYPE_##settings_type; \
 			}
 
 		if (0) {}
@@ -179,151 +269,792 @@ static inline int __sysctl_fill(setting_t* setting, size_t oid_len, int* oid, se
 	return 0;
 }
 
-static inline void __free_settings(setting_t** settings, size_t settings_len) {
-	for (int i = 0; i < settings_len; i++) {
-		setting_t* setting = settings[i];
-		setting_free(setting);
+// if 'oid_buf' is set, the OID is copied into it (it must fit 'CTL_MAXNAME' integers), otherwise it's allocated
+
+static inline int __sysctl_fill(setting_t* setting, size_t oid_len, int* oid, const sysctl_fmt_t* fmt, settings_privilege_t privilege, int* oid_buf) {
+	// make sure it's a sysctl kind we actually care about, based on our privilege
+
+	if (fmt->kind & CTLFLAG_TUN) {
+		setting->privilege = SETTINGS_PRIVILEGE_BOOT;
+	}
+
+	else {
+		setting->privilege = SETTINGS_PRIVILEGE_KERN;
+	}
+
+	if (setting->privilege != privilege) {
+		return 0;
+	}
+
+	setting->writeable = fmt->kind & CTLFLAG_WR;
+	setting->type = fmt->type;
+
+	// 'sysctl' setting, so fill in 'setting_t.oid' & 'setting_t.oid_len'
+	// 'oid_len' is in bytes
+
+	setting->oid_len = oid_len;
+	setting->oid = oid_buf ? oid_buf : malloc(oid_len);
+
+	if (!setting->oid) {
+		return __emit_error("Failed to allocate OID", NULL, NULL);
 	}
 
-	free(settings);
+	memcpy(setting->oid, oid, oid_len);
+
+	return 0;
 }
 
-static inline int __list_sysctl(setting_t*** settings_ref, size_t* settings_len_ref, settings_privilege_t privilege) {
-	*settings_ref = NULL;
-	*settings_len_ref = 0;
+// iterator state for walking the sysctl tree
+// only one 'setting_t' object is ever handed out, with its key & OID pointing into the buffers here, so memory use doesn't depend on the size of the tree
+
+struct settings_iter_t {
+	settings_privilege_t privilege;
+	int user;
 
 	// taking heavily from 'sysctl_all' in 'sbin/sysctl/sysctl.c'
 
-	int name[CTL_MAXNAME + 2] = {
-		CTL_SYSCTL,
-		CTL_SYSCTL_NEXTNOSKIP, // as opposed to 'CTL_SYSCTL_NEXT', don't reject entries we must skip
-		CTL_KERN,
-	};
+	int name[CTL_MAXNAME + 2];
+	size_t name_len;
+
+	// the walk stops as soon as it leaves the subtree of 'prefix' ('prefix_len' is in bytes, and 0 for the whole tree)
+	// if the prefix is a single setting rather than a subtree, 'leaf' is set & that's the only one handed out
+
+	int prefix[CTL_MAXNAME];
+	size_t prefix_len;
+	bool leaf;
 
-	size_t name_len = 3;
+	bool done;
 
-	while (1) {
+	setting_t setting;
+	char key[BUFSIZ];
+	int oid[CTL_MAXNAME];
+};
+
+static inline int __resolve_sysctl(const char* key, size_t* mib_len_ref, int* mib, sysctl_fmt_t* fmt_ref);
+
+settings_iter_t* settings_iter_begin_prefix(const char* prefix, settings_privilege_t privilege, int user) {
+	if (privilege == SETTINGS_PRIVILEGE_USER) {
+		__emit_error("settings_iter_begin: Unimplemented privilege level (SETTINGS_PRIVILEGE_USER)", NULL, NULL);
+		return NULL;
+	}
+
+	else if (privilege == SETTINGS_PRIVILEGE_AQUA) {
+		__emit_error("settings_iter_begin: Unimplemented privilege level (SETTINGS_PRIVILEGE_AQUA)", NULL, NULL);
+		return NULL;
+	}
+
+	else if (privilege != SETTINGS_PRIVILEGE_BOOT && privilege != SETTINGS_PRIVILEGE_KERN) {
+		__emit_error("settings_iter_begin: Unknown privilege level", NULL, NULL);
+		return NULL;
+	}
+
+	settings_iter_t* const iter = calloc(1, sizeof *iter);
+
+	if (!iter) {
+		__emit_error("settings_iter_begin: Failed to allocate iterator", NULL, NULL);
+		return NULL;
+	}
+
+	iter->privilege = privilege;
+	iter->user = user;
+
+	iter->name[0] = CTL_SYSCTL;
+	iter->name[1] = CTL_SYSCTL_NEXTNOSKIP; // as opposed to 'CTL_SYSCTL_NEXT', don't reject entries we must skip
+	iter->name[2] = CTL_KERN;
+	iter->name_len = 3;
+
+	if (!prefix || !*prefix) {
+		return iter;
+	}
+
+	// start walking from the prefix's OID
+
+	sysctl_fmt_t fmt;
+
+	if (__resolve_sysctl(prefix, &iter->prefix_len, iter->prefix, &fmt) < 0) {
+		free(iter);
+		return NULL; // error already emitted
+	}
+
+	memcpy(iter->name + 2, iter->prefix, iter->prefix_len);
+	iter->name_len = 2 + iter->prefix_len / sizeof(int);
+
+	iter->leaf = fmt.type != SETTINGS_TYPE_NODE;
+
+	return iter;
+}
+
+settings_iter_t* settings_iter_begin(settings_privilege_t privilege, int user) {
+	return settings_iter_begin_prefix(NULL, privilege, user);
+}
+
+int settings_iter_next(settings_iter_t* iter, setting_t** setting_ref) {
+	if (!iter || !setting_ref) {
+		return __emit_error("settings_iter_next: Passed references point to NULL", NULL, NULL);
+	}
+
+	*setting_ref = NULL;
+
+	// free whatever was read into the previous setting; its key & OID are the iterator's own buffers
+
+	setting_t* const setting = &iter->setting;
+
+	setting_free(setting);
+	memset(setting, 0, sizeof *setting);
+	setting->__borrowed = true;
+
+	while (!iter->done) {
 		int oid[CTL_MAXNAME];
 		size_t oid_len = sizeof oid;
 
-		if (sysctl(name, name_len, oid, &oid_len, 0, 0) < 0) {
-			if (errno == ENOENT) {
-				break;
-			}
+		if (iter->leaf) {
+			oid_len = iter->prefix_len;
+			memcpy(oid, iter->prefix, oid_len);
 
-			__emit_error("sysctl(getnext): %s", strerror(errno), NULL);
-			goto error;
+			iter->done = true;
 		}
 
-		if (oid_len < 0) {
-			break;
-		}
+		else {
+			if (sysctl(iter->name, iter->name_len, oid, &oid_len, 0, 0) < 0) {
+				if (errno == ENOENT) {
+					break;
+				}
 
-		// get key of sysctl from OID
-
-		char key[BUFSIZ];
-		size_t key_len = sizeof key;
+				return __emit_error("sysctl(getnext): %s", strerror(errno), NULL);
+			}
 
-		if (__query_sysctl(CTL_SYSCTL_NAME, oid_len, oid, &key_len, key) < 0) {
-			goto error; // error already emitted
+			if (oid_len < iter->prefix_len || memcmp(oid, iter->prefix, iter->prefix_len)) {
+				break; // left the subtree
+			}
 		}
 
-		// add setting
+		memcpy(iter->name + 2, oid, oid_len);
+		iter->name_len = 2 + oid_len / sizeof(int);
+
+		// get key of sysctl from OID
 
-		setting_t* setting = __stack_add(settings_ref, settings_len_ref);
+		size_t key_len = sizeof iter->key;
 
-		if (!setting) {
-			__emit_error("Failed to allocate 'setting_t' object ('__stack_add')", NULL, NULL);
-			goto error;
+		if (__query_sysctl(CTL_SYSCTL_NAME, oid_len, oid, &key_len, iter->key) < 0) {
+			return -1; // error already emitted
 		}
 
 		// fill setting
 
-		setting->key = strdup(key);
-		int rv = __sysctl_fill(setting, oid_len, oid, privilege);
+		sysctl_fmt_t fmt;
+		int rv = __sysctl_fmt(oid_len, oid, &fmt);
 
-		if (rv < 0) {
-			// pop setting back off settings stack
-
-			(*settings_len_ref)--;
-			free(setting);
+		if (rv == 0) {
+			rv = __sysctl_fill(setting, oid_len, oid, &fmt, iter->privilege, iter->oid);
+		}
 
+		if (rv < 0) {
 			if (rv > -2) {
-				goto error; // error already emitted
+				return -1; // error already emitted
 			}
+
+			memset(setting, 0, sizeof *setting);
+			setting->__borrowed = true;
+
+			continue;
 		}
 
-		memcpy(name + 2, oid, oid_len);
-		name_len = 2 + oid_len / sizeof(int);
+		setting->key = iter->key;
+		*setting_ref = setting;
+
+		return 1;
 	}
 
+	iter->done = true;
 	return 0;
+}
 
-error:
+int settings_iter_end(settings_iter_t* iter) {
+	if (!iter) {
+		return -1;
+	}
+
+	setting_free(&iter->setting);
+	free(iter);
+
+	return 0;
+}
 
-	__free_settings(*settings_ref, *settings_len_ref);
+int settings_list_prefix(const char* prefix, setting_t*** settings_ref, size_t* settings_len_ref, settings_privilege_t privilege, int user) {
+	if (!settings_ref || !settings_len_ref) {
+		return __emit_error("settings_list: Passed references point to NULL", NULL, NULL);
+	}
 
 	*settings_ref = NULL;
 	*settings_len_ref = 0;
 
-	return -1;
+	settings_iter_t* const iter = settings_iter_begin_prefix(prefix, privilege, user);
+
+	if (!iter) {
+		return -1; // error already emitted
+	}
+
+	// copy each setting the iterator hands out into the arena
+
+	arena_t arena = { 0 };
+
+	setting_t* setting;
+	int rv;
+
+	while ((rv = settings_iter_next(iter, &setting)) > 0) {
+		setting_t* const copy = __arena_add(&arena);
+
+		if (!copy) {
+			rv = __emit_error("Failed to allocate 'setting_t' object ('__arena_add')", NULL, NULL);
+			break;
+		}
+
+		copy->privilege = setting->privilege;
+		copy->type = setting->type;
+		copy->writeable = setting->writeable;
+
+		copy->key = __arena_strdup(&arena, setting->key);
+
+		if (!copy->key) {
+			rv = __emit_error("Failed to allocate key ('__arena_strdup')", NULL, NULL);
+			break;
+		}
+
+		if (!setting->oid) {
+			continue;
+		}
+
+		copy->oid_len = setting->oid_len;
+		copy->oid = __arena_alloc(&arena, setting->oid_len);
+
+		if (!copy->oid) {
+			rv = __emit_error("Failed to allocate OID ('__arena_alloc')", NULL, NULL);
+			break;
+		}
+
+		memcpy(copy->oid, setting->oid, setting->oid_len);
+	}
+
+	settings_iter_end(iter);
+
+	if (rv < 0) {
+		__arena_free(&arena);
+		return -1; // error already emitted
+	}
+
+	// now that the 'setting_t' objects won't be moving anymore, make the array of pointers to them
+
+	arena_list_t* const list = malloc(sizeof *list + arena.settings_len * sizeof *list->settings);
+
+	if (!list) {
+		__arena_free(&arena);
+		return __emit_error("settings_list: Failed to allocate list", NULL, NULL);
+	}
+
+	list->arena = arena;
+
+	for (size_t i = 0; i < arena.settings_len; i++) {
+		list->settings[i] = &arena.settings[i];
+	}
+
+	*settings_ref = list->settings;
+	*settings_len_ref = arena.settings_len;
+
+	return 0;
 }
 
 int settings_list(setting_t*** settings_ref, size_t* settings_len_ref, settings_privilege_t privilege, int user) {
-	if (!settings_ref || !settings_len_ref) {
-		return __emit_error("settings_list: Passed references point to NULL", NULL, NULL);
+	return settings_list_prefix(NULL, settings_ref, settings_len_ref, privilege, user);
+}
+
+int settings_list_free(setting_t** settings, size_t settings_len) {
+	if (!settings) {
+		return -1;
 	}
 
-	if (privilege == SETTINGS_PRIVILEGE_BOOT || privilege == SETTINGS_PRIVILEGE_KERN) {
-		if (__list_sysctl(settings_ref, settings_len_ref, privilege) < 0) {
-			return -1; // error already emitted
+	arena_list_t* const list = (void*) ((uint8_t*) settings - offsetof(arena_list_t, settings));
+	__arena_free(&list->arena);
+	free(list);
+
+	return 0;
+}
+
+// cache of the sysctls 'settings_search' has already looked up, so that looking the same keys up again doesn't cost a 'CTL_SYSCTL_NAME2OID' & a 'CTL_SYSCTL_OIDFMT' query each time
+// it's an open-addressed hash table (with linear probing) from key to OID & format
+// sysctls registered by a kernel module go away when it's unloaded, and their OIDs may then be reused by others, so the whole cache is dropped whenever the set of loaded modules changes
+// that's only checked every 'CACHE_CHECK_INTERVAL' seconds, so that lookups in between don't make any system calls at all
+
+#define CACHE_MIN 512 // must be a power of 2
+#define CACHE_CHECK_INTERVAL 1
+
+#define CACHE_MAGIC "SETCACH1"
+
+typedef struct {
+	char* key; // NULL if the slot is empty
+	uint32_t hash;
+
+	size_t oid_len;
+	int oid[CTL_MAXNAME];
+	sysctl_fmt_t fmt;
+
+	size_t len_hint; // length of the data the last time it was read (see 'settings_read_many'), or 0 if it never has been
+} cache_entry_t;
+
+static struct {
+	cache_entry_t* entries;
+	size_t len;
+	size_t cap;
+
+	bool checked;
+	time_t checked_at;
+	uint64_t kld_sig;
+} cache;
+
+// header & entries of cache files (see 'settings_cache_save')
+// OIDs are only valid for the boot (and set of modules) they were looked up in, so those are recorded too
+
+typedef struct {
+	char magic[8];
+	struct timeval boottime;
+	uint64_t kld_sig;
+	uint64_t len;
+} cache_file_header_t;
+
+typedef struct {
+	uint32_t key_len;
+	uint32_t oid_len;
+	uint32_t kind;
+	uint32_t type;
+} cache_file_entry_t;
+
+static uint32_t __cache_hash(const char* key) {
+	// FNV-1a
+
+	uint32_t hash = 2166136261u;
+
+	for (; *key; key++) {
+		hash = (hash ^ (uint8_t) *key) * 16777619u;
+	}
+
+	return hash;
+}
+
+static uint64_t __kld_sig(void) {
+	// file ID's are handed out to modules in increasing order as they're loaded, so a hash of all of them changes whenever one is loaded or unloaded
+
+	uint64_t sig = 14695981039346656037ull;
+
+	for (int id = kldnext(0); id > 0; id = kldnext(id)) {
+		sig = (sig ^ (uint32_t) id) * 1099511628211ull;
+	}
+
+	return sig;
+}
+
+void settings_cache_flush(void) {
+	for (size_t i = 0; i < cache.cap; i++) {
+		free(cache.entries[i].key);
+	}
+
+	free(cache.entries);
+
+	cache.entries = NULL;
+	cache.len = 0;
+	cache.cap = 0;
+}
+
+static void __cache_check(void) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC_FAST, &now);
+
+	if (cache.checked && now.tv_sec - cache.checked_at < CACHE_CHECK_INTERVAL) {
+		return;
+	}
+
+	uint64_t const sig = __kld_sig();
+
+	if (cache.checked && sig != cache.kld_sig) {
+		settings_cache_flush();
+	}
+
+	cache.checked = true;
+	cache.checked_at = now.tv_sec;
+	cache.kld_sig = sig;
+}
+
+static cache_entry_t* __cache_lookup(const char* key, uint32_t hash) {
+	if (!cache.cap) {
+		return NULL;
+	}
+
+	for (size_t i = hash & (cache.cap - 1);; i = (i + 1) & (cache.cap - 1)) {
+		cache_entry_t* const entry = &cache.entries[i];
+
+		if (!entry->key) {
+			return NULL;
+		}
+
+		if (entry->hash == hash && !strcmp(entry->key, key)) {
+			return entry;
 		}
 	}
+}
 
-	else if (privilege == SETTINGS_PRIVILEGE_USER) {
-		return __emit_error("settings_list: Unimplemented privilege level (SETTINGS_PRIVILEGE_USER)", NULL, NULL);
+static cache_entry_t* __cache_slot(cache_entry_t* entries, size_t cap, uint32_t hash) {
+	size_t i = hash & (cap - 1);
+
+	while (entries[i].key) {
+		i = (i + 1) & (cap - 1);
 	}
 
-	else if (privilege == SETTINGS_PRIVILEGE_AQUA) {
-		return __emit_error("settings_list: Unimplemented privilege level (SETTINGS_PRIVILEGE_AQUA)", NULL, NULL);
+	return &entries[i];
+}
+
+// failing to insert isn't an error as such, the setting just won't be cached
+
+static cache_entry_t* __cache_insert(const char* key, uint32_t hash, size_t oid_len, int* oid, const sysctl_fmt_t* fmt) {
+	if (oid_len > sizeof cache.entries->oid) {
+		return NULL;
 	}
 
-	else {
-		return __emit_error("settings_list: Unknown privilege level", NULL, NULL);
+	// keep the load factor under 3/4
+
+	if ((cache.len + 1) * 4 > cache.cap * 3) {
+		size_t const cap = cache.cap ? cache.cap * 2 : CACHE_MIN;
+		cache_entry_t* const entries = calloc(cap, sizeof *entries);
+
+		if (!entries) {
+			return NULL;
+		}
+
+		for (size_t i = 0; i < cache.cap; i++) {
+			if (cache.entries[i].key) {
+				*__cache_slot(entries, cap, cache.entries[i].hash) = cache.entries[i];
+			}
+		}
+
+		free(cache.entries);
+
+		cache.entries = entries;
+		cache.cap = cap;
+	}
+
+	char* const copy = strdup(key);
+
+	if (!copy) {
+		return NULL;
+	}
+
+	cache_entry_t* const entry = __cache_slot(cache.entries, cache.cap, hash);
+
+	entry->key = copy;
+	entry->hash = hash;
+	entry->oid_len = oid_len;
+	entry->fmt = *fmt;
+	entry->len_hint = 0;
+
+	memcpy(entry->oid, oid, oid_len);
+	cache.len++;
+
+	return entry;
+}
+
+static void __cache_remove(cache_entry_t* entry) {
+	free(entry->key);
+
+	// shift back the entries after the hole which would otherwise become unreachable, i.e. those whose home slot isn't between the hole & where they are
+
+	size_t const mask = cache.cap - 1;
+	size_t hole = entry - cache.entries;
+
+	for (size_t i = (hole + 1) & mask; cache.entries[i].key; i = (i + 1) & mask) {
+		size_t const home = cache.entries[i].hash & mask;
+
+		if (((i - home) & mask) >= ((i - hole) & mask)) {
+			cache.entries[hole] = cache.entries[i];
+			hole = i;
+		}
+	}
+
+	memset(&cache.entries[hole], 0, sizeof cache.entries[hole]);
+	cache.len--;
+}
+
+static int __boottime(struct timeval* boottime) {
+	int mib[] = { CTL_KERN, KERN_BOOTTIME };
+	size_t len = sizeof *boottime;
+
+	if (sysctl(mib, 2, boottime, &len, NULL, 0) < 0) {
+		return __emit_error("sysctl(kern.boottime): %s", strerror(errno), NULL);
 	}
 
 	return 0;
 }
 
-static inline setting_t* __search_sysctl(const char* key, settings_privilege_t privilege) {
-	int mib[CTL_MAXNAME];
-	size_t mib_len = sizeof mib;
+int settings_cache_load(const char* path) {
+	FILE* const fp = fopen(path, "r");
 
-	// TODO as the comment in 'sysctl.c' says, don't, please, just don't
+	if (!fp) {
+		if (errno == ENOENT) {
+			return 0;
+		}
 
-	int oid[] = {
-		CTL_SYSCTL,
-		CTL_SYSCTL_NAME2OID,
+		return __emit_error("settings_cache_load: fopen(\"%s\"): %s", (char*) path, strerror(errno));
+	}
+
+	int rv = -1;
+
+	cache_file_header_t header;
+	struct timeval boottime;
+
+	if (fread(&header, sizeof header, 1, fp) != 1 || memcmp(header.magic, CACHE_MAGIC, sizeof header.magic)) {
+		__emit_error("settings_cache_load: \"%s\" is not a settings cache file", (char*) path, NULL);
+		goto done;
+	}
+
+	if (__boottime(&boottime) < 0) {
+		goto done; // error already emitted
+	}
+
+	// a cache file from another boot or from before a module was (un)loaded is stale, which isn't an error
+
+	__cache_check();
+
+	if (header.boottime.tv_sec != boottime.tv_sec || header.boottime.tv_usec != boottime.tv_usec || header.kld_sig != cache.kld_sig) {
+		rv = 0;
+		goto done;
+	}
+
+	for (uint64_t i = 0; i < header.len; i++) {
+		cache_file_entry_t file_entry;
+		char key[BUFSIZ];
+		int oid[CTL_MAXNAME];
+
+		if (
+			fread(&file_entry, sizeof file_entry, 1, fp) != 1 ||
+			file_entry.key_len >= sizeof key || file_entry.oid_len > sizeof oid ||
+			fread(oid, 1, file_entry.oid_len, fp) != file_entry.oid_len ||
+			fread(key, 1, file_entry.key_len, fp) != file_entry.key_len
+		) {
+			__emit_error("settings_cache_load: \"%s\" is truncated or corrupt", (char*) path, NULL);
+			goto done;
+		}
+
+		key[file_entry.key_len] = '\0';
+
+		sysctl_fmt_t const fmt = {
+			.kind = file_entry.kind,
+			.type = file_entry.type,
+		};
+
+		uint32_t const hash = __cache_hash(key);
+
+		if (!__cache_lookup(key, hash)) {
+			__cache_insert(key, hash, file_entry.oid_len, oid, &fmt);
+		}
+	}
+
+	rv = 0;
+
+done:
+
+	fclose(fp);
+	return rv;
+}
+
+int settings_cache_save(const char* path) {
+	// checking the cache may flush it, so only then is it known how many entries will be written
+
+	__cache_check();
+
+	cache_file_header_t header = {
+		.magic = CACHE_MAGIC,
+		.kld_sig = cache.kld_sig,
+		.len = cache.len,
 	};
 
-	if (sysctl(oid, 2, mib, &mib_len, key, strlen(key)) < 0) {
-		__emit_error("sysctl(NAME2OID): %s", strerror(errno), NULL);
-		return NULL;
+	if (__boottime(&header.boottime) < 0) {
+		return -1; // error already emitted
+	}
+
+	// write to a temporary file first & rename it over 'path', so that readers never see a half-written cache
+
+	char* tmp_path;
+
+	if (asprintf(&tmp_path, "%s.XXXXXX", path) < 0) {
+		return __emit_error("settings_cache_save: Failed to allocate temporary path", NULL, NULL);
+	}
+
+	int const fd = mkstemp(tmp_path);
+
+	if (fd < 0) {
+		__emit_error("settings_cache_save: mkstemp(\"%s\"): %s", tmp_path, strerror(errno));
+		free(tmp_path);
+		return -1;
+	}
+
+	FILE* const fp = fdopen(fd, "w");
+	bool ok = fp && fwrite(&header, sizeof header, 1, fp) == 1;
+
+	for (size_t i = 0; ok && i < cache.cap; i++) {
+		cache_entry_t* const entry = &cache.entries[i];
+
+		if (!entry->key) {
+			continue;
+		}
+
+		cache_file_entry_t const file_entry = {
+			.key_len = strlen(entry->key),
+			.oid_len = entry->oid_len,
+			.kind = entry->fmt.kind,
+			.type = entry->fmt.type,
+		};
+
+		ok =
+			fwrite(&file_entry, sizeof file_entry, 1, fp) == 1 &&
+			fwrite(entry->oid, 1, file_entry.oid_len, fp) == file_entry.oid_len &&
+			fwrite(entry->key, 1, file_entry.key_len, fp) == file_entry.key_len;
+	}
+
+	if (fp ? fclose(fp) : close(fd)) {
+		ok = false;
+	}
+
+	if (!ok || rename(tmp_path, path) < 0) {
+		__emit_error("settings_cache_save: Failed to write \"%s\": %s", (char*) path, strerror(errno));
+		unlink(tmp_path);
+		free(tmp_path);
+
+		return -1;
+	}
+
+	free(tmp_path);
+	return 0;
+}
+
+// get the OID & format of the sysctl with key 'key', looking it up in the cache first
+// 'mib' must fit 'CTL_MAXNAME' integers, and 'mib_len_ref' is in bytes
+
+static inline int __resolve_sysctl(const char* key, size_t* mib_len_ref, int* mib, sysctl_fmt_t* fmt_ref) {
+	uint32_t const hash = __cache_hash(key);
+
+	__cache_check();
+	cache_entry_t* entry = __cache_lookup(key, hash);
+
+	size_t mib_len = CTL_MAXNAME * sizeof *mib;
+	sysctl_fmt_t fmt;
+
+	if (entry) {
+		mib_len = entry->oid_len;
+		memcpy(mib, entry->oid, mib_len);
+		fmt = entry->fmt;
+	}
+
+	else {
+		// TODO as the comment in 'sysctl.c' says, don't, please, just don't
+
+		int oid[] = {
+			CTL_SYSCTL,
+			CTL_SYSCTL_NAME2OID,
+		};
+
+		if (sysctl(oid, 2, mib, &mib_len, key, strlen(key)) < 0) {
+			return __emit_error("sysctl(NAME2OID): %s", strerror(errno), NULL);
+		}
+
+		// if (sysctlnametomib(key, oid, &oid_len) < 0) {
+		// 	__emit_error("sysctlnametomib: %s", strerror(errno), NULL);
+		// 	return NULL;
+		// }
+
+		if (__sysctl_fmt(mib_len, mib, &fmt) < 0) {
+			return -1; // error already emitted
+		}
+
+		__cache_insert(key, hash, mib_len, mib, &fmt);
 	}
 
-	// if (sysctlnametomib(key, oid, &oid_len) < 0) {
-	// 	__emit_error("sysctlnametomib: %s", strerror(errno), NULL);
-	// 	return NULL;
-	// }
+	*mib_len_ref = mib_len;
+	*fmt_ref = fmt;
+
+	return 0;
+}
+
+// dynamic sysctls (e.g. under 'dev.' or 'net.') can be removed & registered again with a new OID without any module being loaded or unloaded, so a cached OID can go stale
+// if a sysctl on a setting's OID just failed with ENOENT, look its key up again, and return 1 if the OID changed and the sysctl is worth retrying
+
+static int __refresh_oid(setting_t* setting) {
+	int const err = errno;
+
+	if (err != ENOENT || !setting->__resolved || !setting->key) {
+		return 0;
+	}
+
+	cache_entry_t* const entry = __cache_lookup(setting->key, __cache_hash(setting->key));
+
+	if (entry) {
+		__cache_remove(entry);
+	}
+
+	int mib[CTL_MAXNAME];
+	size_t mib_len;
+	sysctl_fmt_t fmt;
+
+	if (
+		__resolve_sysctl(setting->key, &mib_len, mib, &fmt) < 0 ||
+		(mib_len == setting->oid_len && !memcmp(mib, setting->oid, mib_len))
+	) {
+		errno = err;
+		return 0;
+	}
+
+	// '__resolved' settings have room for 'CTL_MAXNAME' integers
+
+	memcpy(setting->oid, mib, mib_len);
+	setting->oid_len = mib_len;
+
+	setting->writeable = fmt.kind & CTLFLAG_WR;
+	setting->type = fmt.type;
+
+	return 1;
+}
+
+static inline setting_t* __search_sysctl(const char* key, settings_privilege_t privilege) {
+	int mib[CTL_MAXNAME];
+	size_t mib_len;
+	sysctl_fmt_t fmt;
+
+	if (__resolve_sysctl(key, &mib_len, mib, &fmt) < 0) {
+		return NULL; // error already emitted
+	}
 
 	setting_t* setting = calloc(1, sizeof *setting);
 	setting->key = strdup(key);
 
-	if (__sysctl_fill(setting, mib_len, mib, privilege) < 0) {
+	// the OID is given room for 'CTL_MAXNAME' integers, so it can be refreshed in place if it goes stale (see '__refresh_oid')
+
+	int* const oid_buf = malloc(CTL_MAXNAME * sizeof *oid_buf);
+
+	if (!oid_buf) {
+		free(setting->key);
+		free(setting);
+
+		__emit_error("Failed to allocate OID", NULL, NULL);
+		return NULL;
+	}
+
+	if (__sysctl_fill(setting, mib_len, mib, &fmt, privilege, oid_buf) < 0) {
+		free(oid_buf);
 		free(setting);
 		return NULL; // in the case where this is returning NULL because of an error: error already emitted
 	}
 
+	if (!setting->oid) {
+		free(oid_buf);
+	}
+
+	setting->__resolved = !!setting->oid;
+
 	return setting;
 }
 
@@ -372,13 +1103,20 @@ int setting_read(setting_t* setting) {
 
 	setting->len = 0;
 
-	if (sysctl(setting->oid, setting->oid_len / sizeof(int), NULL, &setting->len, NULL, 0) < 0) {
+	if (
+		sysctl(setting->oid, setting->oid_len / sizeof(int), NULL, &setting->len, NULL, 0) < 0 &&
+		(!__refresh_oid(setting) || sysctl(setting->oid, setting->oid_len / sizeof(int), NULL, &setting->len, NULL, 0) < 0)
+	) {
 		return 0;
 	}
 
 	setting->data = malloc(setting->len + 1);
+	setting->__batched = false;
 
-	if (sysctl(setting->oid, setting->oid_len / sizeof(int), setting->data, &setting->len, NULL, 0) < 0) {
+	if (
+		sysctl(setting->oid, setting->oid_len / sizeof(int), setting->data, &setting->len, NULL, 0) < 0 &&
+		(!__refresh_oid(setting) || sysctl(setting->oid, setting->oid_len / sizeof(int), setting->data, &setting->len, NULL, 0) < 0)
+	) {
 		free(setting->data); // preemptively free this guy
 		setting->data = NULL;
 
@@ -388,6 +1126,236 @@ int setting_read(setting_t* setting) {
 	return 0;
 }
 
+// reads for 'settings_read_many' are given twice the length they last had, as 'sysctl(8)' does, and are aligned so that any type can be read out of them
+
+#define READ_MANY_ALIGN sizeof(uint64_t)
+#define READ_MANY_TRIES 3
+
+static inline size_t __read_many_cap(size_t len) {
+	return (len * 2 + 1 + READ_MANY_ALIGN - 1) & ~(READ_MANY_ALIGN - 1);
+}
+
+int settings_read_many(setting_t** settings, size_t settings_len, void** buf_ref) {
+	if (!settings || !buf_ref) {
+		return __emit_error("settings_read_many: Passed references point to NULL", NULL, NULL);
+	}
+
+	*buf_ref = NULL;
+
+	if (!settings_len) {
+		return 0;
+	}
+
+	// figure out how much space each setting needs
+	// the length it had last time, be it from the setting itself or from the cache, is enough to skip asking for it
+
+	size_t* const offs = calloc(settings_len, 2 * sizeof *offs);
+
+	if (!offs) {
+		return __emit_error("settings_read_many: Failed to allocate offsets", NULL, NULL);
+	}
+
+	size_t* const caps = offs + settings_len;
+	size_t total = 0;
+
+	__cache_check();
+
+	for (size_t i = 0; i < settings_len; i++) {
+		setting_t* const setting = settings[i];
+
+		if (!setting->oid) {
+			continue;
+		}
+
+		size_t len = setting->len;
+		cache_entry_t* const entry = setting->key ? __cache_lookup(setting->key, __cache_hash(setting->key)) : NULL;
+
+		if (entry && entry->len_hint > len) {
+			len = entry->len_hint;
+		}
+
+		if (
+			!len &&
+			sysctl(setting->oid, setting->oid_len / sizeof(int), NULL, &len, NULL, 0) < 0 &&
+			(!__refresh_oid(setting) || sysctl(setting->oid, setting->oid_len / sizeof(int), NULL, &len, NULL, 0) < 0)
+		) {
+			len = 0;
+		}
+
+		offs[i] = total;
+		caps[i] = __read_many_cap(len);
+
+		total += caps[i];
+	}
+
+	// read everything into the one buffer
+	// settings which have outgrown their space are given more at the end of it and read again
+
+	uint8_t* buf = NULL;
+	size_t buf_len = 0;
+
+	for (int tries = 0; total > buf_len; tries++) {
+		if (tries == READ_MANY_TRIES) {
+			free(buf);
+			free(offs);
+
+			return __emit_error("settings_read_many: Settings keep growing", NULL, NULL);
+		}
+
+		uint8_t* const new_buf = realloc(buf, total);
+
+		if (!new_buf) {
+			free(buf);
+			free(offs);
+
+			return __emit_error("settings_read_many: Failed to allocate buffer", NULL, NULL);
+		}
+
+		buf = new_buf;
+		size_t const prev_len = buf_len;
+		buf_len = total;
+
+		for (size_t i = 0; i < settings_len; i++) {
+			setting_t* const setting = settings[i];
+
+			// only (re)read the settings which were given space in this round
+
+			if (!setting->oid || offs[i] < prev_len) {
+				continue;
+			}
+
+			size_t len = caps[i] - 1;
+			int rv = sysctl(setting->oid, setting->oid_len / sizeof(int), buf + offs[i], &len, NULL, 0);
+
+			if (rv < 0 && __refresh_oid(setting)) {
+				len = caps[i] - 1;
+				rv = sysctl(setting->oid, setting->oid_len / sizeof(int), buf + offs[i], &len, NULL, 0);
+			}
+
+			if (rv == 0) {
+				buf[offs[i] + len] = '\0';
+				caps[i] = len + 1; // from now on, what's actually used
+				continue;
+			}
+
+			if (errno != ENOMEM) {
+				caps[i] = 0; // couldn't be read, which 'setting_read' doesn't consider an error either
+				continue;
+			}
+
+			if (sysctl(setting->oid, setting->oid_len / sizeof(int), NULL, &len, NULL, 0) < 0) {
+				caps[i] = 0;
+				continue;
+			}
+
+			offs[i] = total;
+			caps[i] = __read_many_cap(len);
+
+			total += caps[i];
+		}
+	}
+
+	// now that the buffer won't be moving anymore, point the settings into it
+
+	for (size_t i = 0; i < settings_len; i++) {
+		setting_t* const setting = settings[i];
+
+		if (!setting->oid) {
+			continue;
+		}
+
+		if (setting->data && !setting->__batched) {
+			free(setting->data);
+		}
+
+		setting->data = caps[i] ? buf + offs[i] : NULL;
+		setting->len = caps[i] ? caps[i] - 1 : 0;
+		setting->__batched = true;
+
+		cache_entry_t* const entry = setting->key ? __cache_lookup(setting->key, __cache_hash(setting->key)) : NULL;
+
+		if (entry) {
+			entry->len_hint = setting->len;
+		}
+	}
+
+	free(offs);
+	*buf_ref = buf;
+
+	return 0;
+}
+
+int settings_read_many_keys(const char* const* keys, size_t keys_len, settings_privilege_t privilege, int user, setting_t** settings_ref, void** buf_ref) {
+	if (!keys || !settings_ref || !buf_ref) {
+		return __emit_error("settings_read_many_keys: Passed references point to NULL", NULL, NULL);
+	}
+
+	*settings_ref = NULL;
+	*buf_ref = NULL;
+
+	if (privilege == SETTINGS_PRIVILEGE_USER) {
+		return __emit_error("settings_read_many_keys: Unimplemented privilege level (SETTINGS_PRIVILEGE_USER)", NULL, NULL);
+	}
+
+	else if (privilege == SETTINGS_PRIVILEGE_AQUA) {
+		return __emit_error("settings_read_many_keys: Unimplemented privilege level (SETTINGS_PRIVILEGE_AQUA)", NULL, NULL);
+	}
+
+	else if (privilege != SETTINGS_PRIVILEGE_BOOT && privilege != SETTINGS_PRIVILEGE_KERN) {
+		return __emit_error("settings_read_many_keys: Unknown privilege level", NULL, NULL);
+	}
+
+	if (!keys_len) {
+		return 0;
+	}
+
+	// the 'setting_t' objects, the array of pointers to them passed on to 'settings_read_many', & their OIDs are all allocated together
+
+	typedef int oid_t[CTL_MAXNAME];
+
+	setting_t* const settings = calloc(keys_len, sizeof *settings + sizeof(setting_t*) + sizeof(oid_t));
+
+	if (!settings) {
+		return __emit_error("settings_read_many_keys: Failed to allocate settings", NULL, NULL);
+	}
+
+	setting_t** const ptrs = (void*) (settings + keys_len);
+	oid_t* const oids = (void*) (ptrs + keys_len);
+
+	for (size_t i = 0; i < keys_len; i++) {
+		setting_t* const setting = &settings[i];
+		ptrs[i] = setting;
+
+		setting->key = (char*) keys[i];
+		setting->__borrowed = true;
+
+		// keys which can't be found are left without an OID, just like settings of another privilege level
+
+		int mib[CTL_MAXNAME];
+		size_t mib_len;
+		sysctl_fmt_t fmt;
+
+		if (__resolve_sysctl(keys[i], &mib_len, mib, &fmt) < 0) {
+			continue;
+		}
+
+		if (__sysctl_fill(setting, mib_len, mib, &fmt, privilege, oids[i]) < 0) {
+			free(settings);
+			return -1; // error already emitted
+		}
+
+		setting->__resolved = !!setting->oid;
+	}
+
+	if (settings_read_many(ptrs, keys_len, buf_ref) < 0) {
+		free(settings);
+		return -1; // error already emitted
+	}
+
+	*settings_ref = settings;
+	return 0;
+}
+
 int setting_write(setting_t* setting, void* data, size_t len, settings_priority_t priority) {
 	return -1; // TODO
 }
@@ -406,23 +1374,35 @@ int setting_free(setting_t* setting) {
 	}
 
 	// general stuff
+	// settings from 'settings_list' have their key & OID in the list's arena (see 'settings_list_free')
+	// data read by 'settings_read_many' is in the caller's buffer
+	// everything freed is reset, as 'settings_list_free' frees each setting in the list again
 
-	if (setting->key) {
+	if (setting->key && !setting->__borrowed) {
 		free(setting->key);
+		setting->key = NULL;
 	}
 
 	if (setting->descr) {
 		free(setting->descr);
+		setting->descr = NULL;
 	}
 
 	if (setting->data) {
-		free(setting->data);
+		if (!setting->__batched) {
+			free(setting->data);
+		}
+
+		setting->data = NULL;
+		setting->__batched = false;
 	}
 
 	// 'sysctl' stuff
 
-	if (setting->oid) {
+	if (setting->oid && !setting->__borrowed) {
 		free(setting->oid);
+		setting->oid = NULL;
+		setting->__resolved = false;
 	}
 
 	return 0;
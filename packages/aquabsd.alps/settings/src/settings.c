@@ -16,7 +16,7 @@ __FBSDID("$FreeBSD$");
 
 static void __dead2 usage(void) {
 	fprintf(stderr,
-		"usage: %1$s [idk yet man lol]\n",
+		"usage: %1$s [idk yet man lol] [prefix]\n",
 	getprogname());
 
 	exit(EXIT_FAILURE);
@@ -31,6 +31,7 @@ typedef struct {
 	// action options
 
 	char* read;
+	char* prefix; // only list settings under this
 
 	// privilege & user options
 
@@ -39,16 +40,18 @@ typedef struct {
 } opts_t;
 
 static int do_list(opts_t* opts) {
-	setting_t** settings;
-	size_t settings_len;
+	// iterate rather than using 'settings_list', so that settings are printed as they're found
 
-	if (settings_list(&settings, &settings_len, opts->privilege, opts->user) < 0) {
-		errx(EXIT_FAILURE, "settings_list: %s", settings_error_str());
+	settings_iter_t* iter = settings_iter_begin_prefix(opts->prefix, opts->privilege, opts->user);
+
+	if (!iter) {
+		errx(EXIT_FAILURE, "settings_iter_begin: %s", settings_error_str());
 	}
 
-	for (int i = 0; i < settings_len; i++) {
-		setting_t* setting = settings[i];
+	setting_t* setting;
+	int rv;
 
+	while ((rv = settings_iter_next(iter, &setting)) > 0) {
 		// if verbose option set, print out setting description too
 
 		if (opts->verbose) {
@@ -62,10 +65,13 @@ static int do_list(opts_t* opts) {
 		else {
 			printf("%s\n", setting->key);
 		}
+	}
 
-		setting_free(setting);
+	if (rv < 0) {
+		errx(EXIT_FAILURE, "settings_iter_next: %s", settings_error_str());
 	}
 
+	settings_iter_end(iter);
 	return 0;
 }
 
@@ -164,6 +170,14 @@ int main(int argc, char* argv[]) {
 	argc -= optind;
 	argv += optind;
 
+	if (argc > 1) {
+		usage();
+	}
+
+	if (argc == 1) {
+		opts.prefix = argv[0];
+	}
+
 	// take action
 
 	int rv = action(&opts);